@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -10,13 +11,33 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 
 #define SERVER_PORT     9000
 #define BUF_SIZE        1024
 #define DEFAULT_BACKLOG 5
+#define DEFAULT_WORKERS 8    // processos do prefork / threads da pool
+#define POOL_QUEUE_SIZE 1024 // ligações aceites à espera de uma thread da pool
+#define MAX_EVENTS      256
 
 //Try code:  netcat 127.0.0.1 9000
 //Etapa 1, mas com graceful exit
+//Build:     gcc -O2 -Wall -pthread -o etapa1 etapa1.c
+//Modelos:   ./etapa1 -m fork|prefork|thread|pool|epoll [-w workers] [-b backlog] [-q]
+//Medir:     ./etapa1_bench -s ./etapa1   (ver etapa1_bench.c)
+
+// Modelo de concorrência escolhido no arranque
+typedef enum {
+    MODEL_FORK,     // um processo por ligação (original)
+    MODEL_PREFORK,  // processos criados no arranque, todos em accept()
+    MODEL_THREAD,   // uma thread por ligação
+    MODEL_POOL,     // thread que aceita + pool fixa de threads
+    MODEL_EPOLL     // um só processo, event loop não bloqueante
+} Model;
+
+int quiet = 0; // -q: sem mensagens por ligação (para medições)
 
 // Function prototypes
 void process_client(int fd);
@@ -25,6 +46,18 @@ void handle_sigchld(int sig);
 int show_main_menu(int client_socket);
 void process_option(int client_socket, int option);
 void send_message(int client_socket, const char *message);
+void send_main_menu(int client_socket);
+int parse_option(int client_socket, char *buffer, int nread);
+int open_listen_socket(int backlog);
+void run_fork(int fd);
+void run_prefork(int fd, int workers);
+void prefork_spawn(int fd);
+int accept_client(int fd);
+void run_thread_per_connection(int fd);
+void run_thread_pool(int fd, int workers);
+void run_epoll(int fd);
+void *client_thread(void *arg);
+void *pool_worker(void *arg);
 
 // Handlers:
 
@@ -66,18 +99,22 @@ void process_option(int client_socket, int option) {
     send_message(client_socket, "\nSessão concluída. Obrigado por utilizar nosso serviço!\n");
     
     // Exibe opcao do cliente, no lado do servidor
-    printf("Cliente escolheu: %s", response);
+    if (!quiet)
+        printf("Cliente escolheu: %s", response);
 }
 
-int show_main_menu(int client_socket) {
-    char buffer[BUF_SIZE];
-    int option1;
-    
-    // Envia o menu principal para o cliente
+// Envia o menu principal para o cliente
+void send_main_menu(int client_socket) {
     send_message(client_socket, "Hello, Welcome!\n");
     send_message(client_socket, "Please select an option:\n");
     send_message(client_socket, "\n1: Engineer\n");
     send_message(client_socket, "2: Organization\n");
+}
+
+int show_main_menu(int client_socket) {
+    char buffer[BUF_SIZE];
+    
+    send_main_menu(client_socket);
     
     // Lê a opção do cliente usando recv
     int nread = recv(client_socket, buffer, BUF_SIZE - 1, 0);
@@ -90,6 +127,13 @@ int show_main_menu(int client_socket) {
         return -1;
     }
     
+    return parse_option(client_socket, buffer, nread);
+}
+
+// Valida a opção recebida (usado pelos modelos bloqueantes e pelo epoll)
+int parse_option(int client_socket, char *buffer, int nread) {
+    int option1;
+    
     buffer[nread] = '\0';  // character end of string
     
     // Verifica se há problemas na string
@@ -112,10 +156,42 @@ int show_main_menu(int client_socket) {
     return option1; // Retorna a opção escolhida
 }
 
-int main() {
-    int fd, client;
-    struct sockaddr_in addr, client_addr;
-    socklen_t client_addr_size;
+int main(int argc, char *argv[]) {
+    int fd;
+    Model model = MODEL_FORK;
+    int workers = DEFAULT_WORKERS;
+    int backlog = DEFAULT_BACKLOG;
+    int c;
+    
+    while ((c = getopt(argc, argv, "m:w:b:q")) != -1) {
+        switch (c) {
+            case 'm':
+                if (strcmp(optarg, "fork") == 0) model = MODEL_FORK;
+                else if (strcmp(optarg, "prefork") == 0) model = MODEL_PREFORK;
+                else if (strcmp(optarg, "thread") == 0) model = MODEL_THREAD;
+                else if (strcmp(optarg, "pool") == 0) model = MODEL_POOL;
+                else if (strcmp(optarg, "epoll") == 0) model = MODEL_EPOLL;
+                else {
+                    fprintf(stderr, "Modelo desconhecido '%s' (fork, prefork, thread, pool, epoll)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                fprintf(stderr, "Uso: %s [-m fork|prefork|thread|pool|epoll] [-w workers] [-b backlog] [-q]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (workers <= 0) workers = DEFAULT_WORKERS;
+    if (backlog <= 0) backlog = DEFAULT_BACKLOG;
     
     // Set up signal handler for child processes
     struct sigaction sa;
@@ -127,6 +203,28 @@ int main() {
         erro("erro ao configurar manipulador de sinal");
     }
     
+    // Nos modelos com threads/epoll um cliente que desaparece não pode matar o servidor
+    signal(SIGPIPE, SIG_IGN);
+    
+    fd = open_listen_socket(backlog);
+    
+    printf("Servidor iniciado na porta %d. À espera de conexões...\n", SERVER_PORT);
+    fflush(stdout);
+    
+    switch (model) {
+        case MODEL_FORK:    run_fork(fd); break;
+        case MODEL_PREFORK: run_prefork(fd, workers); break;
+        case MODEL_THREAD:  run_thread_per_connection(fd); break;
+        case MODEL_POOL:    run_thread_pool(fd, workers); break;
+        case MODEL_EPOLL:   run_epoll(fd); break;
+    }
+    return 0;
+}
+
+int open_listen_socket(int backlog) {
+    int fd;
+    struct sockaddr_in addr;
+    
     // Setup server socket using AF_INET (linux sockets)
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
@@ -144,49 +242,206 @@ int main() {
     if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) //assigns socket to respective address
         erro("erro na funcao bind");
     
-    if (listen(fd, DEFAULT_BACKLOG) < 0)
+    if (listen(fd, backlog) < 0)
         erro("erro na funcao listen");
     
-    printf("Servidor iniciado na porta %d. À espera de conexões...\n", SERVER_PORT);
-    
-    client_addr_size = sizeof(client_addr); //guarda tamanho endereço
-    
- while (1) {
-    // Espera por uma nova conexão
-    client = accept(fd, (struct sockaddr *)&client_addr, &client_addr_size); // aceitar conexao
-    
-    if (client < 0) {
-        if (errno == EINTR)
-            continue; // Foi interrompido por um sinal...
+    return fd;
+}
+
+// Aceita uma ligação, repetindo se for interrompido por um sinal
+int accept_client(int fd) {
+    while (1) {
+        int client = accept(fd, NULL, NULL);
+        if (client >= 0) {
+            if (!quiet)
+                printf("Nova conexão estabelecida\n");
+            return client;
+        }
+        if (errno != EINTR)
+            perror("Erro na função accept");
+    }
+}
+
+// ---- fork: um processo por ligação (modelo original) ----
+void run_fork(int fd) {
+    while (1) {
+        int client = accept_client(fd);
+        
+        if (fork() == 0) {
+            /* Close the server listening socket in the child process.
+            The child process only communicates with its assigned client, connections. This prevents the child from accidentally accepting new clients and avoids file descriptor leaks. */
+            close(fd);
+            
+            /* Process this specific client connection.
+            This function handles all communication with the client
+            including showing menus, receiving selections, and sending responses.
+            The child process dedicates 100% of its resources to this single client. */
+            process_client(client); 
+            if (!quiet)
+                printf("Conexão com cliente encerrada\n");
             
-        perror("Erro na função accept");
-        continue;
+            /* Terminate the child process completely.
+            This ensures the child process exits cleanly after serving its client */
+            exit(0);
+        }
+        
+        /* PARENT PROCESS: Close the client socket in the parent process
+        since it's being handled by the child process */
+        close(client);
+    }
+}
+
+// ---- prefork: processos criados uma vez, todos bloqueados em accept() ----
+void prefork_spawn(int fd) {
+    if (fork() == 0) {
+        while (1) {
+            process_client(accept_client(fd));
+        }
     }
+}
+
+void run_prefork(int fd, int workers) {
+    // O pai recolhe os workers ele próprio para os poder substituir
+    signal(SIGCHLD, SIG_DFL);
     
-    printf("Nova conexão estabelecida\n");
+    for (int i = 0; i < workers; i++)
+        prefork_spawn(fd);
     
-    if (fork() == 0) {
-        /* Close the server listening socket in the child process.
-        The child process only communicates with its assigned client, connections. This prevents the child from accidentally accepting new clients and avoids file descriptor leaks. */
-        close(fd);
-        
-        /* Process this specific client connection.
-        This function handles all communication with the client
-        including showing menus, receiving selections, and sending responses.
-        The child process dedicates 100% of its resources to this single client. */
-        process_client(client); 
-        printf("Conexão com cliente encerrada\n");
+    // O pai só espera; se um worker morrer é substituído
+    while (1) {
+        if (waitpid(-1, NULL, 0) > 0)
+            prefork_spawn(fd);
+        else if (errno != EINTR)
+            erro("erro no waitpid");
+    }
+}
+
+// ---- thread: uma thread nova por ligação ----
+void *client_thread(void *arg) {
+    process_client((int)(intptr_t)arg);
+    return NULL;
+}
+
+void run_thread_per_connection(int fd) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    while (1) {
+        int client = accept_client(fd);
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, client_thread, (void *)(intptr_t)client) != 0) {
+            perror("Erro ao criar thread");
+            close(client);
+        }
+    }
+}
+
+// ---- pool: uma thread aceita e entrega as ligações a threads fixas por uma fila ----
+typedef struct {
+    int fds[POOL_QUEUE_SIZE];
+    int head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} ClientQueue;
+
+ClientQueue queue = { .lock = PTHREAD_MUTEX_INITIALIZER,
+                      .not_empty = PTHREAD_COND_INITIALIZER,
+                      .not_full = PTHREAD_COND_INITIALIZER };
+
+void *pool_worker(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0)
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+        int client = queue.fds[queue.head];
+        queue.head = (queue.head + 1) % POOL_QUEUE_SIZE;
+        queue.count--;
+        pthread_cond_signal(&queue.not_full);
+        pthread_mutex_unlock(&queue.lock);
         
-        /* Terminate the child process completely.
-        This ensures the child process exits cleanly after serving its client */
-        exit(0);
+        process_client(client);
+    }
+    return NULL;
+}
+
+void run_thread_pool(int fd, int workers) {
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, pool_worker, NULL) != 0)
+            erro("erro ao criar thread da pool");
+        pthread_detach(tid);
     }
     
-    /* PARENT PROCESS: Close the client socket in the parent process
-    since it's being handled by the child process */
-    close(client);
+    while (1) {
+        int client = accept_client(fd);
+        
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == POOL_QUEUE_SIZE)
+            pthread_cond_wait(&queue.not_full, &queue.lock);
+        queue.fds[(queue.head + queue.count) % POOL_QUEUE_SIZE] = client;
+        queue.count++;
+        pthread_cond_signal(&queue.not_empty);
+        pthread_mutex_unlock(&queue.lock);
+    }
 }
-return 0;
+
+// ---- epoll: um só processo; o menu é enviado ao aceitar e a resposta quando chega a opção ----
+void run_epoll(int fd) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        erro("erro no epoll_create1");
+    
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        erro("erro no epoll_ctl");
+    
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            erro("erro no epoll_wait");
+        }
+        
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == fd) {
+                // Aceita todas as ligações pendentes
+                int client;
+                while ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    if (!quiet)
+                        printf("Nova conexão estabelecida\n");
+                    send_main_menu(client);
+                    ev.events = EPOLLIN;
+                    ev.data.fd = client;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+                        perror("Erro no epoll_ctl");
+                        close(client);
+                    }
+                }
+                continue;
+            }
+            
+            int client = events[i].data.fd;
+            char buffer[BUF_SIZE];
+            int nread = recv(client, buffer, BUF_SIZE - 1, 0);
+            if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+            
+            if (nread > 0) {
+                int chosen = parse_option(client, buffer, nread);
+                if (chosen != -1) {
+                    process_option(client, chosen);
+                } else {
+                    send_message(client, "Não foi possível processar sua solicitação. Encerrando conexão.\n");
+                }
+            }
+            close(client); // fecha também o registo no epoll
+        }
+    }
 }
 
 void process_client(int client_fd) 
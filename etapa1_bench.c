@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SERVER_PORT     9000
+#define BUF_SIZE        1024
+#define MENU_END        "2: Organization\n"
+
+//Driver de medição para o etapa1.c
+//Build:     gcc -O2 -Wall -pthread -o etapa1_bench etapa1_bench.c
+//Uso:       ./etapa1_bench -s ./etapa1                 (arranca e mede cada modelo)
+//           ./etapa1_bench -m epoll,pool -s ./etapa1   (só alguns modelos)
+//           ./etapa1_bench                             (mede um servidor já a correr)
+//Opções:    -n ligações (10000)  -c clientes concorrentes (32)
+//           -w workers e -b backlog passados ao servidor (8, 128)
+//Cada ligação: connect -> lê o menu -> envia "1" -> lê a resposta até o servidor fechar.
+//A latência é medida desde o início do handshake até ao fecho pelo servidor.
+
+const char *host = "127.0.0.1";
+int total = 10000;
+int concurrency = 32;
+
+int next_conn;      // próxima ligação a fazer (partilhado entre os clientes)
+int failures;
+double *latencies;  // em microssegundos, uma por ligação
+
+// Function prototypes
+double now_us(void);
+int one_connection(double *latency);
+void *client_thread(void *arg);
+int compare_double(const void *a, const void *b);
+void run_benchmark(const char *label);
+pid_t start_server(const char *path, const char *model, const char *workers, const char *backlog);
+void stop_server(pid_t pid);
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Uma sessão completa; devolve 0 se o servidor respondeu e fechou
+int one_connection(double *latency) {
+    struct sockaddr_in addr;
+    char buffer[BUF_SIZE];
+    int got = 0, n;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+
+    double start = now_us();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Lê até ao fim do menu (pode chegar em vários segmentos)
+    while (got < BUF_SIZE - 1) {
+        n = recv(fd, buffer + got, BUF_SIZE - 1 - got, 0);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        got += n;
+        buffer[got] = '\0';
+        if (strstr(buffer, MENU_END))
+            break;
+    }
+
+    if (send(fd, "1\n", 2, 0) != 2) {
+        close(fd);
+        return -1;
+    }
+
+    // A resposta acaba quando o servidor fecha a ligação
+    got = 0;
+    while ((n = recv(fd, buffer, BUF_SIZE, 0)) > 0)
+        got += n;
+    close(fd);
+    if (n < 0 || got == 0)
+        return -1;
+
+    *latency = now_us() - start;
+    return 0;
+}
+
+void *client_thread(void *arg) {
+    while (1) {
+        int i = __atomic_fetch_add(&next_conn, 1, __ATOMIC_RELAXED);
+        if (i >= total)
+            break;
+        if (one_connection(&latencies[i]) < 0) {
+            latencies[i] = -1;
+            __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void run_benchmark(const char *label) {
+    pthread_t threads[concurrency];
+
+    next_conn = 0;
+    failures = 0;
+
+    double start = now_us();
+    for (int i = 0; i < concurrency; i++)
+        pthread_create(&threads[i], NULL, client_thread, NULL);
+    for (int i = 0; i < concurrency; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    // Só as ligações bem sucedidas entram nos percentis (as falhadas ficam a -1 no início)
+    qsort(latencies, total, sizeof(double), compare_double);
+    int ok = total - failures;
+    if (ok == 0) {
+        printf("%-8s  todas as %d ligações falharam\n", label, total);
+        return;
+    }
+    double *valid = latencies + failures;
+
+    printf("%-8s %10.0f %10.0f %10.0f %10.0f %8d\n", label,
+           ok / elapsed,
+           valid[ok / 2],
+           valid[(int)(ok * 0.99) < ok ? (int)(ok * 0.99) : ok - 1],
+           valid[ok - 1],
+           failures);
+    fflush(stdout);
+}
+
+// Arranca o servidor num grupo de processos próprio e espera que aceite ligações
+pid_t start_server(const char *path, const char *model, const char *workers, const char *backlog) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Erro no fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        // O servidor não precisa de escrever para o terminal durante a medição
+        freopen("/dev/null", "w", stdout);
+        execl(path, path, "-q", "-m", model, "-w", workers, "-b", backlog, (char *)NULL);
+        perror("Erro ao executar o servidor");
+        _exit(EXIT_FAILURE);
+    }
+    setpgid(pid, pid);
+
+    // A primeira sessão completa confirma que o servidor já está a aceitar
+    for (int tries = 0; tries < 100; tries++) {
+        double ignored;
+        if (one_connection(&ignored) == 0)
+            return pid;
+        usleep(50000);
+    }
+    fprintf(stderr, "Servidor (%s) não arrancou\n", model);
+    stop_server(pid);
+    exit(EXIT_FAILURE);
+}
+
+// Termina o servidor e todos os processos que criou (prefork/fork)
+void stop_server(pid_t pid) {
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    usleep(100000); // deixa sair os filhos antes do próximo bind
+}
+
+int main(int argc, char *argv[]) {
+    const char *server = NULL;
+    char models[BUF_SIZE] = "fork,prefork,thread,pool,epoll";
+    const char *workers = "8";
+    const char *backlog = "128";
+    int c;
+
+    while ((c = getopt(argc, argv, "s:m:n:c:w:b:h:")) != -1) {
+        switch (c) {
+            case 's': server = optarg; break;
+            case 'm': snprintf(models, sizeof(models), "%s", optarg); break;
+            case 'n': total = atoi(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'w': workers = optarg; break;
+            case 'b': backlog = optarg; break;
+            case 'h': host = optarg; break;
+            default:
+                fprintf(stderr, "Uso: %s [-s ./etapa1] [-m fork,prefork,thread,pool,epoll] [-n ligações] [-c clientes] [-w workers] [-b backlog] [-h host]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (total <= 0 || concurrency <= 0) {
+        fprintf(stderr, "-n e -c têm de ser positivos\n");
+        exit(EXIT_FAILURE);
+    }
+
+    latencies = malloc(total * sizeof(double));
+    if (latencies == NULL) {
+        perror("Erro no malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d ligações, %d clientes concorrentes\n", total, concurrency);
+    printf("%-8s %10s %10s %10s %10s %8s\n", "modelo", "conn/s", "p50(us)", "p99(us)", "max(us)", "falhas");
+
+    if (server == NULL) {
+        run_benchmark("servidor");
+    } else {
+        char *saveptr;
+        for (char *model = strtok_r(models, ",", &saveptr); model; model = strtok_r(NULL, ",", &saveptr)) {
+            pid_t pid = start_server(server, model, workers, backlog);
+            run_benchmark(model);
+            stop_server(pid);
+        }
+    }
+
+    free(latencies);
+    return 0;
+}
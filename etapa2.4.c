@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -12,10 +13,66 @@
 #include <signal.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <ucontext.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+//Build:     gcc -O2 -Wall -pthread -o server etapa2.4.c
+//           gcc -O2 -Wall -pthread -DHAVE_LIBURING -o server etapa2.4.c -luring   (io_uring backend)
+//Try code:  netcat 127.0.0.1 9000
+//Run modes: ./server                  (epoll reactor, default)
+//           ./server -m threads -w 8  (8 reactor threads, SO_REUSEPORT)
+//           ./server -m prefork -w 4 -W 32  (4 to 32 pre-forked worker processes)
+//           ./server -m fork          (one process per connection)
+//           -b epoll|uring picks the reactor I/O backend (uring needs the HAVE_LIBURING build)
+//Stats:     kill -USR1 <pid>          (reactor modes print their statistics)
+//Storage:   accounts and profiles are kept in accounts.db and profiles.db (see the Record store section);
+//           the first start imports credentials.txt, pending.txt, engineers.txt and organizations.txt.
+//           ./server -X export writes the text files from the store, -X import rebuilds the store from them.
+//           Changes are logged to accounts.wal and folded into the store every few seconds
+//           (see the Write-ahead log section); a restart replays what is left of it.
+//           -G us  changes made within this window share one sync of the log (1000, 0 = no wait);
+//           each is acknowledged once it is on disk (see the Storage writer section)
+//Index:     -U accounts the in-memory credentials index is sized for at least (65536)
+//Timeouts:  -t seconds to answer a prompt (30), -T seconds idle in a main menu (900);
+//           sessions that miss their deadline are told so and closed
+//Limits:    -l listen backlog (1024), -c max connections (10000),
+//           -r connections and -a login attempts per minute from one IP address (600, 30; 0 = no limit)
+//           -o KB of replies a reactor client may leave unread (256), then -O disconnect|drop
+//Sockets:   -S comma-separated options, "no" in front turns one off (see the Socket tuning section):
+//           defer[=s] fastopen[=queue] nodelay cork busypoll=us (default: fastopen,nodelay,cork)
+//Restart:   -H path  serve a hot restart socket there; a new build started with the same -H path
+//           takes over the listening sockets, the old one finishes its sessions within -D seconds (30)
+//Commands:  at the login menu a client may send one-line commands instead of menu choices:
+//           LOGIN <user> <password> | LOGOUT | QUIT | VIEW PROFILE | LIST ENGINEERS | LIST ORGANIZATIONS
+//           REGISTER <user> <password> ENGINEER <specialization>|<experience>|<education>|<skills>
+//           REGISTER <user> <password> ORGANIZATION <name>|<industry>|<description>
+//           every response ends with a line that is exactly OK or ERR
+//HTTP:      -P port  also serve read-only JSON there from the reactors (see the HTTP API section):
+//           curl 127.0.0.1:8080/engineers  /organizations  /profile/<user>
+//Admin:     -A path  take batched admin commands on that Unix socket (see the Admin control socket section):
+//           echo "approve alice bob carol" | socat - UNIX-CONNECT:path     (also delete [--type=1|2] ..., pending)
+//Binary:    clients starting with the bytes "\0ENG" 1 speak length-prefixed frames instead
+//           (see the Binary protocol section; etapa2.4_client.h is a C client library for it)
 
 #define SERVER_PORT     9000
 #define BUF_SIZE        1024
-#define DEFAULT_BACKLOG 5
+#define DEFAULT_BACKLOG 1024     // accept queue length (the kernel caps it at net.core.somaxconn)
 #define MAX_USERS       100
 #define MAX_USERNAME_LENGTH 50
 #define MAX_PASSWORD_LENGTH 50
@@ -23,6 +80,67 @@
 #define ENGINEERS_FILE "engineers.txt"
 #define ORGANIZATIONS_FILE "organizations.txt"
 #define PENDING_FILE "pending.txt"
+#define STORE_FILE "accounts.db"     // accounts and profiles (see the Record store section)...
+#define HEAP_FILE "profiles.db"      // ...and the profiles too long for a record
+#define STORE_MAGIC "ENGSTOR"        // first bytes of accounts.db
+#define STORE_VERSION 1
+#define RECORD_SIZE 256              // bytes of a record of accounts.db, and of its header
+#define RECORD_INLINE (RECORD_SIZE - 24 - MAX_USERNAME_LENGTH - MAX_PASSWORD_LENGTH)  // profile bytes a record holds
+#define PROFILE_MAX_LENGTH (BUF_SIZE * 4 - MAX_USERNAME_LENGTH - 2)  // "username|profile" fits a profile line
+#define STORE_BATCH 16               // records a walk over the store reads at a time
+#define WAL_FILE "accounts.wal"      // changes not yet folded into the store (see the Write-ahead log section)
+#define WAL_MAGIC 0x324c4157         // "WAL2", first bytes of every log entry
+#define WAL_COMPACT_BYTES (1 << 20)  // a log this long is folded into the store at once...
+#define WAL_COMPACT_INTERVAL 5       // ...a shorter one after this many seconds
+#define WAL_QUEUE_BYTES (256 * 1024) // changes waiting for the storage writer
+#define WAL_WINDOW_US 1000           // default time the writer lets a batch gather before syncing it
+#define WAL_MAX_REACTORS 256         // reactor threads the writer wakes; tasks of any more block
+#define WAL_FAILED_RUNS 64           // runs of failed changes kept for the waiters that haven't looked yet
+#define MAX_EVENTS      256
+#define URING_ENTRIES   4096     // submission queue size of each io_uring reactor
+#define URING_BUFFERS   1024     // provided receive buffers per ring (power of two)
+#define URING_BUF_GROUP 0
+#define COROUTINE_STACK_SIZE (64 * 1024)  // per dialogue; only the touched pages become resident
+#define STACK_POOL_SIZE 256              // free coroutine stacks kept per reactor thread
+#define PREFORK_MAX_WORKERS 64   // default upper bound of the prefork pool
+#define PREFORK_MIN_SPARE   2    // idle workers kept ready for new clients
+#define PREFORK_MAX_SPARE   8    // idle workers above this are retired
+#define OUTPUT_BUF_SIZE 4096     // replies collected between two reads of a client
+#define INPUT_BUF_SIZE  BUF_SIZE // received bytes not yet consumed as lines
+#define BINARY_MAGIC    "\0ENG"  // first bytes sent by a binary protocol client...
+#define BINARY_MAGIC_LEN 4
+#define BINARY_VERSION  1        // ...followed by the protocol version
+#define BINARY_CHOICE   -2       // show_login_menu(): the client started the binary handshake
+#define PROMPT_TIMEOUT  30       // default seconds to answer a prompt
+#define IDLE_TIMEOUT    (15 * 60)  // default seconds idle in a main menu
+#define TIMER_TICK_MS   1000     // resolution of the timer wheel
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4     // 64^4 ticks ahead at most
+#define TIMEOUT_MESSAGE "\nTimeout: no answer in time, closing connection.\n"
+#define DEFAULT_MAX_CONNECTIONS 10000
+#define CONN_RATE       600      // default new connections per minute from one IP address...
+#define CONN_BURST      100      // ...of which this many may come at once
+#define LOGIN_RATE      30       // default login attempts per minute from one IP address...
+#define LOGIN_BURST     10
+#define ADMISSION_SETS  1024     // per-IP buckets: sets of ADMISSION_WAYS addresses
+#define ADMISSION_WAYS  4
+#define ADMISSION_LOCKS 64
+#define BUSY_MESSAGE    "Server busy, please try again later.\n"
+#define LOGIN_LIMIT_MESSAGE "Too many login attempts, please try again later.\n"
+#define OUTQ_LIMIT_KB   256      // default bytes a reactor client may leave unread, in KB
+#define OUTQ_IOV        16       // queued chunks written per writev()
+#define DEFER_ACCEPT_SECONDS 1   // default wait for the first bytes when defer is enabled
+#define FASTOPEN_QUEUE  256      // default pending Fast Open requests on the listener
+#define DRAIN_TIMEOUT   30       // default seconds an old process may take to finish its sessions
+#define HANDOFF_MAX_FDS 64       // listening sockets passed in one hot restart
+#define HANDOFF_ACK_TIMEOUT 10   // seconds the old process waits for the new one to confirm
+#define INDEX_MIN_USERS (1 << 16)  // accounts the credentials index is sized for at least (-U)
+#define FILTER_COUNTERS_PER_USER 10 // with FILTER_HASHES, about 1% false positives at that many users
+#define FILTER_HASHES 7
+#define SCHED_BUDGET_US 2000     // queued bulk and admin work run per reactor loop iteration
+#define SCHED_SLICE_RECORDS 256  // records a listing sends between two yield points
+#define LATENCY_BUCKETS 27       // latency histogram: bucket i counts requests under 2^i us
 
 // Structure to store user information
 typedef struct {
@@ -33,15 +151,336 @@ typedef struct {
     int is_online;  // 1 if user is online, 0 otherwise
 } User;
 
-// Array to store online users
-User users[MAX_USERS];
-int numUsers = 0;
+// What the credentials index knows about a username
+enum {
+    INDEX_EMPTY = 0,    // unknown (or a free slot)
+    INDEX_ACTIVE,       // an active user of the record store
+    INDEX_PENDING,      // a registration waiting for approval
+    INDEX_DELETED       // slot of a removed user
+};
+
+// State of a record of the store; the credentials index uses the same values
+enum {
+    RECORD_FREE = INDEX_EMPTY,
+    RECORD_ACTIVE = INDEX_ACTIVE,
+    RECORD_PENDING = INDEX_PENDING
+};
+
+// Header of accounts.db, in the room of one record
+typedef struct {
+    char magic[8];              // STORE_MAGIC
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t records;           // records after the header, free ones included
+    uint64_t free_head;         // first free record + 1, 0 when there is none
+    uint64_t free_count;
+    uint64_t heap_size;         // bytes of profiles.db in use
+    uint64_t heap_garbage;      // of those, bytes no record points to any more
+} StoreHeader;
+
+// One user of accounts.db, with the profile (what followed "username|" in
+// engineers.txt or organizations.txt) inside when it fits
+typedef struct {
+    uint8_t state;              // RECORD_*
+    uint8_t user_type;
+    uint16_t profile_len;       // 0 when there is no profile
+    uint32_t reserved;
+    uint64_t next_free;         // free records: the next free record + 1
+    uint64_t heap_offset;       // profile_len > RECORD_INLINE: where it starts in profiles.db
+    char username[MAX_USERNAME_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];
+    char profile[RECORD_INLINE];  // not terminated when it is full
+} Record;
+
+_Static_assert(sizeof(Record) == RECORD_SIZE, "a Record must fill RECORD_SIZE bytes");
+
+// A walk over the records of the store
+typedef struct {
+    long next;                  // record the batch starts at
+    long slot;                  // number of the record store_next() returned last
+    int pos, count;
+    int failed;
+    Record batch[STORE_BATCH];
+} StoreCursor;
+
+// Operations of the write-ahead log
+enum {
+    WAL_REGISTER = 1,           // a new user, active or pending, maybe with a profile
+    WAL_APPROVE,                // a user changes state
+    WAL_DELETE,
+    WAL_PROFILE                 // a user's profile is replaced
+};
+
+// One entry of accounts.wal, followed by profile_len bytes of profile
+typedef struct {
+    uint32_t magic;             // WAL_MAGIC
+    uint32_t crc;               // CRC-32 of what follows it, the profile included
+    uint64_t stamp;             // CLOCK_MONOTONIC ns when the change was made, the store locked
+    uint8_t op;                 // WAL_*
+    uint8_t state;              // RECORD_*: of a new user, or the one a user gets approved to
+    uint8_t user_type;
+    uint8_t reserved;
+    uint16_t profile_len;
+    uint16_t reserved2;
+    char username[MAX_USERNAME_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];  // WAL_REGISTER only
+} WalEntry;
+
+// Where an entry lies in the log, for replaying the entries in the order they were made
+typedef struct {
+    uint64_t stamp;
+    off_t offset;
+} WalPosition;
+
+// Changes a task queued that wal_commit() hasn't waited for: sequence numbers first..last, 0 for none
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+} WalPending;
+
+// Changes waiting for the storage writer, shared by prefork and fork workers.
+// Every change gets the next sequence number; the writer syncs them in order
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued;      // wakes the writer
+    pthread_cond_t room;        // wakes changes waiting for room in data
+    pthread_cond_t durable;     // wakes wal_commit() when a batch is on disk
+    uint64_t next_seq;          // number of the next change, from 1
+    uint64_t durable_seq;       // changes up to this one are on disk (or failed)
+    uint64_t failed_first[WAL_FAILED_RUNS]; // runs of changes that couldn't be made durable,
+    uint64_t failed_last[WAL_FAILED_RUNS];  // run i at i % WAL_FAILED_RUNS, the oldest overwritten
+    long failed_runs;
+    uint64_t failed_forgotten;  // last change of the newest run overwritten so far
+    int64_t first_queued_us;    // when the oldest change in data was queued
+    size_t used;                // bytes of entries in data
+    long appends;
+    long bytes;
+    long batches;               // one write and one fdatasync each
+    long max_batch;             // changes in the largest batch
+    long sync_us;               // time spent writing and syncing batches
+    long store_syncs;           // batches made durable by syncing the store after the log failed
+    long commits;               // wal_commit() calls that waited for a batch
+    long commit_us;             // ...and the time they waited
+    long compactions;
+    long replayed;              // entries read back at startup
+    char data[WAL_QUEUE_BYTES]; // entries as they go to accounts.wal
+} WalQueue;
+
+// Online users, shared by every reactor thread
+typedef struct {
+    User users[MAX_USERS];
+    int numUsers;
+    pthread_mutex_t lock;
+} OnlineUsers;
+
+OnlineUsers online = { .numUsers = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Serializes the changes to the record store between threads and worker
+// processes (it lives in shared memory, see storage_init()); store_lock()
+// keeps out the other process of a hot restart as well
+pthread_mutex_t *storage_lock;
+
+// How connections are served
+typedef enum {
+    MODE_REACTOR,   // single process, epoll event loop
+    MODE_THREADS,   // one epoll event loop per worker thread, SO_REUSEPORT sockets
+    MODE_PREFORK,   // fixed-size pool of worker processes sharing the listening socket
+    MODE_FORK       // one child process per connection
+} ServerMode;
+
+// How a reactor waits for and performs socket I/O
+typedef enum {
+    BACKEND_EPOLL,
+    BACKEND_URING
+} IoBackend;
+
+// What to do with a client whose unread replies reach the limit
+typedef enum {
+    OUTQ_DISCONNECT,
+    OUTQ_DROP                   // keep the connection, lose the reply that does not fit
+} OutQueuePolicy;
+
+#ifdef HAVE_LIBURING
+IoBackend io_backend = BACKEND_URING;
+#else
+IoBackend io_backend = BACKEND_EPOLL;
+#endif
+
+// Deadlines in seconds (-t and -T)
+int prompt_timeout = PROMPT_TIMEOUT;
+int idle_timeout = IDLE_TIMEOUT;
+
+// Limits (-l, -c, -r, -a, -o, -O)
+int listen_backlog = DEFAULT_BACKLOG;
+int max_connections = DEFAULT_MAX_CONNECTIONS;
+int conn_rate = CONN_RATE;
+int login_rate = LOGIN_RATE;
+size_t outq_limit = OUTQ_LIMIT_KB * 1024;
+OutQueuePolicy outq_policy = OUTQ_DISCONNECT;
+
+// Where a reactor session is waiting for input
+typedef enum {
+    ST_LOGIN_MENU,
+    ST_LOGIN_USERNAME,
+    ST_LOGIN_PASSWORD,
+    ST_MAIN_MENU,
+    ST_ADMIN_MENU,
+    ST_DIALOGUE         // input goes to the coroutine running a linear dialogue
+} SessionState;
+
+// How soon a piece of reactor work must be done (see the Latency classes section)
+typedef enum {
+    CLASS_INTERACTIVE,  // prompts, logins, menu choices: handled as soon as they arrive
+    CLASS_ADMIN,        // approve and delete rewrites: after the interactive work at hand
+    CLASS_BULK,         // listings: in slices, after everything else
+    CLASS_COUNT
+} LatencyClass;
+
+// A deadline in a timer wheel slot; next == NULL while it is not scheduled
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer *prev;
+    uint64_t expires;           // tick at which it fires
+    void *data;                 // the session it belongs to
+} Timer;
+
+// Hierarchical timer wheel: level 0 holds the next 64 ticks one per slot, each
+// higher level 64 times coarser. Timers move down a level when their slot comes
+// up, so adding and cancelling are O(1) and a tick only looks at one slot.
+typedef struct {
+    uint64_t now;               // last tick processed
+    long count;                 // timers scheduled
+    int ready;
+    Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // list heads
+} TimerWheel;
+
+// Bytes received from one client, consumed a line at a time (ring buffer)
+typedef struct {
+    int start;                  // first unconsumed byte
+    int len;                    // unconsumed bytes from start, wrapping around
+    char data[INPUT_BUF_SIZE];
+} InputBuffer;
+
+// Part of a reply the socket did not take yet
+typedef struct OutChunk {
+    struct OutChunk *next;
+    size_t len;
+    size_t sent;
+    char data[];
+} OutChunk;
+
+// Replies waiting for a slow reactor client, written on EPOLLOUT
+typedef struct {
+    OutChunk *head;
+    OutChunk *tail;
+    size_t bytes;               // not yet sent
+    int discard;                // over the limit (disconnect policy) or closing: send nothing more
+} OutQueue;
+
+// Everything sent to one client since it last read, written out in one go
+typedef struct {
+    int fd;
+    int len;
+    OutQueue *queue;            // reactor session: written through its queue, never blocks
+    int capture;                // binary protocol: keep handler messages for the response, never send
+    int corked;                 // TCP_CORK holds what was sent of this prompt until it is complete
+    char data[OUTPUT_BUF_SIZE];
+} OutputBuffer;
+
+// A linear dialogue (registration, approve, delete) running on its own small stack
+typedef struct {
+    ucontext_t context;         // the dialogue's own context
+    ucontext_t caller;          // reactor context to return to when it suspends
+    char *stack;                // COROUTINE_STACK_SIZE bytes from the thread's stack pool
+    void (*entry)(int);         // dialogue function, e.g. process_registration
+    int fd;
+    int done;
+    int eof;                    // client went away: receive_string() returns NULL from now on
+    int nread;                  // length of the line in input, -1 when there is none
+    char input[BUF_SIZE];       // last line handed to receive_string(), without its newline
+    OutputBuffer output;        // the dialogue's replies, flushed when it waits for input
+    void *session;              // reactor session it runs for, NULL for none
+    int runnable;               // stopped at a yield point, queued to run again
+    LatencyClass latency_class; // class of the work since its last yield point
+    int64_t queued_us;          // when it was queued at its first yield point, 0 before
+    uint64_t durable_wait;      // parked until the storage writer has synced this change, 0 when not
+    WalPending wal;             // its changes wal_commit() hasn't waited for yet
+    int finishing;              // session_finish_task() runs it: wait in place instead of parking
+} Coroutine;
+
+// HTTP list response that stopped while the client's socket was full
+typedef struct {
+    StoreCursor *cursor;        // where the list goes on, NULL when no list is pending
+    int engineers;              // engineers (1) or organizations (0)
+    int chunked;
+    int keep_alive;
+    int count;                  // records sent so far
+} HttpPending;
+
+// Per-connection state used by the epoll reactor instead of a process stack
+typedef struct Session {
+    int fd;
+    SessionState state;
+    char username[MAX_USERNAME_LENGTH];  // logged in user
+    char password[MAX_PASSWORD_LENGTH];
+    int user_type;
+    int logged_in;
+    Coroutine *dialogue;        // set while state is ST_DIALOGUE
+    struct Session *run_next;   // next session in its run queue
+    int run_queued;             // its dialogue is in a run queue of the thread
+    struct Session *park_next;  // next session whose task waits for the storage writer
+    SessionState after_dialogue;  // menu to show when the dialogue returns
+    int watching_output;        // epoll: registered for EPOLLOUT instead of EPOLLIN
+    OutQueue outq;              // replies the socket did not take yet
+    int closing;                // io_uring: shutdown queued, waiting for the recv to end
+    InputBuffer *input;         // partial line waiting for the rest, NULL when there is none
+    int command_mode;           // client sent a one-line command: no more menus, one response per line
+    int binary;                 // 1 while the binary handshake is arriving, 2 once frames are exchanged
+    int http;                   // accepted on the HTTP port: 1, then 2 once a request was answered
+    HttpPending http_pending;   // list response to finish before the next request
+    Timer timer;                // deadline of the current prompt or menu
+    uint32_t addr;              // client IPv4 address, network byte order
+} Session;
+
+// Token buckets of one client address; tokens are in thousandths
+typedef struct {
+    uint32_t addr;              // 0 while the entry is unused
+    int64_t conn_tokens;
+    int64_t login_tokens;
+    int64_t last_ms;            // when both were last refilled
+} IpBucket;
+
+// Connection limits, in memory shared by every thread and worker process
+typedef struct {
+    pthread_mutex_t locks[ADMISSION_LOCKS];
+    IpBucket buckets[ADMISSION_SETS][ADMISSION_WAYS];
+    long active;                // connections being served
+    long shed_full;             // refused: max connections reached
+    long shed_rate;             // refused: too many connections from the address
+    long shed_login;            // login attempts refused before looking at the files
+} Admission;
 
 // Function prototypes
 void handle_sigchld(int sig);
 void process_client(int client_fd);
 void send_message(int client_socket, const char *message);
-int show_login_menu(int client_socket);
+void send_bytes(int client_socket, const char *data, size_t len);
+void output_begin(int client_socket, OutQueue *queue);
+void outq_send(int client_socket, OutQueue *q, const char *data, size_t len);
+int outq_drain(int client_socket, OutQueue *q);
+void outq_free(OutQueue *q);
+void print_outq_stats(void);
+void print_memory_stats(void);
+int parse_socket_tuning(const char *list);
+void tune_listen_socket(int fd);
+void tune_client_socket(int fd);
+int socket_cork(int fd, int on);
+void print_socket_tuning(void);
+void output_flush(OutputBuffer *out);
+void output_flush_partial(OutputBuffer *out);
+void output_append(OutputBuffer *out, const char *data, size_t len);
+void output_end(void);
+int show_login_menu(int client_socket, char *line, int size);
 void process_login(int client_socket);
 void process_registration(int client_socket);
 int check_credentials(int client_socket, char *username, char *password);
@@ -49,20 +488,134 @@ void add_user_to_file(char *username, char *password, int user_type);
 void show_main_menu(int client_socket, char *username, int user_type);
 void register_engineer(int client_socket, char *username);
 void register_organization(int client_socket, char *username);
-void list_engineers(int client_socket);
-void list_organizations(int client_socket);
+int list_engineers(int client_socket);
+int list_organizations(int client_socket);
 void view_profile(int client_socket, char *username, int user_type);
 int username_exists(const char *username);
+int active_user_type(const char *username);
+int split_profile(char *line, char **fields, int max);
+int find_profile(int user_type, const char *username, char *line, int size, char **fields, int max);
+int for_each_profile(int user_type, int max, void (*fn)(void *ctx, char **fields), void *ctx);
 void erro(const char *msg);
 char *receive_string(int client_socket);
+int receive_line(int client_socket, char *line, int size);
+void input_reset(InputBuffer *in);
+int input_read(InputBuffer *in, int fd);
+int input_append(InputBuffer *in, const char *data, int n);
+int input_next_line(InputBuffer *in, char *line, int size);
+int input_next_frame(InputBuffer *in, char *scratch, char **body);
+int input_take(InputBuffer *in, char *dest, int n);
+int receive_more(int client_socket);
+int binary_process(Session *s, InputBuffer *in);
+int http_process(Session *s, InputBuffer *in);
+void http_pending_end(Session *s);
+void print_http_stats(void);
 int contains_invalid_chars(const char *input);
 int contains_invalid_file_chars(const char *str);
-void sanitize_filename(char *dest, const char *src, size_t max_len);
 void show_admin_menu(int client_socket, char *username);
 void accept_new_user(int client_socket);
 void delete_user(int client_socket);
 int is_admin(char *username);
-void move_user_from_pending_to_active(const char *username, const char *password, int user_type);
+int move_user_from_pending_to_active(const char *username);
+void add_user_to_online_list(char *username, char *password, int user_type, int client_socket);
+void remove_user_from_online_list(const char *username);
+int is_user_online(const char *username);
+int is_pending_user(const char *username);
+int add_pending_user(int client_socket, const char *username, const char *password, int user_type);
+int save_engineer_profile(int client_socket, const char *username, const char *specialization,
+                          const char *experience, const char *education, const char *skills);
+int save_organization_profile(int client_socket, const char *username, const char *org_name,
+                              const char *industry, const char *description);
+int list_pending_users(int client_socket, User *list, int max);
+int list_active_users(int client_socket, User *list, int max);
+int remove_user(int client_socket, const char *username);
+int remove_user_locked(int client_socket, const char *username);
+void storage_init(void);
+int filter_may_contain(const char *username);
+void filter_add(const char *username);
+void filter_remove(const char *username);
+void filter_false_positive(void);
+int index_find(const char *username, char *password, int *user_type, long *slot);
+void index_put(const char *username, const char *password, int user_type, int state, long slot);
+void store_cursor_init(StoreCursor *c);
+Record *store_next(StoreCursor *c);
+int record_line(const Record *r, char *line, size_t size);
+int user_state(const char *username, char *password, int *user_type, long *slot);
+long store_find(const char *username, Record *r);
+long store_add(const char *username, const char *password, int user_type, int state, const char *profile);
+int store_save_profile(const char *username, int user_type, const char *profile);
+int store_set_state(long slot, const Record *r, int state);
+int store_remove(long slot, const Record *r);
+void wal_append(int op, const char *username, const char *password, int user_type, int state, const char *profile);
+int wal_commit(void);
+int sched_park(uint64_t seq);
+void index_remove(const char *username);
+int64_t monotonic_ms(void);
+int64_t monotonic_us(void);
+void send_login_menu(int client_socket);
+void send_user_menu(int client_socket, int user_type);
+void send_admin_menu(int client_socket);
+void run_fork_server(int fd);
+void run_prefork_server(int fd, int min_workers, int max_workers);
+void run_reactor(int fd, int http_fd);
+void run_epoll_reactor(int fd, int http_fd);
+void run_threaded_reactors(int num_workers);
+int open_listen_socket(int port, int reuse_port);
+void handoff_take_over(void);
+void handoff_ready(int use_thread);
+int take_inherited(int port);
+int inherited_listeners(int port, int *reuse_port);
+int handoff_serve(void);
+void *handoff_thread(void *arg);
+int drain_over(long open);
+void *admin_thread(void *arg);
+void admin_start(void);
+Session *session_open(int client_fd, uint32_t addr, int http);
+void session_close(Session *s);
+void session_enter_login_menu(Session *s);
+void session_enter_menu(Session *s);
+int session_handle_line(Session *s, char *line, int len);
+void sched_yield_point(LatencyClass c);
+int session_start_task(Session *s, void (*task)(int));
+int session_task_pending(Session *s);
+int is_command(const char *line);
+int command_execute(Session *s, char *line);
+int session_process_input(Session *s);
+int session_feed(Session *s, const char *data, int n);
+void session_dialogue_resumed(Session *s);
+void reactor_watch_output(Session *s, int want_output);
+Coroutine *coroutine_start(void (*entry)(int), int fd, OutQueue *queue, void *session);
+void coroutine_resume(Coroutine *co);
+void coroutine_free(Coroutine *co);
+char *coroutine_receive_string(Coroutine *co);
+void coroutine_send_bytes(Coroutine *co, int client_socket, const char *data, size_t len);
+void print_server_stats(void);
+uint64_t timer_ticks(void);
+void timer_wheel_init(TimerWheel *w);
+void timer_add(TimerWheel *w, Timer *t, uint64_t expires);
+void timer_cancel(TimerWheel *w, Timer *t);
+void timer_advance(TimerWheel *w, void (*expire)(Timer *t));
+int timer_wait_ms(TimerWheel *w);
+int session_is_idle(Session *s);
+void session_arm_timer(Session *s);
+void session_timed_out(Session *s);
+void count_timeout(int idle);
+void admission_init(void);
+int admit_connection(int client_socket, uint32_t addr);
+void release_connection(void);
+int admit_login(int client_socket, uint32_t addr);
+uint32_t peer_address(int client_socket);
+void print_admission_stats(void);
+void print_timeout_stats(void);
+void check_stats_request(void);
+extern __thread Coroutine *current_coroutine;
+extern __thread OutputBuffer *current_output;
+extern __thread TimerWheel thread_timers;
+extern __thread int thread_epfd;
+#ifdef HAVE_LIBURING
+int uring_send_bytes(int client_socket, const char *data, size_t len);
+int run_uring_reactor(int fd, int http_fd);
+#endif
 
 
 // Handler to prevent zombie processes
@@ -76,13 +629,40 @@ void erro(const char *msg) {
     exit(EXIT_FAILURE);
 }
 
-// Message sending with error handling
+// Message sending with error handling; collected in the client's output buffer when there is one
 void send_message(int client_socket, const char *message) {
-    ssize_t bytes_sent = send(client_socket, message, strlen(message), 0);
-    if (bytes_sent < 0) {
-        perror("Error sending message");
-    } else if (bytes_sent < strlen(message)) {
-        fprintf(stderr, "Warning: Message sent partially\n");
+    OutputBuffer *out = current_output;
+    
+    if (out == NULL || out->fd != client_socket) {
+        send_bytes(client_socket, message, strlen(message));
+        return;
+    }
+    output_append(out, message, strlen(message));
+}
+
+void send_bytes(int client_socket, const char *data, size_t len) {
+    Coroutine *co = current_coroutine;
+    if (co != NULL) {
+        coroutine_send_bytes(co, client_socket, data, len);
+        return;
+    }
+#ifdef HAVE_LIBURING
+    if (uring_send_bytes(client_socket, data, len)) {
+        return;
+    }
+#endif
+    // Blocking socket: a partial write just means send the rest
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(client_socket, data + sent, len - sent, 0);
+        if (n > 0) {
+            sent += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            perror("Error sending message");
+            return;
+        }
     }
 }
 
@@ -95,33 +675,82 @@ int is_valid_integer(const char *str) {
 }
 
 
-char *receive_string(int client_socket) {
-    static char buffer[BUF_SIZE];
-    memset(buffer, 0, BUF_SIZE);
-
-    int bytes_received = recv(client_socket, buffer, BUF_SIZE - 1, 0);
+// Client of the blocking handlers in this thread (one at a time per thread or process)
+__thread InputBuffer thread_input;
+__thread char thread_line[BUF_SIZE];
+__thread int thread_timeout;          // seconds the next read may wait
+__thread int thread_timeout_applied;  // SO_RCVTIMEO currently set on the client socket
+__thread int thread_timed_out;        // the client missed a deadline: it gets nothing more
+__thread uint32_t thread_client_addr; // for the per-IP login limit
 
-    if (bytes_received == 0) {
+// Next line from the client without its newline; the result is valid until the next call
+char *receive_string(int client_socket) {
+    // Inside a reactor dialogue: suspend until the reactor has input for us
+    if (current_coroutine != NULL) {
+        return coroutine_receive_string(current_coroutine);
+    }
+    
+    int len = receive_line(client_socket, thread_line, sizeof(thread_line));
+    if (len == -1) {
         // Client closed connection
         printf("Client desconnected.\n");
         return NULL;
-    } else if (bytes_received < 0) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            printf("Timeout: client didn't respond in time.\n");
-        } else {
+    } else if (len < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
             perror("Error receiving data from client");
         }
-        return NULL;
+        return NULL;  // a timeout was already reported by receive_more()
     }
+    
+    return thread_line;
+}
 
-    // Remove newline at the end, if exists
-    if (buffer[bytes_received - 1] == '\n') {
-        buffer[bytes_received - 1] = '\0';
-    } else {
-        buffer[bytes_received] = '\0';  // Ensure null termination 
+// Blocking read of the next line; -1 when the client disconnected, -2 on error (errno set).
+// Lines the client sent ahead stay buffered for the following prompts.
+int receive_line(int client_socket, char *line, int size) {
+    int len;
+    
+    while ((len = input_next_line(&thread_input, line, size)) < 0) {
+        int n = receive_more(client_socket);
+        if (n == 0) {
+            return -1;
+        } else if (n < 0) {
+            return -2;
+        }
     }
+    return len;
+}
 
-    return buffer;
+// Wait for more input from a blocking client; returns what recv() did, retrying on EINTR.
+// Waits at most thread_timeout seconds; after a timeout every later read sees end of file.
+int receive_more(int client_socket) {
+    // The kernel keeps the deadline, set again only when it changes
+    if (thread_timeout != thread_timeout_applied) {
+        struct timeval tv = { .tv_sec = thread_timeout, .tv_usec = 0 };
+        if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+            perror("Error setting receive timeout");
+        }
+        thread_timeout_applied = thread_timeout;
+    }
+    
+    // About to wait: the prompt must be out first
+    output_flush(current_output);
+    
+    while (1) {
+        int n = input_read(&thread_input, client_socket);
+        if (n >= 0 || errno != EINTR) {
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                printf("Timeout: client didn't respond in time.\n");
+                count_timeout(thread_timeout == idle_timeout);
+                send_message(client_socket, TIMEOUT_MESSAGE);
+                output_flush(current_output);
+                thread_timed_out = 1;
+                shutdown(client_socket, SHUT_RD);
+                errno = EAGAIN;
+            }
+            return n;
+        }
+    }
 }
 
 //Check if special characters are being used, whent they shouldn't (regular users username)
@@ -147,23 +776,121 @@ int is_admin(char *username) {
     return strcmp(username, "admin") == 0;
 }
 
-int show_login_menu(int client_socket) {
-    char buffer[BUF_SIZE];
+// Mark a user as online in the users list
+void add_user_to_online_list(char *username, char *password, int user_type, int client_socket) {
+    pthread_mutex_lock(&online.lock);
     
-    send_message(client_socket, "\n===== Welcome to Engineering Platform =====\n");
-    send_message(client_socket, "1. Login\n");
-    send_message(client_socket, "2. Register\n");
-    send_message(client_socket, "3. Exit\n");
-    send_message(client_socket, "=======================================\n");
-    send_message(client_socket, "Enter your choice: ");
+    // Check if user is already in the list
+    for (int i = 0; i < online.numUsers; i++) {
+        if (strcmp(online.users[i].username, username) == 0) {
+            online.users[i].is_online = 1;
+            online.users[i].socket_fd = client_socket;
+            pthread_mutex_unlock(&online.lock);
+            return;
+        }
+    }
+    
+    // Add new user to the list, unless we've reached the maximum number of users
+    if (online.numUsers < MAX_USERS) {
+        User *user = &online.users[online.numUsers++];
+        strcpy(user->username, username);
+        strcpy(user->password, password);
+        user->user_type = user_type;
+        user->socket_fd = client_socket;
+        user->is_online = 1;
+    }
+    
+    pthread_mutex_unlock(&online.lock);
+}
+
+void remove_user_from_online_list(const char *username) {
+    pthread_mutex_lock(&online.lock);
+    for (int i = 0; i < online.numUsers; i++) {
+        if (strcmp(online.users[i].username, username) == 0) {
+            online.users[i].is_online = 0;
+            online.users[i].socket_fd = -1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&online.lock);
+}
+
+int is_user_online(const char *username) {
+    int is_online = 0;
+    
+    pthread_mutex_lock(&online.lock);
+    for (int i = 0; i < online.numUsers; i++) {
+        if (strcmp(online.users[i].username, username) == 0 && online.users[i].is_online) {
+            is_online = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&online.lock);
+    return is_online;
+}
+
+// Menu texts, shared by the blocking handlers and the reactor.
+// Each menu is one constant string so it goes out as a single write.
+static const char LOGIN_MENU[] =
+    "\n===== Welcome to Engineering Platform =====\n"
+    "1. Login\n"
+    "2. Register\n"
+    "3. Exit\n"
+    "=======================================\n"
+    "Enter your choice: ";
+
+#define USER_MENU(list_option) \
+    "\n===== Main Menu =====\n" \
+    "1. View Profile\n" \
+    list_option \
+    "3. Start Conversation\n" \
+    "4. View Conversations\n" \
+    "5. Block/Unblock Users\n" \
+    "6. Logout\n" \
+    "Enter your choice: "
+
+static const char ENGINEER_MENU[] = USER_MENU("2. List Organizations\n");
+static const char ORGANIZATION_MENU[] = USER_MENU("2. List Engineers\n");
+
+static const char ADMIN_MENU[] =
+    "\n===== Admin Menu =====\n"
+    "1. View Engineers\n"
+    "2. View Organizations\n"
+    "3. Accept New Users\n"
+    "4. Delete Users\n"
+    "5. Logout\n"
+    "Enter your choice: ";
+
+void send_login_menu(int client_socket) {
+    send_message(client_socket, LOGIN_MENU);
+}
+
+void send_user_menu(int client_socket, int user_type) {
+    send_message(client_socket, user_type == 1 ? ENGINEER_MENU : ORGANIZATION_MENU);
+}
+
+void send_admin_menu(int client_socket) {
+    send_message(client_socket, ADMIN_MENU);
+}
+
+// Returns the menu choice; the whole line is left in line for command detection
+int show_login_menu(int client_socket, char *line, int size) {
+    send_login_menu(client_socket);
     
-    int nread = recv(client_socket, buffer, BUF_SIZE - 1, 0);
-    if (nread <= 0) {
+    // A binary client's handshake starts with a NUL, which no typed answer does
+    if (thread_input.len == 0 && receive_more(client_socket) <= 0) {
         return -1;
     }
+    if (thread_input.data[thread_input.start] == '\0') {
+        return BINARY_CHOICE;
+    }
+    
+    if (receive_line(client_socket, line, size) < 0) {
+        return -1;  // Client disconnected
+    }
     
-    buffer[nread] = '\0';
-    return atoi(buffer);
+    int choice = atoi(line);
+    return choice < 0 ? 0 : choice;
 }
 
 void process_login(int client_socket) {
@@ -190,23 +917,14 @@ void process_login(int client_socket) {
     strncpy(username, input_username, MAX_USERNAME_LENGTH - 1);
     username[MAX_USERNAME_LENGTH - 1] = '\0';  // Ensures null termination
 
+    if (!admit_login(client_socket, thread_client_addr)) {
+        return;
+    }
+
     // Check if the username is in pending status
-    FILE *pending_file = fopen(PENDING_FILE, "r");
-    if (pending_file != NULL) {
-        char line[BUF_SIZE];
-        char pending_username[MAX_USERNAME_LENGTH];
-        
-        while (fgets(line, sizeof(line), pending_file) != NULL) {
-            if (sscanf(line, "%s", pending_username) == 1) {
-                if (strcmp(username, pending_username) == 0) {
-                    fclose(pending_file);
-                    send_message(client_socket, "Your account is pending approval by an administrator.\n");
-                    return;
-                }
-            }
-        }
-        
-        fclose(pending_file);
+    if (is_pending_user(username)) {
+        send_message(client_socket, "Your account is pending approval by an administrator.\n");
+        return;
     }
 
     send_message(client_socket, "Enter password: ");
@@ -248,92 +966,62 @@ int check_credentials(int client_socket, char *username, char *password) {
         return 3;  // 3 = admin user type
     }
     
-    FILE *file = fopen(DATABASE_FILE, "r");
-    if (file == NULL) {
+    char stored_password[MAX_PASSWORD_LENGTH];
+    int stored_type;
+    int state = user_state(username, stored_password, &stored_type, NULL);
+    if (state < 0) {
         send_message(client_socket, "Error opening the credentials file.\n");
-        perror("Error opening DATABASE_FILE");
+        perror("Error reading the record store");
         return 0;
     }
+    return (state == RECORD_ACTIVE && strcmp(password, stored_password) == 0) ? stored_type : 0;
+}
 
-    char line[BUF_SIZE];
-    while (fgets(line, sizeof(line), file) != NULL) {
-        // Remove newline
-        line[strcspn(line, "\n")] = '\0';
-
-        // Create copy to not modify the original
-        char temp_line[BUF_SIZE];
-        strncpy(temp_line, line, sizeof(temp_line));
-        temp_line[sizeof(temp_line) - 1] = '\0';
-
-        // Separate tokens (expect 3 tokens: username, password, type)
-        char *token_username = strtok(temp_line, " ");
-        char *token_password = strtok(NULL, " ");
-        char *token_user_type = strtok(NULL, " ");
-
-        // If you don't have all 3 tokens, ignore the line.
-        if (!token_username || !token_password || !token_user_type) {
-            continue;
-        }
-
-        // Validate if user_type is numeric
-        char *endptr;
-        int user_type = strtol(token_user_type, &endptr, 10);
-        if (*endptr != '\0') {
-            continue;  // Não é um número válido
-        }
+//Check if username already exists, active or pending
+int username_exists(const char *username) {
+    if (!filter_may_contain(username)) {
+        return 0;
+    }
+    int state = user_state(username, NULL, NULL, NULL);
+    if (state == RECORD_FREE) {
+        filter_false_positive();
+    }
+    return state > 0;
+}
 
-        //Compare with the data provided
-        if (strcmp(username, token_username) == 0 && strcmp(password, token_password) == 0) {
-            fclose(file);
-            return user_type;
-        }
+// Type of an active user (1 engineer, 2 organization), 0 when there is none, -1 on error
+int active_user_type(const char *username) {
+    int user_type;
+    int state = user_state(username, NULL, &user_type, NULL);
+    if (state < 0) {
+        return -1;
     }
-if (fclose(file) != 0) {
-        perror("Error closing DATABASE_FILE");
+    return state == RECORD_ACTIVE ? user_type : 0;
+}
+
+// Check if a username is waiting for admin approval
+int is_pending_user(const char *username) {
+    if (!filter_may_contain(username)) {
+        return 0;
     }
-    return 0;  // Autentication failed
+    return user_state(username, NULL, NULL, NULL) == RECORD_PENDING;
 }
 
-//Check if username already exists
-// Function to check credentials should also check pending users
-int username_exists(const char *username) {
-    // First check active users
-    FILE *file = fopen(DATABASE_FILE, "r");
-    if (file != NULL) {
-        char line[BUF_SIZE];
-        char stored_username[MAX_USERNAME_LENGTH];
-        
-        while (fgets(line, sizeof(line), file) != NULL) {
-            if (sscanf(line, "%s", stored_username) == 1) {
-                if (strcmp(username, stored_username) == 0) {
-                    fclose(file);
-                    return 1;  // Username exists in active users
-                }
-            }
-        }
-        
-        fclose(file);
+// Store a new registration as a pending user; it is acknowledged with the
+// profile that follows, whose wal_commit() covers it too
+int add_pending_user(int client_socket, const char *username, const char *password, int user_type) {
+    pthread_mutex_lock(storage_lock);
+    long slot = store_add(username, password, user_type, RECORD_PENDING, NULL);
+    pthread_mutex_unlock(storage_lock);
+    if (slot == -2) {
+        send_message(client_socket, "Username already exists. Please choose another one.\n");
+        return -1;
     }
-    
-    // Then check pending users
-    file = fopen(PENDING_FILE, "r");
-    if (file != NULL) {
-        char line[BUF_SIZE];
-        char stored_username[MAX_USERNAME_LENGTH];
-        
-        while (fgets(line, sizeof(line), file) != NULL) {
-            if (sscanf(line, "%s", stored_username) == 1) {
-                if (strcmp(username, stored_username) == 0) {
-                    fclose(file);
-                    return 1;  // Username exists in pending users
-                }
-            }
-        }
-        
-        fclose(file);
+    if (slot < 0) {
+        send_message(client_socket, "Error in registration. Please try again later.\n");
+        return -1;
     }
-    
-    return 0;  // Username doesn't exist anywhere
+    return 0;
 }
 
 
@@ -370,22 +1058,9 @@ void process_registration(int client_socket) {
     }
 
     // Also check pending file
-    FILE *pending_file = fopen(PENDING_FILE, "r");
-    if (pending_file != NULL) {
-        char line[BUF_SIZE];
-        char stored_username[MAX_USERNAME_LENGTH];
-        
-        while (fgets(line, sizeof(line), pending_file) != NULL) {
-            if (sscanf(line, "%s", stored_username) == 1) {
-                if (strcmp(username, stored_username) == 0) {
-                    fclose(pending_file);
-                    send_message(client_socket, "Username already pending approval. Please choose another one.\n");
-                    return;
-                }
-            }
-        }
-        
-        fclose(pending_file);
+    if (is_pending_user(username)) {
+        send_message(client_socket, "Username already pending approval. Please choose another one.\n");
+        return;
     }
 
     send_message(client_socket, "Enter new password: ");
@@ -427,24 +1102,10 @@ void process_registration(int client_socket) {
         return;
     }
 
-    FILE *file = fopen(PENDING_FILE, "a");
-    if (file == NULL) {
-        printf("Error opening pending file!\n");
-        send_message(client_socket, "Error in registration. Please try again later.\n");
-        return;
-    }
-
-    if (fprintf(file, "%s %s %d\n", username, password, user_type) < 0) {
-        perror("Error writing to pending file");
-        fclose(file);
-        send_message(client_socket, "Error in registration. Please try again later.\n");
+    if (add_pending_user(client_socket, username, password, user_type) < 0) {
         return;
     }
 
-    if (fclose(file) != 0) {
-        perror("Error closing PENDING_FILE");
-    }
-
     // Collect profile information but mark it as pending
     if (user_type == 1) {
         send_message(client_socket, "Complete your engineer profile:\n");
@@ -459,41 +1120,18 @@ void process_registration(int client_socket) {
 }
 
 
-void sanitize_filename(char *dest, const char *src, size_t max_len) {
-    size_t j = 0;
-    for (size_t i = 0; i < strlen(src) && j < max_len - 1; i++) {
-        if (isalnum((unsigned char)src[i]) || src[i] == '_') {
-            dest[j++] = src[i];
-        }
-    }
-    dest[j] = '\0';
-}
-
 void add_user_to_file(char *username, char *password, int user_type) {
     if (contains_invalid_file_chars(username) || contains_invalid_file_chars(password)) {
         printf("Error: username ou password contains invalid characters.\n");
         return;
     }
 
-    FILE *file = fopen(DATABASE_FILE, "a");
-    if (file == NULL) {
-        printf("Error opening file!\n");
-        return;
-    }
-
-    if (fprintf(file, "%s %s %d\n", username, password, user_type) < 0) {
-        perror("Error writing to credentials file");
-        fclose(file);
-        return;
-    }
-
-    if (fclose(file) != 0) {
-        perror("Error closing DATABASE_FILE");
+    pthread_mutex_lock(storage_lock);
+    long slot = store_add(username, password, user_type, RECORD_ACTIVE, NULL);
+    pthread_mutex_unlock(storage_lock);
+    if (slot >= 0) {
+        wal_commit();
     }
-
-    // Sanitize filename for safe use
-    char safe_username[MAX_USERNAME_LENGTH];
-    sanitize_filename(safe_username, username, sizeof(safe_username));
 }
 
 void register_engineer(int client_socket, char *username) {
@@ -505,11 +1143,13 @@ void register_engineer(int client_socket, char *username) {
 
     send_message(client_socket, "Enter your specialization: ");
     temp = receive_string(client_socket);
+    if (temp == NULL) return;  // client disconnected
     strncpy(specialization, temp, BUF_SIZE);
 
     while (1) {
         send_message(client_socket, "Enter your years of experience: ");
         temp = receive_string(client_socket);
+        if (temp == NULL) return;
 
         if (!is_valid_integer(temp)) {
             send_message(client_socket, "Invalid input. Enter a number.\n");
@@ -529,6 +1169,7 @@ void register_engineer(int client_socket, char *username) {
     while (1) {
         send_message(client_socket, "Enter your education (in years): ");
         temp = receive_string(client_socket);
+        if (temp == NULL) return;
 
         if (!is_valid_integer(temp)) {
             send_message(client_socket, "Education not in years. Try again.\n");
@@ -541,66 +1182,63 @@ void register_engineer(int client_socket, char *username) {
 
     send_message(client_socket, "Enter your skills (comma separated): ");
     temp = receive_string(client_socket);
+    if (temp == NULL) return;
     strncpy(skills, temp, BUF_SIZE);
 
-    // Save engineer profile to file
-    FILE *file = fopen(ENGINEERS_FILE, "a");
-    if (file == NULL) {
-        perror("Error opening engineer profile file");
-        send_message(client_socket, "Error saving engineer profile!\n");
-        return;
-    }
-
-    if (fprintf(file, "%s|%s|%s|%s|%s\n", username, specialization, experience, education, skills) < 0) {
-        perror("Error writing to engineer file");
-        send_message(client_socket, "Error writing engineer profile.\n");
-        fclose(file);
-        return;
-    }
+    save_engineer_profile(client_socket, username, specialization, experience, education, skills);
+}
 
-    if (fclose(file) != 0) {
-        perror("Error closing the engineer file");
+// Save engineer profile in the user's record
+int save_engineer_profile(int client_socket, const char *username, const char *specialization,
+                          const char *experience, const char *education, const char *skills) {
+    char profile[BUF_SIZE * 4];
+    
+    snprintf(profile, sizeof(profile), "%s|%s|%s|%s", specialization, experience, education, skills);
+    if (store_save_profile(username, 1, profile) < 0 || wal_commit() < 0) {
+        send_message(client_socket, "Error saving engineer profile!\n");
+        return -1;
     }
 
     send_message(client_socket, "Engineer profile created successfully!\n");
+    return 0;
 }
 
 void register_organization(int client_socket, char *username) {
     char org_name[BUF_SIZE];
     char industry[BUF_SIZE];
     char description[BUF_SIZE];
+    char *temp;
     
     send_message(client_socket, "Enter organization name: ");
-    strcpy(org_name, receive_string(client_socket));
+    if ((temp = receive_string(client_socket)) == NULL) return;  // client disconnected
+    strcpy(org_name, temp);
     
     send_message(client_socket, "Enter industry: ");
-    strcpy(industry, receive_string(client_socket));
+    if ((temp = receive_string(client_socket)) == NULL) return;
+    strcpy(industry, temp);
     
     send_message(client_socket, "Enter description: ");
-    strcpy(description, receive_string(client_socket));
+    if ((temp = receive_string(client_socket)) == NULL) return;
+    strcpy(description, temp);
     
-    // Save organization profile to file
-    FILE *file = fopen(ORGANIZATIONS_FILE, "a");
-	if (file == NULL) {
-		perror("Error opening organization file");
-		send_message(client_socket, "Error saving organization profile!\n");
-		return;
-	}
-
-	if (fprintf(file, "%s|%s|%s|%s\n", username, org_name, industry, description) < 0) {
-		perror("Error wrinting to organization file");
-		send_message(client_socket, "Error writing organization profile.\n");
-		fclose(file);
-		return;
-	}
-
-	if (fclose(file) != 0) {
-		perror("Error closing organization file");
-	}
+    save_organization_profile(client_socket, username, org_name, industry, description);
+}
 
-send_message(client_socket, "Organization profile created successfully!\n");
+// Save organization profile in the user's record
+int save_organization_profile(int client_socket, const char *username, const char *org_name,
+                              const char *industry, const char *description) {
+    char profile[BUF_SIZE * 4];
+    
+    snprintf(profile, sizeof(profile), "%s|%s|%s", org_name, industry, description);
+    if (store_save_profile(username, 2, profile) < 0 || wal_commit() < 0) {
+        send_message(client_socket, "Error saving organization profile!\n");
+        return -1;
+    }
 
+    send_message(client_socket, "Organization profile created successfully!\n");
+    return 0;
 }
+
 void show_main_menu(int client_socket, char *username, int user_type) {
     int choice = 0;
     char buffer[BUF_SIZE];
@@ -611,27 +1249,16 @@ void show_main_menu(int client_socket, char *username, int user_type) {
     }
     
     while (1) {
-        send_message(client_socket, "\n===== Main Menu =====\n");
-        send_message(client_socket, "1. View Profile\n");
-        
-        if (user_type == 1) { // Engineer
-            send_message(client_socket, "2. List Organizations\n");
-        } else { // Organization
-            send_message(client_socket, "2. List Engineers\n");
-        }
+        send_user_menu(client_socket, user_type);
         
-        send_message(client_socket, "3. Start Conversation\n");
-        send_message(client_socket, "4. View Conversations\n");
-        send_message(client_socket, "5. Block/Unblock Users\n");
-        send_message(client_socket, "6. Logout\n");
-        send_message(client_socket, "Enter your choice: ");
-        
-        int nread = recv(client_socket, buffer, BUF_SIZE - 1, 0);
-        if (nread <= 0) {
+        // Idle in the menu: the longer deadline applies
+        thread_timeout = idle_timeout;
+        int len = receive_line(client_socket, buffer, sizeof(buffer));
+        thread_timeout = prompt_timeout;
+        if (len < 0) {
             break;
         }
         
-        buffer[nread] = '\0';
         choice = atoi(buffer);
         
         switch (choice) {
@@ -657,12 +1284,7 @@ void show_main_menu(int client_socket, char *username, int user_type) {
             case 6:
                 send_message(client_socket, "Logging out...\n");
                 // Update user's online status
-                for (int i = 0; i < numUsers; i++) {
-                    if (strcmp(users[i].username, username) == 0) {
-                        users[i].is_online = 0;
-                        break;
-                    }
-                }
+                remove_user_from_online_list(username);
                 return;
             default:
                 send_message(client_socket, "Invalid choice. Please try again.\n");
@@ -676,20 +1298,15 @@ void show_admin_menu(int client_socket, char *username) {
     char buffer[BUF_SIZE];
     
     while (1) {
-        send_message(client_socket, "\n===== Admin Menu =====\n");
-        send_message(client_socket, "1. View Engineers\n");
-        send_message(client_socket, "2. View Organizations\n");
-        send_message(client_socket, "3. Accept New Users\n");
-        send_message(client_socket, "4. Delete Users\n");
-        send_message(client_socket, "5. Logout\n");
-        send_message(client_socket, "Enter your choice: ");
+        send_admin_menu(client_socket);
         
-        int nread = recv(client_socket, buffer, BUF_SIZE - 1, 0);
-        if (nread <= 0) {
+        thread_timeout = idle_timeout;
+        int len = receive_line(client_socket, buffer, sizeof(buffer));
+        thread_timeout = prompt_timeout;
+        if (len < 0) {
             break;
         }
         
-        buffer[nread] = '\0';
         choice = atoi(buffer);
         
         switch (choice) {
@@ -714,98 +1331,96 @@ void show_admin_menu(int client_socket, char *username) {
     }
 }
 
+// Split a profile file record at '|' into at most max fields, the last one running to the newline
+int split_profile(char *line, char **fields, int max) {
+    char *saveptr;
+    int count = 0;
+    
+    char *token = strtok_r(line, "|", &saveptr);
+    while (token != NULL && count < max) {
+        fields[count++] = token;
+        token = strtok_r(NULL, (count == max - 1) ? "\n" : "|", &saveptr);
+    }
+    for (int i = count; i < max; i++) {
+        fields[i] = "";
+    }
+    return count;
+}
+
+// Find the profile of username among the users of user_type; fields point into line.
+// Returns 1 when found, 0 when not, -1 when the store can't be read.
+int find_profile(int user_type, const char *username, char *line, int size, char **fields, int max) {
+    Record r;
+    long slot = store_find(username, &r);
+    
+    if (slot == -2) {
+        return -1;
+    }
+    if (slot < 0 || r.user_type != user_type || r.profile_len == 0) {
+        return 0;
+    }
+    if (record_line(&r, line, size) < 0) {
+        return -1;
+    }
+    split_profile(line, fields, max);
+    return 1;
+}
+
+// Call fn for every profile of the users of user_type; returns -1 when the store can't be read
+int for_each_profile(int user_type, int max, void (*fn)(void *ctx, char **fields), void *ctx) {
+    StoreCursor c;
+    Record *r;
+    char line[BUF_SIZE * 4];
+    char *fields[max];
+    
+    store_cursor_init(&c);
+    while ((r = store_next(&c)) != NULL) {
+        if (r->state == RECORD_FREE || r->user_type != user_type || r->profile_len == 0) {
+            continue;
+        }
+        if (record_line(r, line, sizeof(line)) == 0 && split_profile(line, fields, max) >= 3) {
+            fn(ctx, fields);
+        }
+    }
+    return c.failed ? -1 : 0;
+}
+
 void view_profile(int client_socket, char *username, int user_type) {
     char profile_info[BUF_SIZE * 4] = {0};
+    char line[BUF_SIZE * 4];
+    char *fields[5];
     sprintf(profile_info, "\n===== Profile Information =====\n");
     sprintf(profile_info + strlen(profile_info), "Username: %s\n", username);
     sprintf(profile_info + strlen(profile_info), "User Type: %s\n", (user_type == 1) ? "Engineer" : "Organization");
     
     if (user_type == 1) {
-        // Get engineer details
-        FILE *file = fopen(ENGINEERS_FILE, "r");
-        if (file == NULL) {
+        // Get engineer details: username|specialization|experience|education|skills
+        int found = find_profile(1, username, line, sizeof(line), fields, 5);
+        if (found < 0) {
             send_message(client_socket, "Error retrieving profile information!\n");
             return;
         }
         
-        char line[BUF_SIZE * 4];
-        char stored_username[MAX_USERNAME_LENGTH];
-        char specialization[BUF_SIZE];
-        char experience[BUF_SIZE];
-        char education[BUF_SIZE];
-        char skills[BUF_SIZE];
-        int found = 0;
-        
-        while (fgets(line, sizeof(line), file) != NULL) {
-            char *token = strtok(line, "|");
-            if (token != NULL && strcmp(token, username) == 0) {
-                strcpy(stored_username, token);
-                
-                token = strtok(NULL, "|");
-                if (token != NULL) strcpy(specialization, token);
-                
-                token = strtok(NULL, "|");
-                if (token != NULL) strcpy(experience, token);
-                
-                token = strtok(NULL, "|");
-                if (token != NULL) strcpy(education, token);
-                
-                token = strtok(NULL, "\n");
-                if (token != NULL) strcpy(skills, token);
-                
-                found = 1;
-                break;
-            }
-        }
-        fclose(file);
-        
         if (found) {
-            sprintf(profile_info + strlen(profile_info), "Specialization: %s\n", specialization);
-            sprintf(profile_info + strlen(profile_info), "Experience: %s years\n", experience);
-            sprintf(profile_info + strlen(profile_info), "Education: %s\n", education);
-            sprintf(profile_info + strlen(profile_info), "Skills: %s\n", skills);
+            sprintf(profile_info + strlen(profile_info), "Specialization: %s\n", fields[1]);
+            sprintf(profile_info + strlen(profile_info), "Experience: %s years\n", fields[2]);
+            sprintf(profile_info + strlen(profile_info), "Education: %s\n", fields[3]);
+            sprintf(profile_info + strlen(profile_info), "Skills: %s\n", fields[4]);
         } else {
             sprintf(profile_info + strlen(profile_info), "No additional profile information found.\n");
         }
     } else {
-        // Get organization details
-        FILE *file = fopen(ORGANIZATIONS_FILE, "r");
-        if (file == NULL) {
+        // Get organization details: username|name|industry|description
+        int found = find_profile(2, username, line, sizeof(line), fields, 4);
+        if (found < 0) {
             send_message(client_socket, "Error retrieving profile information!\n");
             return;
         }
         
-        char line[BUF_SIZE * 4];
-        char stored_username[MAX_USERNAME_LENGTH];
-        char org_name[BUF_SIZE];
-        char industry[BUF_SIZE];
-        char description[BUF_SIZE];
-        int found = 0;
-        
-        while (fgets(line, sizeof(line), file) != NULL) {
-            char *token = strtok(line, "|");
-            if (token != NULL && strcmp(token, username) == 0) {
-                strcpy(stored_username, token);
-                
-                token = strtok(NULL, "|");
-                if (token != NULL) strcpy(org_name, token);
-                
-                token = strtok(NULL, "|");
-                if (token != NULL) strcpy(industry, token);
-                
-                token = strtok(NULL, "\n");
-                if (token != NULL) strcpy(description, token);
-                
-                found = 1;
-                break;
-            }
-        }
-        fclose(file);
-        
         if (found) {
-            sprintf(profile_info + strlen(profile_info), "Organization Name: %s\n", org_name);
-            sprintf(profile_info + strlen(profile_info), "Industry: %s\n", industry);
-            sprintf(profile_info + strlen(profile_info), "Description: %s\n", description);
+            sprintf(profile_info + strlen(profile_info), "Organization Name: %s\n", fields[1]);
+            sprintf(profile_info + strlen(profile_info), "Industry: %s\n", fields[2]);
+            sprintf(profile_info + strlen(profile_info), "Description: %s\n", fields[3]);
         } else {
             sprintf(profile_info + strlen(profile_info), "No additional profile information found.\n");
         }
@@ -814,116 +1429,136 @@ void view_profile(int client_socket, char *username, int user_type) {
     send_message(client_socket, profile_info);
 }
 
-void list_engineers(int client_socket) {
-    FILE *file = fopen(ENGINEERS_FILE, "r");
-    if (file == NULL) {
-        send_message(client_socket, "No engineers found in the system.\n");
+// Text listing built by list_engineers() and list_organizations(), sent a slice at a time
+typedef struct {
+    int fd;
+    char text[BUF_SIZE * 10];
+    int count;
+} ProfileList;
+
+// Listings are bulk work: send what was built every SCHED_SLICE_RECORDS
+// records, or before the text could overflow, and let interactive work run
+void profile_list_slice(ProfileList *list) {
+    if (list->count % SCHED_SLICE_RECORDS != 0 && strlen(list->text) < sizeof(list->text) - BUF_SIZE * 5) {
         return;
     }
+    send_message(list->fd, list->text);
+    list->text[0] = '\0';
+    sched_yield_point(CLASS_BULK);
+}
+
+void add_engineer_line(void *ctx, char **fields) {
+    ProfileList *list = ctx;
+    // Check if user is online
+    int is_online = is_user_online(fields[0]);
     
-    char line[BUF_SIZE * 4];
-    char engineer_list[BUF_SIZE * 10] = {0};
-    int count = 0;
+    sprintf(list->text + strlen(list->text), 
+            "%d. %s - %s (%s years) [%s]\n", 
+            ++list->count, fields[0], fields[1], fields[2], 
+            is_online ? "Online" : "Offline");
+    profile_list_slice(list);
+}
+
+// -1 when the profiles couldn't be read
+int list_engineers(int client_socket) {
+    ProfileList list = { .fd = client_socket, .count = 0 };
     
-    sprintf(engineer_list, "\n===== Available Engineers =====\n");
+    sched_yield_point(CLASS_BULK);  // queue behind the interactive work at hand
+    sprintf(list.text, "\n===== Available Engineers =====\n");
     
-    while (fgets(line, sizeof(line), file) != NULL) {
-        char username[MAX_USERNAME_LENGTH];
-        char specialization[BUF_SIZE];
-        char experience[BUF_SIZE];
-        
-        char *token = strtok(line, "|");
-        if (token != NULL) {
-            strcpy(username, token);
-            
-            token = strtok(NULL, "|");
-            if (token != NULL) strcpy(specialization, token);
-            
-            token = strtok(NULL, "|");
-            if (token != NULL) strcpy(experience, token);
-            
-            // Check if user is online
-            int is_online = 0;
-            for (int i = 0; i < numUsers; i++) {
-                if (strcmp(users[i].username, username) == 0 && users[i].is_online) {
-                    is_online = 1;
-                    break;
-                }
-            }
-            
-            sprintf(engineer_list + strlen(engineer_list), 
-                    "%d. %s - %s (%s years) [%s]\n", 
-                    ++count, username, specialization, experience, 
-                    is_online ? "Online" : "Offline");
-        }
+    // Slices may have gone out before a read failed: say so instead of ending the list as if complete
+    if (for_each_profile(1, 5, add_engineer_line, &list) < 0) {
+        send_message(client_socket, "Error accessing engineer profiles!\n");
+        return -1;
     }
-    fclose(file);
-    
-    if (count == 0) {
+    if (list.count == 0) {
         send_message(client_socket, "No engineers found in the system.\n");
-    } else {
-        send_message(client_socket, engineer_list);
+    } else if (list.text[0] != '\0') {
+        send_message(client_socket, list.text);  // the slices before went out already
     }
+    return 0;
 }
 
-void list_organizations(int client_socket) {
-    FILE *file = fopen(ORGANIZATIONS_FILE, "r");
-    if (file == NULL) {
-        send_message(client_socket, "No organizations found in the system.\n");
-        return;
-    }
+void add_organization_line(void *ctx, char **fields) {
+    ProfileList *list = ctx;
+    // Check if organization is online
+    int is_online = is_user_online(fields[0]);
     
-    char line[BUF_SIZE * 4];
-    char org_list[BUF_SIZE * 10] = {0};
-    int count = 0;
+    sprintf(list->text + strlen(list->text), 
+            "%d. %s - %s [%s]\n", 
+            ++list->count, fields[1], fields[2], 
+            is_online ? "Online" : "Offline");
+    profile_list_slice(list);
+}
+
+int list_organizations(int client_socket) {
+    ProfileList list = { .fd = client_socket, .count = 0 };
     
-    sprintf(org_list, "\n===== Available Organizations =====\n");
+    sched_yield_point(CLASS_BULK);
+    sprintf(list.text, "\n===== Available Organizations =====\n");
     
-    while (fgets(line, sizeof(line), file) != NULL) {
-        char username[MAX_USERNAME_LENGTH];
-        char org_name[BUF_SIZE];
-        char industry[BUF_SIZE];
-        
-        char *token = strtok(line, "|");
-        if (token != NULL) {
-            strcpy(username, token);
-            
-            token = strtok(NULL, "|");
-            if (token != NULL) strcpy(org_name, token);
-            
-            token = strtok(NULL, "|");
-            if (token != NULL) strcpy(industry, token);
-            
-            // Check if organization is online
-            int is_online = 0;
-            for (int i = 0; i < numUsers; i++) {
-                if (strcmp(users[i].username, username) == 0 && users[i].is_online) {
-                    is_online = 1;
-                    break;
-                }
-            }
-            
-            sprintf(org_list + strlen(org_list), 
-                    "%d. %s - %s [%s]\n", 
-                    ++count, org_name, industry, 
-                    is_online ? "Online" : "Offline");
-        }
+    if (for_each_profile(2, 4, add_organization_line, &list) < 0) {
+        send_message(client_socket, "Error accessing organization profiles!\n");
+        return -1;
     }
-    fclose(file);
-    
-    if (count == 0) {
+    if (list.count == 0) {
         send_message(client_socket, "No organizations found in the system.\n");
-    } else {
-        send_message(client_socket, org_list);
+    } else if (list.text[0] != '\0') {
+        send_message(client_socket, list.text);
     }
+    return 0;
+}
+
+// The menus' listings as reactor tasks; an error was reported to the client already
+void list_engineers_task(int client_socket) {
+    list_engineers(client_socket);
+}
+
+void list_organizations_task(int client_socket) {
+    list_organizations(client_socket);
 }
 
 void process_client(int client_fd) {
     int choice;
     int exit_flag = 0;
+    char line[BUF_SIZE];
+    
+    input_reset(&thread_input);
+    output_begin(client_fd, NULL);
+    thread_timeout = prompt_timeout;
+    thread_timeout_applied = 0;  // a new socket has no receive timeout
+    thread_timed_out = 0;
+    thread_client_addr = peer_address(client_fd);
     
-    while (!exit_flag) {
-        choice = show_login_menu(client_fd);
+    while (!exit_flag && !thread_timed_out) {
+        choice = show_login_menu(client_fd, line, sizeof(line));
+        
+        if (choice == BINARY_CHOICE) {
+            Session session = { .fd = client_fd, .binary = 1, .addr = thread_client_addr };
+            while (binary_process(&session, &thread_input) == 0) {
+                thread_timeout = session.logged_in ? idle_timeout : prompt_timeout;
+                if (receive_more(client_fd) <= 0)
+                    break;
+            }
+            
+            if (session.logged_in)
+                remove_user_from_online_list(session.username);
+            break;
+        }
+        
+        if (choice >= 0 && is_command(line)) {
+            // One-line commands from here on, answered without menus
+            Session session = { .fd = client_fd, .command_mode = 1, .addr = thread_client_addr };
+            do {
+                if (command_execute(&session, line) < 0)
+                    break;
+                thread_timeout = session.logged_in ? idle_timeout : prompt_timeout;
+            } while (receive_line(client_fd, line, sizeof(line)) >= 0);
+            
+            if (session.logged_in)
+                remove_user_from_online_list(session.username);
+            break;
+        }
         
         switch (choice) {
             case 1: // Login
@@ -936,82 +1571,25 @@ void process_client(int client_fd) {
                 send_message(client_fd, "Goodbye!\n");
                 exit_flag = 1;
                 break;
+            case -1: // Disconnected, stop so a prefork worker can take the next client
+                exit_flag = 1;
+                break;
             default:
                 send_message(client_fd, "Invalid choice! Please try again.\n");
         }
     }
     
+    output_end();
     close(client_fd);
 }
 
 // Function to accept new users (implementation would depend on pending users mechanism)
 void accept_new_user(int client_socket) {
-    FILE *file = fopen(PENDING_FILE, "r");
-    if (file == NULL) {
-        // If the file doesn't exist, create it
-        file = fopen(PENDING_FILE, "w");
-        if (file == NULL) {
-            send_message(client_socket, "Error accessing pending users!\n");
-            return;
-        }
-        fclose(file);
-        send_message(client_socket, "No pending users to approve.\n");
-        return;
-    }
-    
-    // Check if the file is empty
-    fseek(file, 0, SEEK_END);
-    if (ftell(file) == 0) {
-        fclose(file);
-        send_message(client_socket, "No pending users to approve.\n");
-        return;
-    }
-    rewind(file);
-
     // Create arrays to store pending user information
-    char usernames[MAX_USERS][MAX_USERNAME_LENGTH];
-    char passwords[MAX_USERS][MAX_PASSWORD_LENGTH];
-    int user_types[MAX_USERS];
-    int count = 0;
-    
-    char line[BUF_SIZE];
-    send_message(client_socket, "\n===== Pending Users =====\n");
-    
-    while (fgets(line, sizeof(line), file) != NULL && count < MAX_USERS) {
-        char username[MAX_USERNAME_LENGTH];
-        char password[MAX_PASSWORD_LENGTH];
-        int user_type;
-        
-        // Parse the line
-        if (sscanf(line, "%s %s %d", username, password, &user_type) == 3) {
-            // Skip admin if somehow it got into pending
-            if (strcmp(username, "admin") == 0) {
-                continue;
-            }
-            
-            // Store user info
-            strncpy(usernames[count], username, MAX_USERNAME_LENGTH - 1);
-            usernames[count][MAX_USERNAME_LENGTH - 1] = '\0';
-            
-            strncpy(passwords[count], password, MAX_PASSWORD_LENGTH - 1);
-            passwords[count][MAX_PASSWORD_LENGTH - 1] = '\0';
-            
-            user_types[count] = user_type;
-            
-            // Display user info
-            char user_info[BUF_SIZE];
-            sprintf(user_info, "%d. %s - %s\n", count + 1, username, 
-                    (user_type == 1) ? "Engineer" : "Organization");
-            send_message(client_socket, user_info);
-            
-            count++;
-        }
-    }
-    
-    fclose(file);
+    User pending[MAX_USERS];
+    int count = list_pending_users(client_socket, pending, MAX_USERS);
     
-    if (count == 0) {
-        send_message(client_socket, "No pending users to approve.\n");
+    if (count <= 0) {
         return;
     }
     
@@ -1033,7 +1611,7 @@ void accept_new_user(int client_socket) {
     // Ask for confirmation
     char confirm_msg[BUF_SIZE];
     sprintf(confirm_msg, "Are you sure you want to approve user '%s'? [Y/N]: ", 
-            usernames[selection - 1]);
+            pending[selection - 1].username);
     send_message(client_socket, confirm_msg);
     
     response = receive_string(client_socket);
@@ -1042,115 +1620,80 @@ void accept_new_user(int client_socket) {
         return;
     }
     
-    // Move user from pending to active
-    move_user_from_pending_to_active(usernames[selection - 1], 
-                                     passwords[selection - 1], 
-                                     user_types[selection - 1]);
+    // Move user from pending to active, once the interactive work at hand is done
+    sched_yield_point(CLASS_ADMIN);
+    if (move_user_from_pending_to_active(pending[selection - 1].username) < 0) {
+        send_message(client_socket, "Error accessing user database!\n");
+        return;
+    }
     
     send_message(client_socket, "User successfully approved.\n");
 }
 
-// Function to move a user from pending to active status
-void move_user_from_pending_to_active(const char *username, const char *password, int user_type) {
-    // Add user to credentials file
-    FILE *cred_file = fopen(DATABASE_FILE, "a");
-    if (cred_file == NULL) {
-        perror("Error opening credentials file");
-        return;
-    }
-    
-    fprintf(cred_file, "%s %s %d\n", username, password, user_type);
-    fclose(cred_file);
-    
-    // Remove user from pending file
-    FILE *pending_file = fopen(PENDING_FILE, "r");
-    FILE *temp_file = fopen("temp_pending.txt", "w");
-    
-    if (pending_file == NULL || temp_file == NULL) {
-        if (pending_file) fclose(pending_file);
-        if (temp_file) fclose(temp_file);
-        perror("Error opening files for pending user removal");
-        return;
-    }
+// Show the numbered list of pending users and keep them in list; returns how many were listed
+int list_pending_users(int client_socket, User *list, int max) {
+    StoreCursor c;
+    Record *r;
+    int count = 0;
     
-    char line[BUF_SIZE];
-    while (fgets(line, sizeof(line), pending_file) != NULL) {
-        char current_username[MAX_USERNAME_LENGTH];
-        sscanf(line, "%s", current_username);
-        
-        // If this is not the user we're approving, keep them in the pending file
-        if (strcmp(current_username, username) != 0) {
-            fputs(line, temp_file);
+    store_cursor_init(&c);
+    while (count < max && (r = store_next(&c)) != NULL) {
+        // Skip admin if somehow it got into pending
+        if (r->state != RECORD_PENDING || strcmp(r->username, "admin") == 0) {
+            continue;
+        }
+        if (count == 0) {
+            send_message(client_socket, "\n===== Pending Users =====\n");
         }
+        
+        // Store user info
+        strcpy(list[count].username, r->username);
+        strcpy(list[count].password, r->password);
+        list[count].user_type = r->user_type;
+        
+        // Display user info
+        char user_info[BUF_SIZE];
+        sprintf(user_info, "%d. %s - %s\n", count + 1, r->username, 
+                (r->user_type == 1) ? "Engineer" : "Organization");
+        send_message(client_socket, user_info);
+        
+        count++;
     }
     
-    fclose(pending_file);
-    fclose(temp_file);
+    if (c.failed) {
+        send_message(client_socket, "Error accessing pending users!\n");
+        return -1;
+    }
+    if (count == 0) {
+        send_message(client_socket, "No pending users to approve.\n");
+    }
+    return count;
+}
+
+// Approve a pending user: the state byte of its record changes.
+// Returns once that is on disk; -1 on error
+int move_user_from_pending_to_active(const char *username) {
+    Record r;
+    int ret = 0;
     
-    // Replace original pending file with temp file
-    remove(PENDING_FILE);
-    rename("temp_pending.txt", PENDING_FILE);
+    pthread_mutex_lock(storage_lock);
+    long slot = store_find(username, &r);
+    // Two admins approving the same user: the second finds it active already
+    if (slot == -2 || (slot >= 0 && r.state == RECORD_PENDING && store_set_state(slot, &r, RECORD_ACTIVE) < 0)) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(storage_lock);
+    return (ret < 0) ? -1 : wal_commit();
 }
 
 
 // Function to delete users
 void delete_user(int client_socket) {
     // First display a list of users
-    FILE *file = fopen(DATABASE_FILE, "r");
-    if (file == NULL) {
-        send_message(client_socket, "Error opening user database!\n");
-        return;
-    }
-    
-    char line[BUF_SIZE];
-    char username[MAX_USERNAME_LENGTH];
-    char user_type_str[10];
-    int user_type;
-    int count = 0;
-    
-    // Array to store usernames
-    char usernames[MAX_USERS][MAX_USERNAME_LENGTH];
-    int user_types[MAX_USERS];
-    
-    send_message(client_socket, "\n===== Users List =====\n");
-    
-    while (fgets(line, sizeof(line), file) != NULL && count < MAX_USERS) {
-        // Split the line by spaces
-        char *token = strtok(line, " ");
-        if (token != NULL) {
-            strcpy(username, token);
-            
-            // Skip password
-            token = strtok(NULL, " ");
-            
-            // Get user type
-            token = strtok(NULL, " \n");
-            if (token != NULL) {
-                user_type = atoi(token);
-                
-                // Skip admin user
-                if (strcmp(username, "admin") == 0) {
-                    continue;
-                }
-                
-                // Store username and type
-                strcpy(usernames[count], username);
-                user_types[count] = user_type;
-                
-                // Display user info
-                sprintf(line, "%d. %s - %s\n", count + 1, username, 
-                        (user_type == 1) ? "Engineer" : "Organization");
-                send_message(client_socket, line);
-                
-                count++;
-            }
-        }
-    }
-    
-    fclose(file);
+    User active[MAX_USERS];
+    int count = list_active_users(client_socket, active, MAX_USERS);
     
-    if (count == 0) {
-        send_message(client_socket, "No users found to delete.\n");
+    if (count <= 0) {
         return;
     }
     
@@ -1172,7 +1715,7 @@ void delete_user(int client_socket) {
     // Ask for confirmation
     char confirm_msg[BUF_SIZE];
     sprintf(confirm_msg, "Are you sure you want to delete user '%s'? [Y/N]: ", 
-            usernames[selection - 1]);
+            active[selection - 1].username);
     send_message(client_socket, confirm_msg);
     
     response = receive_string(client_socket);
@@ -1181,203 +1724,6302 @@ void delete_user(int client_socket) {
         return;
     }
     
-    // Delete user from credentials file
-    file = fopen(DATABASE_FILE, "r");
-    FILE *temp = fopen("temp_credentials.txt", "w");
-    
-    if (file == NULL || temp == NULL) {
-        send_message(client_socket, "Error accessing user database!\n");
-        if (file) fclose(file);
-        if (temp) fclose(temp);
-        return;
-    }
-    
-    // Copy all lines except the one to delete
-    while (fgets(line, sizeof(line), file) != NULL) {
-        char current_username[MAX_USERNAME_LENGTH];
-        sscanf(line, "%s", current_username);
-        
-        if (strcmp(current_username, usernames[selection - 1]) != 0) {
-            fputs(line, temp);
-        }
+    sched_yield_point(CLASS_ADMIN);
+    if (remove_user(client_socket, active[selection - 1].username) == 0) {
+        send_message(client_socket, "User successfully deleted.\n");
     }
+}
+
+// Show the numbered list of active users (admin excluded); returns how many were listed
+int list_active_users(int client_socket, User *list, int max) {
+    StoreCursor c;
+    Record *r;
+    char line[BUF_SIZE];
+    int count = 0;
     
-    fclose(file);
-    fclose(temp);
-    
-    // Replace original file with temp file
-    remove(DATABASE_FILE);
-    rename("temp_credentials.txt", DATABASE_FILE);
+    send_message(client_socket, "\n===== Users List =====\n");
     
-    // Also delete from appropriate profile file based on user type
-    if (user_types[selection - 1] == 1) {
-        // Delete engineer profile
-        file = fopen(ENGINEERS_FILE, "r");
-        temp = fopen("temp_engineers.txt", "w");
-        
-        if (file == NULL || temp == NULL) {
-            send_message(client_socket, "Error accessing engineer profiles!\n");
-            if (file) fclose(file);
-            if (temp) fclose(temp);
-            // User is already deleted from credentials file
-            send_message(client_socket, "User deleted, but engineer profile remains.\n");
-            return;
-        }
-        
-        while (fgets(line, sizeof(line), file) != NULL) {
-            char *token = strtok(strdup(line), "|");
-            if (token != NULL && strcmp(token, usernames[selection - 1]) != 0) {
-                fputs(line, temp);
-            }
-        }
-        
-        fclose(file);
-        fclose(temp);
-        
-        remove(ENGINEERS_FILE);
-        rename("temp_engineers.txt", ENGINEERS_FILE);
-    } else {
-        // Delete organization profile
-        file = fopen(ORGANIZATIONS_FILE, "r");
-        temp = fopen("temp_organizations.txt", "w");
-        
-        if (file == NULL || temp == NULL) {
-            send_message(client_socket, "Error accessing organization profiles!\n");
-            if (file) fclose(file);
-            if (temp) fclose(temp);
-            // User is already deleted from credentials file
-            send_message(client_socket, "User deleted, but organization profile remains.\n");
-            return;
+    store_cursor_init(&c);
+    while (count < max && (r = store_next(&c)) != NULL) {
+        // Skip admin user
+        if (r->state != RECORD_ACTIVE || strcmp(r->username, "admin") == 0) {
+            continue;
         }
         
-        while (fgets(line, sizeof(line), file) != NULL) {
-            char *token = strtok(strdup(line), "|");
-            if (token != NULL && strcmp(token, usernames[selection - 1]) != 0) {
-                fputs(line, temp);
-            }
-        }
+        // Store username and type
+        strcpy(list[count].username, r->username);
+        list[count].user_type = r->user_type;
         
-        fclose(file);
-        fclose(temp);
+        // Display user info
+        sprintf(line, "%d. %s - %s\n", count + 1, r->username, 
+                (r->user_type == 1) ? "Engineer" : "Organization");
+        send_message(client_socket, line);
         
-        remove(ORGANIZATIONS_FILE);
-        rename("temp_organizations.txt", ORGANIZATIONS_FILE);
+        count++;
     }
     
-    send_message(client_socket, "User successfully deleted.\n");
+    if (c.failed) {
+        send_message(client_socket, "Error opening user database!\n");
+        return -1;
+    }
+    if (count == 0) {
+        send_message(client_socket, "No users found to delete.\n");
+    }
+    return count;
 }
 
-// Function to create the admin user in the credentials file
-void create_admin_user() {
-    // Check if admin already exists
-    FILE *file = fopen(DATABASE_FILE, "r");
-    if (file != NULL) {
-        char line[BUF_SIZE];
-        while (fgets(line, sizeof(line), file) != NULL) {
-            char username[MAX_USERNAME_LENGTH];
-            sscanf(line, "%s", username);
-            if (strcmp(username, "admin") == 0) {
-                fclose(file);
-                return; // Admin already exists
-            }
-        }
-        fclose(file);
+// Remove an active user, its profile with it: the record goes back on the free list.
+// Returns once that is on disk; -1 on error
+int remove_user(int client_socket, const char *username) {
+    pthread_mutex_lock(storage_lock);
+    int result = remove_user_locked(client_socket, username);
+    pthread_mutex_unlock(storage_lock);
+    if (result == 0 && wal_commit() < 0) {
+        send_message(client_socket, "Error accessing user database!\n");
+        return -1;
     }
+    return result;
+}
+
+// remove_user() with storage_lock held; a name that isn't an active user is left alone
+int remove_user_locked(int client_socket, const char *username) {
+    Record r;
+    long slot = store_find(username, &r);
     
-    // Add admin user
-    file = fopen(DATABASE_FILE, "a");
-    if (file == NULL) {
-        perror("Error opening credentials file");
-        return;
+    if (slot == -2 || (slot >= 0 && r.state == RECORD_ACTIVE && store_remove(slot, &r) < 0)) {
+        send_message(client_socket, "Error accessing user database!\n");
+        return -1;
     }
-    
-    fprintf(file, "admin admin 3\n");
-    fclose(file);
-    printf("Admin user created successfully.\n");
+    return 0;
 }
 
-int main() {
-    int fd, client;
-    struct sockaddr_in addr, client_addr;
-    socklen_t client_addr_size;
-    
-    // Set up signal handler for child processes
-    struct sigaction sa;
-    sa.sa_handler = &handle_sigchld;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+// The storage lock must also hold across the processes of prefork and fork
+void storage_init(void) {
+    storage_lock = mmap(NULL, sizeof(pthread_mutex_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (storage_lock == MAP_FAILED)
+        erro("error creating storage lock");
     
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        erro("Error setting up signal handler");
-    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(storage_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Function to create the admin user in the record store
+void create_admin_user() {
+    Record r;
     
-    // Create initial files if they don't exist
-    FILE *credential_file = fopen(DATABASE_FILE, "a+");
-    if (credential_file != NULL) {
-        fclose(credential_file);
+    // Check if admin already exists
+    if (store_find("admin", &r) != -1) {
+        return;
     }
     
-    FILE *engineers_file = fopen(ENGINEERS_FILE, "a+");
-    if (engineers_file != NULL) {
-        fclose(engineers_file);
+    // Add admin user
+    if (store_add("admin", "admin", 3, RECORD_ACTIVE, NULL) >= 0 && wal_commit() == 0) {
+        printf("Admin user created successfully.\n");
     }
-    
-    FILE *organizations_file = fopen(ORGANIZATIONS_FILE, "a+");
-    if (organizations_file != NULL) {
-        fclose(organizations_file);
+}
+
+// ===================== Record store =====================
+// Accounts and profiles live in two binary files instead of the four text
+// files. accounts.db is a header followed by fixed-size records, one per
+// active or pending user and found by number (the credentials index keeps
+// each user's record number). Approving a user rewrites one byte of its
+// record; deleting one clears the record and pushes it on a free list,
+// where the next registration finds it. No operation copies a file any more.
+//
+// A profile that fits stays inside its record. A longer one goes to
+// profiles.db, a heap that is only appended to; the bytes a deleted profile
+// leaves behind are counted as garbage until an export and import (-X)
+// writes the store anew.
+//
+// Writers hold storage_lock and, so that the old and the new process of a
+// hot restart don't hand out the same record, an flock() on accounts.db.
+// Readers take no lock. Every change is logged once its records are
+// written (see the Write-ahead log section), and the files here are only
+// synced when the log is folded into them. At startup the record count is
+// taken from the file size and the free list is rebuilt, so a crash between
+// writing a record and writing the header loses nothing; then the log is
+// replayed. The first start without accounts.db imports the text files.
+
+int store_fd = -1;
+int heap_fd = -1;
+
+// All of len bytes at offset; -1 on error or at the end of the file
+int store_pread(int fd, void *data, size_t len, off_t offset) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
     }
-    
-	FILE *pending_file = fopen(PENDING_FILE, "a+");
-    if (pending_file != NULL) {
-        fclose(pending_file);
+    return 0;
+}
+
+int store_pwrite(int fd, const void *data, size_t len, off_t offset) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+        offset += n;
     }
-    
-    // Create admin user
-    create_admin_user();
-    
-    // Setup server socket
+    return 0;
+}
+
+off_t record_offset(long slot) {
+    return (off_t)(slot + 1) * RECORD_SIZE;  // the header takes the first record's room
+}
+
+int store_header_read(StoreHeader *h) {
+    return store_pread(store_fd, h, sizeof(StoreHeader), 0);
+}
+
+int store_header_write(const StoreHeader *h) {
+    return store_pwrite(store_fd, h, sizeof(StoreHeader), 0);
+}
+
+int store_read(long slot, Record *r) {
+    if (store_pread(store_fd, r, sizeof(Record), record_offset(slot)) < 0) {
+        return -1;
+    }
+    r->username[MAX_USERNAME_LENGTH - 1] = '\0';
+    r->password[MAX_PASSWORD_LENGTH - 1] = '\0';
+    return 0;
+}
+
+int store_write(long slot, const Record *r) {
+    return store_pwrite(store_fd, r, sizeof(Record), record_offset(slot));
+}
+
+void store_lock(void) {
+    while (flock(store_fd, LOCK_EX) < 0 && errno == EINTR) {
+    }
+}
+
+void store_unlock(void) {
+    flock(store_fd, LOCK_UN);
+}
+
+void store_cursor_init(StoreCursor *c) {
+    c->next = 0;
+    c->pos = 0;
+    c->count = 0;
+    c->failed = 0;
+}
+
+// Next record in file order, free ones included, read STORE_BATCH at a time;
+// NULL at the end, or with c->failed set on error. c->slot is its number
+Record *store_next(StoreCursor *c) {
+    if (c->pos == c->count) {
+        ssize_t n;
+        c->next += c->count;
+        do {
+            n = pread(store_fd, c->batch, sizeof(c->batch), record_offset(c->next));
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            c->failed = 1;
+            return NULL;
+        }
+        c->pos = 0;
+        c->count = n / RECORD_SIZE;  // a record cut short by a crash is left out
+        if (c->count == 0) {
+            return NULL;
+        }
+    }
+    Record *r = &c->batch[c->pos];
+    c->slot = c->next + c->pos++;
+    r->username[MAX_USERNAME_LENGTH - 1] = '\0';
+    r->password[MAX_PASSWORD_LENGTH - 1] = '\0';
+    return r;
+}
+
+// The profile of r into text, terminated; its length, -1 on error
+int record_profile(const Record *r, char *text, size_t size) {
+    size_t len = (r->profile_len < size) ? r->profile_len : size - 1;
+    
+    if (r->profile_len <= RECORD_INLINE) {
+        memcpy(text, r->profile, len);
+    } else if (store_pread(heap_fd, text, len, r->heap_offset) < 0) {
+        return -1;
+    }
+    text[len] = '\0';
+    return len;
+}
+
+// "username|profile", the line the profile files had, for split_profile(); -1 on error
+int record_line(const Record *r, char *line, size_t size) {
+    int n = snprintf(line, size, "%s|", r->username);
+    if (n >= (int)size) {
+        return -1;
+    }
+    return record_profile(r, line + n, size - n) < 0 ? -1 : 0;
+}
+
+// RECORD_ACTIVE or RECORD_PENDING with the user's password, type and record
+// number, RECORD_FREE when there is no such user, -1 on error. The index
+// answers when it can, else the records are read
+int user_state(const char *username, char *password, int *user_type, long *slot) {
+    int state = index_find(username, password, user_type, slot);
+    if (state >= 0) {
+        return state;
+    }
+    
+    StoreCursor c;
+    Record *r;
+    store_cursor_init(&c);
+    while ((r = store_next(&c)) != NULL) {
+        if (r->state != RECORD_FREE && strcmp(r->username, username) == 0) {
+            if (password != NULL) {
+                strcpy(password, r->password);
+            }
+            if (user_type != NULL) {
+                *user_type = r->user_type;
+            }
+            if (slot != NULL) {
+                *slot = c.slot;
+            }
+            return r->state;
+        }
+    }
+    return c.failed ? -1 : RECORD_FREE;
+}
+
+// username's record into r; its number, -1 when there is none, -2 on error
+long store_find(const char *username, Record *r) {
+    long slot;
+    int state = user_state(username, NULL, NULL, &slot);
+    
+    if (state <= 0) {
+        return (state < 0) ? -2 : -1;
+    }
+    if (store_read(slot, r) < 0) {
+        return -2;
+    }
+    return (r->state != RECORD_FREE && strcmp(r->username, username) == 0) ? slot : -1;
+}
+
+// Give r its profile, in the record when it fits, else at the end of the heap; h is updated
+int record_set_profile(StoreHeader *h, Record *r, const char *profile) {
+    size_t len = strlen(profile);
+    
+    if (len > PROFILE_MAX_LENGTH) {
+        len = PROFILE_MAX_LENGTH;
+    }
+    if (r->profile_len > RECORD_INLINE) {
+        h->heap_garbage += r->profile_len;
+    }
+    memset(r->profile, 0, sizeof(r->profile));
+    r->heap_offset = 0;
+    r->profile_len = len;
+    if (len <= RECORD_INLINE) {
+        memcpy(r->profile, profile, len);
+        return 0;
+    }
+    if (store_pwrite(heap_fd, profile, len, h->heap_size) < 0) {
+        return -1;
+    }
+    r->heap_offset = h->heap_size;
+    h->heap_size += len;
+    return 0;
+}
+
+// A new record for username, from the free list or at the end; profile may be NULL.
+// Its number, -1 on error. The store is locked (or not yet open to anyone else)
+long store_apply_add(const char *username, const char *password, int user_type, int state, const char *profile) {
+    StoreHeader h;
+    Record r, old;
+    long slot;
+    
+    if (store_header_read(&h) < 0) {
+        goto failed;
+    }
+    if (h.free_head != 0) {
+        slot = h.free_head - 1;
+        if (store_read(slot, &old) < 0) {
+            goto failed;
+        }
+        h.free_head = old.next_free;
+        h.free_count--;
+    } else {
+        slot = h.records++;
+    }
+    
+    memset(&r, 0, sizeof(r));
+    r.state = state;
+    r.user_type = user_type;
+    snprintf(r.username, sizeof(r.username), "%s", username);
+    snprintf(r.password, sizeof(r.password), "%s", password);
+    // The record before the header: a crash in between leaves a record the next start finds
+    if ((profile != NULL && record_set_profile(&h, &r, profile) < 0) ||
+        store_write(slot, &r) < 0 || store_header_write(&h) < 0) {
+        goto failed;
+    }
+    
+    index_put(username, password, user_type, state, slot);
+    filter_add(username);
+    return slot;
+    
+failed:
+    perror("Error writing the record store");
+    return -1;
+}
+
+// Replace the profile of record slot; the store is locked
+int store_apply_profile(long slot, const char *profile) {
+    StoreHeader h;
+    Record r;
+    
+    if (store_header_read(&h) < 0 || store_read(slot, &r) < 0 ||
+        record_set_profile(&h, &r, profile) < 0 || store_write(slot, &r) < 0 ||
+        store_header_write(&h) < 0) {
+        perror("Error writing the record store");
+        return -1;
+    }
+    return 0;
+}
+
+// Give the user of record slot (r holds it) a new state: one byte is written. The store is locked
+int store_apply_state(long slot, const Record *r, int state) {
+    uint8_t byte = state;
+    
+    if (store_pwrite(store_fd, &byte, 1, record_offset(slot) + offsetof(Record, state)) < 0) {
+        perror("Error writing the record store");
+        return -1;
+    }
+    index_put(r->username, r->password, r->user_type, state, slot);
+    return 0;
+}
+
+// Free record slot (r holds it) with its profile; the store is locked
+int store_apply_remove(long slot, const Record *r) {
+    StoreHeader h;
+    Record freed;
+    
+    if (store_header_read(&h) < 0) {
+        perror("Error reading the record store");
+        return -1;
+    }
+    memset(&freed, 0, sizeof(freed));
+    freed.state = RECORD_FREE;
+    freed.next_free = h.free_head;
+    if (r->profile_len > RECORD_INLINE) {
+        h.heap_garbage += r->profile_len;
+    }
+    h.free_head = slot + 1;
+    h.free_count++;
+    if (store_write(slot, &freed) < 0 || store_header_write(&h) < 0) {
+        perror("Error writing the record store");
+        return -1;
+    }
+    
+    index_remove(r->username);
+    filter_remove(r->username);
+    return 0;
+}
+
+// The operations below queue a log entry (see the Write-ahead log section) for
+// what they changed, still holding the store's locks so the log keeps their
+// order; wal_commit() then waits until it is on disk. storage_lock held
+
+// Add username; its record number, -1 on error, -2 when the name is taken. The
+// caller checked the name earlier, but another session may have registered it since
+long store_add(const char *username, const char *password, int user_type, int state, const char *profile) {
+    Record r;
+    
+    store_lock();
+    long slot = store_find(username, &r);
+    if (slot >= 0) {
+        slot = -2;
+    } else if (slot == -1) {
+        slot = store_apply_add(username, password, user_type, state, profile);
+        if (slot >= 0) {
+            wal_append(WAL_REGISTER, username, password, user_type, state, profile);
+        }
+    } else {
+        slot = -1;
+    }
+    store_unlock();
+    return slot;
+}
+
+// The profile of username, if it is a user of user_type; 0, or -1 when it isn't or on error.
+// Takes storage_lock
+int store_save_profile(const char *username, int user_type, const char *profile) {
+    Record r;
+    int ret = -1;
+    
+    pthread_mutex_lock(storage_lock);
+    store_lock();
+    long slot = store_find(username, &r);
+    if (slot >= 0 && r.user_type == user_type) {
+        ret = store_apply_profile(slot, profile);
+        if (ret == 0) {
+            wal_append(WAL_PROFILE, username, NULL, user_type, r.state, profile);
+        }
+    }
+    store_unlock();
+    pthread_mutex_unlock(storage_lock);
+    return ret;
+}
+
+// Whether record slot still is r, which was read before store_lock(): the
+// other process of a hot restart may have changed it in between
+int store_unchanged(long slot, const Record *r) {
+    Record now;
+    return store_read(slot, &now) == 0 && now.state == r->state && strcmp(now.username, r->username) == 0;
+}
+
+// Approve the user of record slot (r holds it)
+int store_set_state(long slot, const Record *r, int state) {
+    store_lock();
+    int ret = store_unchanged(slot, r) ? store_apply_state(slot, r, state) : -1;
+    if (ret == 0) {
+        wal_append(WAL_APPROVE, r->username, NULL, r->user_type, state, NULL);
+    }
+    store_unlock();
+    return ret;
+}
+
+// Delete the user of record slot (r holds it)
+int store_remove(long slot, const Record *r) {
+    store_lock();
+    int ret = store_unchanged(slot, r) ? store_apply_remove(slot, r) : -1;
+    if (ret == 0) {
+        wal_append(WAL_DELETE, r->username, NULL, r->user_type, RECORD_FREE, NULL);
+    }
+    store_unlock();
+    return ret;
+}
+
+// Users in the store (records that aren't free)
+long store_users(void) {
+    StoreHeader h;
+    return (store_header_read(&h) < 0) ? 0 : (long)(h.records - h.free_count);
+}
+
+// Fresh header for an empty store on store_fd
+int store_create(void) {
+    char block[RECORD_SIZE] = {0};
+    StoreHeader *h = (StoreHeader *)block;
+    
+    memcpy(h->magic, STORE_MAGIC, sizeof(h->magic));
+    h->version = STORE_VERSION;
+    h->record_size = RECORD_SIZE;
+    return (ftruncate(store_fd, 0) < 0 || ftruncate(heap_fd, 0) < 0) ? -1 : store_pwrite(store_fd, block, RECORD_SIZE, 0);
+}
+
+// Count the records from the file size and link the free ones again
+int store_recover(void) {
+    StoreHeader h;
+    struct stat st, heap_st;
+    long *free_slots = NULL;
+    long count = 0, capacity = 0;
+    StoreCursor c;
+    Record *r;
+    
+    if (store_header_read(&h) < 0 || fstat(store_fd, &st) < 0 || fstat(heap_fd, &heap_st) < 0) {
+        return -1;
+    }
+    if (memcmp(h.magic, STORE_MAGIC, sizeof(h.magic)) != 0 || h.version != STORE_VERSION ||
+        h.record_size != RECORD_SIZE) {
+        fprintf(stderr, "%s is not a record store this server can read\n", STORE_FILE);
+        return -1;
+    }
+    
+    // Records may reach the disk before the header and the heap: heap bytes past
+    // heap_size may be a record's, and a profile the heap lost is dropped
+    if ((uint64_t)heap_st.st_size > h.heap_size) {
+        h.heap_size = heap_st.st_size;
+    }
+    store_cursor_init(&c);
+    while ((r = store_next(&c)) != NULL) {
+        if (r->state != RECORD_FREE) {
+            if (r->profile_len > RECORD_INLINE && r->heap_offset + r->profile_len > h.heap_size) {
+                r->profile_len = 0;
+                r->heap_offset = 0;
+                if (store_write(c.slot, r) < 0) {
+                    free(free_slots);
+                    return -1;
+                }
+            }
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            long *grown = realloc(free_slots, capacity * sizeof(long));
+            if (grown == NULL) {
+                free(free_slots);
+                return -1;
+            }
+            free_slots = grown;
+        }
+        free_slots[count++] = c.slot;
+    }
+    if (c.failed) {
+        free(free_slots);
+        return -1;
+    }
+    
+    // Lowest first, so new users fill the holes at the front
+    for (long i = 0; i < count; i++) {
+        uint64_t next = (i + 1 < count) ? free_slots[i + 1] + 1 : 0;
+        if (store_pwrite(store_fd, &next, sizeof(next), record_offset(free_slots[i]) + offsetof(Record, next_free)) < 0) {
+            free(free_slots);
+            return -1;
+        }
+    }
+    h.records = st.st_size / RECORD_SIZE - 1;
+    h.free_head = count ? free_slots[0] + 1 : 0;
+    h.free_count = count;
+    free(free_slots);
+    return store_header_write(&h);
+}
+
+// One account line of credentials.txt or pending.txt, for store_import()
+typedef struct {
+    char username[MAX_USERNAME_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];
+    int user_type;
+    int state;
+    long line;                  // order of the lines, credentials.txt first
+} ImportAccount;
+
+// One line of engineers.txt or organizations.txt
+typedef struct {
+    char *line;                 // "username|profile", the '|' replaced by '\0'
+    int user_type;
+    long order;
+} ImportProfile;
+
+int compare_import_accounts(const void *a, const void *b) {
+    const ImportAccount *x = a, *y = b;
+    int c = strcmp(x->username, y->username);
+    return c ? c : (x->line > y->line) - (x->line < y->line);
+}
+
+int compare_import_lines(const void *a, const void *b) {
+    const ImportAccount *x = a, *y = b;
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+int compare_import_profiles(const void *a, const void *b) {
+    const ImportProfile *x = a, *y = b;
+    int c = strcmp(x->line, y->line);
+    return c ? c : (x->order > y->order) - (x->order < y->order);
+}
+
+// Append the accounts of one text file to *accounts
+int import_accounts(const char *file_name, int state, ImportAccount **accounts, long *count, long *capacity) {
+    FILE *file = fopen(file_name, "r");
+    char line[BUF_SIZE];
+    
+    if (file == NULL) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        ImportAccount a;
+        if (sscanf(line, "%49s %49s %d", a.username, a.password, &a.user_type) != 3) {
+            continue;
+        }
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 1024;
+            ImportAccount *grown = realloc(*accounts, *capacity * sizeof(ImportAccount));
+            if (grown == NULL) {
+                fclose(file);
+                return -1;
+            }
+            *accounts = grown;
+        }
+        a.state = state;
+        a.line = *count;
+        (*accounts)[(*count)++] = a;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Append the profiles of one text file to *profiles
+int import_profiles(const char *file_name, int user_type, ImportProfile **profiles, long *count, long *capacity) {
+    FILE *file = fopen(file_name, "r");
+    char line[BUF_SIZE * 4];
+    
+    if (file == NULL) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        char *bar = strchr(line, '|');
+        if (bar == NULL || bar == line) {
+            continue;
+        }
+        *bar = '\0';
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 1024;
+            ImportProfile *grown = realloc(*profiles, *capacity * sizeof(ImportProfile));
+            if (grown == NULL) {
+                fclose(file);
+                return -1;
+            }
+            *profiles = grown;
+        }
+        size_t len = (bar - line) + 1 + strlen(bar + 1) + 1;
+        ImportProfile p = { .line = malloc(len), .user_type = user_type, .order = *count };
+        if (p.line == NULL) {
+            fclose(file);
+            return -1;
+        }
+        memcpy(p.line, line, len);
+        (*profiles)[(*count)++] = p;
+    }
+    fclose(file);
+    return 0;
+}
+
+// Converter, text files -> store: accounts.db and profiles.db are written anew from
+// credentials.txt, pending.txt, engineers.txt and organizations.txt. A name in both
+// account files stays active; profiles are matched to accounts by name and type
+int store_import(void) {
+    ImportAccount *accounts = NULL;
+    ImportProfile *profiles = NULL;
+    long account_count = 0, account_capacity = 0, profile_count = 0, profile_capacity = 0;
+    long imported[3] = { 0, 0, 0 }, with_profile = 0, skipped = 0;
+    int ret = -1;
+    
+    if (import_accounts(DATABASE_FILE, RECORD_ACTIVE, &accounts, &account_count, &account_capacity) < 0 ||
+        import_accounts(PENDING_FILE, RECORD_PENDING, &accounts, &account_count, &account_capacity) < 0 ||
+        import_profiles(ENGINEERS_FILE, 1, &profiles, &profile_count, &profile_capacity) < 0 ||
+        import_profiles(ORGANIZATIONS_FILE, 2, &profiles, &profile_count, &profile_capacity) < 0) {
+        perror("Error reading the text files");
+        goto done;
+    }
+    
+    // Sorted by name the repeated names are dropped, the first line kept; then back to file order
+    qsort(accounts, account_count, sizeof(ImportAccount), compare_import_accounts);
+    long unique = 0;
+    for (long i = 0; i < account_count; i++) {
+        if (unique > 0 && strcmp(accounts[unique - 1].username, accounts[i].username) == 0) {
+            skipped++;
+            continue;
+        }
+        accounts[unique++] = accounts[i];
+    }
+    account_count = unique;
+    qsort(accounts, account_count, sizeof(ImportAccount), compare_import_lines);
+    qsort(profiles, profile_count, sizeof(ImportProfile), compare_import_profiles);
+    
+    store_fd = open("temp_accounts.db", O_RDWR | O_CREAT | O_TRUNC, 0600);
+    heap_fd = open("temp_profiles.db", O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (store_fd < 0 || heap_fd < 0 || store_create() < 0) {
+        perror("Error creating the record store");
+        goto done;
+    }
+    for (long i = 0; i < account_count; i++) {
+        ImportAccount *a = &accounts[i];
+        ImportProfile key = { .line = a->username, .order = -1 }, *p;
+        const char *profile = NULL;
+        
+        // The first profile line with this name, as find_profile() read them
+        long lo = 0, hi = profile_count;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (compare_import_profiles(&profiles[mid], &key) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (p = &profiles[lo]; lo < profile_count && strcmp(p->line, a->username) == 0; p++, lo++) {
+            if (p->user_type == a->user_type) {
+                profile = p->line + strlen(p->line) + 1;
+                with_profile++;
+                break;
+            }
+        }
+        if (store_apply_add(a->username, a->password, a->user_type, a->state, profile) < 0) {
+            goto done;
+        }
+        if (a->user_type >= 1 && a->user_type <= 2) {
+            imported[a->state == RECORD_ACTIVE ? 1 : 2]++;
+        } else {
+            imported[0]++;
+        }
+    }
+    
+    if (fsync(store_fd) < 0 || fsync(heap_fd) < 0 ||
+        rename("temp_accounts.db", STORE_FILE) < 0 || rename("temp_profiles.db", HEAP_FILE) < 0) {
+        perror("Error replacing the record store");
+        goto done;
+    }
+    // The log was about the store just replaced
+    if (unlink(WAL_FILE) < 0 && errno != ENOENT) {
+        perror("Error removing the write-ahead log");
+        goto done;
+    }
+    printf("Record store: imported %ld active and %ld pending users and %ld admin(s), %ld with a profile; "
+           "%ld repeated name(s) and %ld profile(s) without an account left out\n",
+           imported[1], imported[2], imported[0], with_profile, skipped, profile_count - with_profile);
+    ret = 0;
+    
+done:
+    if (store_fd >= 0) close(store_fd);
+    if (heap_fd >= 0) close(heap_fd);
+    store_fd = heap_fd = -1;
+    if (ret < 0) {
+        unlink("temp_accounts.db");
+        unlink("temp_profiles.db");
+    }
+    for (long i = 0; i < profile_count; i++) {
+        free(profiles[i].line);
+    }
+    free(profiles);
+    free(accounts);
+    return ret;
+}
+
+// Converter, store -> text files: credentials.txt, pending.txt, engineers.txt and
+// organizations.txt are written to temp_*.txt and renamed over the old ones
+int store_export(void) {
+    const char *names[] = { DATABASE_FILE, PENDING_FILE, ENGINEERS_FILE, ORGANIZATIONS_FILE };
+    const char *temps[] = { "temp_credentials.txt", "temp_pending.txt", "temp_engineers.txt", "temp_organizations.txt" };
+    FILE *files[4] = { NULL, NULL, NULL, NULL };
+    char line[BUF_SIZE * 4];
+    long users = 0, profiles = 0;
+    int ret = -1;
+    StoreCursor c;
+    Record *r;
+    
+    for (int i = 0; i < 4; i++) {
+        if ((files[i] = fopen(temps[i], "w")) == NULL) {
+            perror("Error creating the text files");
+            goto done;
+        }
+    }
+    store_cursor_init(&c);
+    while ((r = store_next(&c)) != NULL) {
+        if (r->state == RECORD_FREE) {
+            continue;
+        }
+        fprintf(files[r->state == RECORD_ACTIVE ? 0 : 1], "%s %s %d\n", r->username, r->password, r->user_type);
+        users++;
+        if (r->profile_len > 0 && (r->user_type == 1 || r->user_type == 2)) {
+            if (record_line(r, line, sizeof(line)) < 0) {
+                perror("Error reading a profile");
+                goto done;
+            }
+            fprintf(files[r->user_type == 1 ? 2 : 3], "%s\n", line);
+            profiles++;
+        }
+    }
+    if (c.failed) {
+        perror("Error reading the record store");
+        goto done;
+    }
+    
+    ret = 0;
+    for (int i = 0; i < 4; i++) {
+        if (ferror(files[i]) || fclose(files[i]) != 0) {
+            ret = -1;
+        }
+        files[i] = NULL;
+    }
+    for (int i = 0; i < 4 && ret == 0; i++) {
+        if (rename(temps[i], names[i]) < 0) {
+            ret = -1;
+        }
+    }
+    if (ret < 0) {
+        perror("Error writing the text files");
+    } else {
+        printf("Record store: exported %ld users and %ld profiles to the text files\n", users, profiles);
+    }
+    
+done:
+    for (int i = 0; i < 4; i++) {
+        if (files[i] != NULL) {
+            fclose(files[i]);
+        }
+        if (ret < 0) {
+            unlink(temps[i]);
+        }
+    }
+    return ret;
+}
+
+// Open the store, importing the text files when there is none yet
+void store_open(void) {
+    if (access(STORE_FILE, F_OK) != 0 && access(DATABASE_FILE, F_OK) == 0) {
+        printf("Record store: no %s yet, importing the text files\n", STORE_FILE);
+        if (store_import() < 0) {
+            erro("error importing the text files into the record store");
+        }
+    }
+    store_fd = open(STORE_FILE, O_RDWR | O_CREAT, 0600);
+    heap_fd = open(HEAP_FILE, O_RDWR | O_CREAT, 0600);
+    if (store_fd < 0 || heap_fd < 0) {
+        erro("error opening the record store");
+    }
+    
+    struct stat st;
+    store_lock();
+    if (fstat(store_fd, &st) < 0 || (st.st_size == 0 && store_create() < 0) || store_recover() < 0) {
+        erro("error reading the record store");
+    }
+    store_unlock();
+}
+
+void print_store_stats(void) {
+    StoreHeader h;
+    if (store_fd < 0 || store_header_read(&h) < 0) {
+        return;
+    }
+    printf("Record store: %lu records (%lu free, %lu KB), profile heap %lu KB of which %lu KB garbage\n",
+           (unsigned long)h.records, (unsigned long)h.free_count,
+           (unsigned long)((h.records + 1) * RECORD_SIZE / 1024),
+           (unsigned long)(h.heap_size / 1024), (unsigned long)(h.heap_garbage / 1024));
+}
+
+// ===================== Write-ahead log =====================
+// Every change to the store is also appended to accounts.wal: registering,
+// approving or deleting a user and writing a profile are each one entry, one
+// sequential write, whatever records, header and heap bytes they touched.
+// The records are written in place first and the entry is queued after
+// them, under the same locks; the storage writer (see the next section)
+// syncs the log, and only then is the change acknowledged. So the log is not
+// ahead of the store: what it guarantees is that no acknowledged change is
+// lost, not that it can explain every record.
+//
+// A crash can leave the store with changes whose entries never reached the
+// log, whole or in part, since the kernel writes dirty pages back when it
+// likes. That is safe:
+//  - such a change was never acknowledged: keeping or losing it are both
+//    outcomes its client must expect anyway, as when a reply gets lost;
+//  - a record is RECORD_SIZE bytes at a multiple of RECORD_SIZE, inside one
+//    disk sector, so it reaches the disk old or new but never torn;
+//  - store_recover() rebuilds the header and the free list from the records
+//    and drops a profile whose heap bytes were lost, so the store is
+//    consistent whatever subset of its writes survived;
+//  - entries name the user rather than a record, and replaying one brings
+//    that user to what the entry says over whatever the record holds.
+// So at startup the whole log is replayed over a store that has some, all or
+// more than it: every acknowledged change comes back, and an unlogged change
+// to the same user may be undone by it, which is allowed. An entry cut short
+// by the crash fails its CRC and ends the log there.
+//
+// A compactor thread folds the log into the store: it syncs accounts.db and
+// profiles.db, the snapshot, and empties the log, when the log passes
+// WAL_COMPACT_BYTES or WAL_COMPACT_INTERVAL seconds after its first entry.
+// In a hot restart both processes append their batches to one log, under
+// its flock(); each entry carries the time its change was made, with the
+// store locked, and replay goes by that.
+
+int wal_fd = -1;
+WalQueue *wal_queue = NULL;
+pthread_mutex_t wal_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The log file: the mutex orders this process's writer and compactor, flock() the other process
+void wal_lock(void) {
+    pthread_mutex_lock(&wal_file_lock);
+    while (flock(wal_fd, LOCK_EX) < 0 && errno == EINTR) {
+    }
+}
+
+void wal_unlock(void) {
+    flock(wal_fd, LOCK_UN);
+    pthread_mutex_unlock(&wal_file_lock);
+}
+
+// CRC-32 (IEEE), continuing from crc
+uint32_t wal_crc(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    
+    crc = ~crc;
+    while (len-- > 0) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+uint32_t wal_entry_crc(const WalEntry *e, const char *profile) {
+    uint32_t crc = wal_crc(0, &e->stamp, sizeof(WalEntry) - offsetof(WalEntry, stamp));
+    return wal_crc(crc, profile, e->profile_len);
+}
+
+// Whether r's profile is profile (len bytes; none when len is 0)
+int record_same_profile(const Record *r, const char *profile, size_t len) {
+    char stored[PROFILE_MAX_LENGTH + 1];
+    
+    if (r->profile_len != len) {
+        return 0;
+    }
+    return len == 0 || (record_profile(r, stored, sizeof(stored)) == (int)len && memcmp(stored, profile, len) == 0);
+}
+
+// Bring the store to what one entry says; 0, or -1 on error. The record may
+// hold this change, later ones, or unlogged ones a crash left (see above),
+// and needn't be told apart. The store is locked
+int wal_replay_entry(const WalEntry *e, const char *profile) {
+    Record r;
+    long slot = store_find(e->username, &r);
+    
+    if (slot == -2) {
+        return -1;
+    }
+    switch (e->op) {
+        case WAL_REGISTER:
+            // The same account: its state and profile are left to the APPROVE and
+            // PROFILE entries after this one, which the record may hold already
+            if (slot >= 0 && r.user_type == e->user_type && strcmp(r.password, e->password) == 0) {
+                return 0;
+            }
+            // The name may have been deleted and registered again since the store was synced
+            if (slot >= 0 && store_apply_remove(slot, &r) < 0) {
+                return -1;
+            }
+            return store_apply_add(e->username, e->password, e->user_type, e->state,
+                                   e->profile_len > 0 ? profile : NULL) < 0 ? -1 : 0;
+        case WAL_APPROVE:
+            return (slot < 0 || r.state == e->state) ? 0 : store_apply_state(slot, &r, e->state);
+        case WAL_DELETE:
+            return (slot < 0) ? 0 : store_apply_remove(slot, &r);
+        case WAL_PROFILE:
+            if (slot < 0 || r.user_type != e->user_type || record_same_profile(&r, profile, e->profile_len)) {
+                return 0;
+            }
+            return store_apply_profile(slot, profile);
+    }
+    return 0;
+}
+
+// The entry at offset with its profile (NUL-terminated); -1 when it is cut short or damaged
+int wal_read_entry(off_t offset, WalEntry *e, char *profile) {
+    if (store_pread(wal_fd, e, sizeof(*e), offset) < 0 || e->magic != WAL_MAGIC ||
+        e->profile_len > PROFILE_MAX_LENGTH ||
+        store_pread(wal_fd, profile, e->profile_len, offset + sizeof(*e)) < 0 ||
+        e->crc != wal_entry_crc(e, profile)) {
+        return -1;
+    }
+    profile[e->profile_len] = '\0';
+    e->username[MAX_USERNAME_LENGTH - 1] = '\0';
+    e->password[MAX_PASSWORD_LENGTH - 1] = '\0';
+    return 0;
+}
+
+int wal_position_compare(const void *a, const void *b) {
+    const WalPosition *x = a, *y = b;
+    if (x->stamp != y->stamp) {
+        return (x->stamp > y->stamp) ? 1 : -1;
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Replay the whole log over the store, in the order the changes were made,
+// and cut off a torn last entry; the number of entries, -1 on error. The store and the log are locked
+long wal_replay(void) {
+    WalEntry e;
+    char profile[PROFILE_MAX_LENGTH + 1];
+    WalPosition *order = NULL;
+    long count = 0, capacity = 0;
+    off_t offset = 0;
+    struct stat st;
+    
+    if (fstat(wal_fd, &st) < 0) {
+        return -1;
+    }
+    while (offset < st.st_size) {
+        if (wal_read_entry(offset, &e, profile) < 0) {
+            printf("Write-ahead log: dropping %ld byte(s) of an entry cut short at offset %ld\n",
+                   (long)(st.st_size - offset), (long)offset);
+            if (ftruncate(wal_fd, offset) < 0) {
+                free(order);
+                return -1;
+            }
+            break;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            WalPosition *grown = realloc(order, capacity * sizeof(WalPosition));
+            if (grown == NULL) {
+                free(order);
+                return -1;
+            }
+            order = grown;
+        }
+        order[count].stamp = e.stamp;
+        order[count].offset = offset;
+        count++;
+        offset += sizeof(e) + e.profile_len;
+    }
+    
+    // Batches of two processes (hot restart) may lie in the log out of order
+    qsort(order, count, sizeof(WalPosition), wal_position_compare);
+    for (long i = 0; i < count; i++) {
+        if (wal_read_entry(order[i].offset, &e, profile) < 0 || wal_replay_entry(&e, profile) < 0) {
+            free(order);
+            return -1;
+        }
+    }
+    free(order);
+    return count;
+}
+
+// Fold the log into the store: accounts.db and profiles.db are synced, then the log is emptied
+int wal_compact(void) {
+    struct stat st;
+    int ret = 0;
+    
+    // Most of the syncing is done before taking the locks, so writers only wait for what came since
+    if (fdatasync(heap_fd) < 0 || fdatasync(store_fd) < 0) {
+        return -1;
+    }
+    // Every change logged so far is in the files once they are synced with the store locked
+    pthread_mutex_lock(storage_lock);
+    store_lock();
+    wal_lock();
+    if (fstat(wal_fd, &st) < 0) {
+        ret = -1;
+    } else if (st.st_size > 0) {
+        if (fdatasync(heap_fd) < 0 || fdatasync(store_fd) < 0 || ftruncate(wal_fd, 0) < 0 || fdatasync(wal_fd) < 0) {
+            ret = -1;
+        } else {
+            __atomic_add_fetch(&wal_queue->compactions, 1, __ATOMIC_RELAXED);
+        }
+    }
+    wal_unlock();
+    store_unlock();
+    pthread_mutex_unlock(storage_lock);
+    return ret;
+}
+
+void *wal_compactor_thread(void *arg) {
+    int64_t first_seen_ms = 0;
+    struct stat st;
+    
+    while (1) {
+        sleep(1);
+        if (fstat(wal_fd, &st) < 0 || st.st_size == 0) {
+            first_seen_ms = 0;
+            continue;
+        }
+        if (first_seen_ms == 0) {
+            first_seen_ms = monotonic_ms();
+        }
+        if (st.st_size < WAL_COMPACT_BYTES && monotonic_ms() - first_seen_ms < WAL_COMPACT_INTERVAL * 1000) {
+            continue;
+        }
+        if (wal_compact() < 0) {
+            perror("Error compacting the write-ahead log");
+        }
+        first_seen_ms = 0;
+    }
+    return NULL;
+}
+
+// Open the log, replay it over the store and start from an empty one. Needs
+// storage_lock and the credentials index, which replaying keeps up to date
+void wal_open(void) {
+    wal_queue = mmap(NULL, sizeof(WalQueue), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (wal_queue == MAP_FAILED) {
+        erro("error creating the storage writer's queue");
+    }
+    memset(wal_queue, 0, offsetof(WalQueue, data));
+    wal_queue->next_seq = 1;
+    
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&wal_queue->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal_queue->queued, &cond_attr);
+    pthread_cond_init(&wal_queue->room, &cond_attr);
+    pthread_cond_init(&wal_queue->durable, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    
+    wal_fd = open(WAL_FILE, O_RDWR | O_CREAT, 0600);
+    if (wal_fd < 0) {
+        erro("error opening the write-ahead log");
+    }
+    
+    pthread_mutex_lock(storage_lock);
+    store_lock();
+    wal_lock();
+    long replayed = wal_replay();
+    wal_unlock();
+    store_unlock();
+    pthread_mutex_unlock(storage_lock);
+    if (replayed < 0 || wal_compact() < 0) {
+        erro("error replaying the write-ahead log");
+    }
+    wal_queue->replayed = replayed;
+    if (replayed > 0) {
+        printf("Write-ahead log: replayed %ld change(s) into the record store\n", replayed);
+    }
+}
+
+// ===================== Storage writer =====================
+// Changes don't wait for the disk one by one. wal_append() copies the entry
+// into a queue in shared memory, which prefork and fork workers fill too, and
+// gives it the next sequence number. One writer thread takes everything that
+// arrived within -G microseconds of the oldest entry (sooner when the queue is
+// half full) and writes it to the log with one write() and one fdatasync().
+// A batch of a hundred registrations costs the disk what one did before.
+//
+// The records are written before the entry is queued, so other sessions see
+// a change at once; it is only acknowledged once durable (the Write-ahead log
+// section says why a crash in between is safe). Whoever answers the
+// client calls wal_commit() first, after releasing storage_lock: a reactor
+// task parks (see sched_park()) and the writer's eventfd wakes its loop when
+// the batch is on disk, anything else blocks. When the log can't be written,
+// syncing the store, which has the changes already, makes them durable instead.
+
+long wal_window_us = WAL_WINDOW_US;
+__thread WalPending thread_wal;       // the same as Coroutine.wal, for code outside coroutines
+
+// Reactor threads with an eventfd to wake when their parked tasks may go on
+typedef struct {
+    int fd;                           // -1: a free entry
+    int *parked;                      // tasks parked in that thread
+} WalWaker;
+
+WalWaker wal_wakers[WAL_MAX_REACTORS];
+int wal_waker_count = 0;
+pthread_mutex_t wal_wakers_lock = PTHREAD_MUTEX_INITIALIZER;
+char wal_batch[WAL_QUEUE_BYTES];      // the writer's copy of the batch it writes
+
+// Queue one change for the storage writer; password and profile may be NULL.
+// The records are written already and the store is still locked, so entries queue in the order of their changes
+void wal_append(int op, const char *username, const char *password, int user_type, int state, const char *profile) {
+    struct {
+        WalEntry e;
+        char profile[PROFILE_MAX_LENGTH];
+    } entry;
+    size_t len = (profile != NULL) ? strlen(profile) : 0;
+    WalQueue *q = wal_queue;
+    struct timespec now;
+    
+    if (wal_fd < 0) {
+        return;  // the store is being created: there is nothing to log yet
+    }
+    if (len > PROFILE_MAX_LENGTH) {
+        len = PROFILE_MAX_LENGTH;  // as record_set_profile() keeps it
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&entry.e, 0, sizeof(entry.e));
+    entry.e.magic = WAL_MAGIC;
+    entry.e.stamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    entry.e.op = op;
+    entry.e.state = state;
+    entry.e.user_type = user_type;
+    entry.e.profile_len = len;
+    snprintf(entry.e.username, sizeof(entry.e.username), "%s", username);
+    if (password != NULL) {
+        snprintf(entry.e.password, sizeof(entry.e.password), "%s", password);
+    }
+    if (len > 0) {
+        memcpy(entry.profile, profile, len);
+    }
+    entry.e.crc = wal_entry_crc(&entry.e, entry.profile);
+    
+    size_t size = sizeof(WalEntry) + len;
+    pthread_mutex_lock(&q->lock);
+    while (q->used + size > WAL_QUEUE_BYTES) {
+        pthread_cond_wait(&q->room, &q->lock);  // the writer copies batches out before syncing them
+    }
+    memcpy(q->data + q->used, &entry, size);
+    if (q->used == 0) {
+        q->first_queued_us = monotonic_us();
+    }
+    // The writer waits for the first entry, then for the window or half the queue
+    if (q->used == 0 || (q->used < WAL_QUEUE_BYTES / 2 && q->used + size >= WAL_QUEUE_BYTES / 2)) {
+        pthread_cond_signal(&q->queued);
+    }
+    q->used += size;
+    WalPending *mine = (current_coroutine != NULL) ? &current_coroutine->wal : &thread_wal;
+    mine->last = q->next_seq++;
+    if (mine->first == 0) {
+        mine->first = mine->last;
+    }
+    q->appends++;
+    q->bytes += size;
+    pthread_mutex_unlock(&q->lock);
+}
+
+int wal_durable(uint64_t seq) {
+    return __atomic_load_n(&wal_queue->durable_seq, __ATOMIC_SEQ_CST) >= seq;
+}
+
+// Whether a change from first to last couldn't be made durable; q->lock held.
+// Changes as old as an overwritten run may have been in it: they count as failed
+int wal_failed(WalQueue *q, uint64_t first, uint64_t last) {
+    if (first <= q->failed_forgotten) {
+        return 1;
+    }
+    for (long i = 0; i < q->failed_runs && i < WAL_FAILED_RUNS; i++) {
+        if (first <= q->failed_last[i] && last >= q->failed_first[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Wait until the changes the task (or, outside coroutines, the thread) queued
+// since its last call are on disk; 0, or -1 when they couldn't be made
+// durable. Returns at once when it queued none. storage_lock must not be held
+int wal_commit(void) {
+    WalQueue *q = wal_queue;
+    WalPending *mine = (current_coroutine != NULL) ? &current_coroutine->wal : &thread_wal;
+    WalPending pending = *mine;
+    int ret = 0;
+    
+    mine->first = mine->last = 0;
+    if (q == NULL || pending.last == 0) {
+        return 0;
+    }
+    uint64_t seq = pending.last;
+    int64_t start = monotonic_us();
+    int waited = !wal_durable(seq);
+    while (!wal_durable(seq) && sched_park(seq)) {
+    }
+    // A reactor session that is closing has nobody to tell, and must not hold up its thread
+    if (!wal_durable(seq) && current_coroutine != NULL && current_coroutine->eof) {
+        return -1;
+    }
+    pthread_mutex_lock(&q->lock);
+    while (q->durable_seq < seq) {
+        pthread_cond_wait(&q->durable, &q->lock);
+    }
+    if (wal_failed(q, pending.first, pending.last)) {
+        ret = -1;
+    }
+    if (waited) {
+        q->commits++;
+        q->commit_us += monotonic_us() - start;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+// An eventfd the writer signals when changes the thread's parked tasks wait
+// for are durable; -1 when there is none and its tasks block instead
+int wal_register_reactor(int *parked) {
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        perror("Error creating the storage writer's eventfd");
+        return -1;
+    }
+    pthread_mutex_lock(&wal_wakers_lock);
+    int i = 0;
+    while (i < wal_waker_count && wal_wakers[i].fd >= 0) {
+        i++;
+    }
+    if (i == WAL_MAX_REACTORS) {
+        pthread_mutex_unlock(&wal_wakers_lock);
+        close(fd);
+        return -1;
+    }
+    wal_wakers[i].fd = fd;
+    wal_wakers[i].parked = parked;
+    if (i == wal_waker_count) {
+        wal_waker_count++;
+    }
+    pthread_mutex_unlock(&wal_wakers_lock);
+    return fd;
+}
+
+// The reactor thread's loop is over
+void wal_unregister_reactor(int fd) {
+    if (fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&wal_wakers_lock);
+    for (int i = 0; i < wal_waker_count; i++) {
+        if (wal_wakers[i].fd == fd) {
+            wal_wakers[i].fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&wal_wakers_lock);
+    close(fd);
+}
+
+// After durable_seq moved: a thread that parked a task reads durable_seq
+// after counting it, this reads the count after durable_seq, so either the
+// thread sees the change durable or it gets woken
+void wal_wake_reactors(void) {
+    uint64_t one = 1;
+    
+    pthread_mutex_lock(&wal_wakers_lock);
+    for (int i = 0; i < wal_waker_count; i++) {
+        if (wal_wakers[i].fd >= 0 && __atomic_load_n(wal_wakers[i].parked, __ATOMIC_SEQ_CST) > 0 &&
+            write(wal_wakers[i].fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("Error waking a reactor");
+        }
+    }
+    pthread_mutex_unlock(&wal_wakers_lock);
+}
+
+// Append a batch to the log with one write and make it durable; 0, or -1 when it couldn't be
+int wal_write_batch(const char *batch, size_t len) {
+    struct stat st;
+    int ret = 0;
+    
+    wal_lock();
+    if (fstat(wal_fd, &st) < 0) {
+        ret = -1;
+    } else if (store_pwrite(wal_fd, batch, len, st.st_size) < 0) {
+        // Replay would stop at the broken entry and miss the ones after it
+        if (ftruncate(wal_fd, st.st_size) < 0) {
+            perror("Error truncating the write-ahead log");
+        }
+        ret = -1;
+    }
+    wal_unlock();
+    // The sync happens unlocked: the other process's writer may append meanwhile, and its sync covers both
+    if (ret == 0 && fdatasync(wal_fd) == 0) {
+        return 0;
+    }
+    perror("Error writing the write-ahead log");
+    
+    // The changes are in the store's files already: syncing them does it too
+    if (fdatasync(heap_fd) < 0 || fdatasync(store_fd) < 0) {
+        perror("Error syncing the record store");
+        return -1;
+    }
+    __atomic_add_fetch(&wal_queue->store_syncs, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void *wal_writer_thread(void *arg) {
+    WalQueue *q = wal_queue;
+    
+    pthread_mutex_lock(&q->lock);
+    while (1) {
+        while (q->used == 0) {
+            pthread_cond_wait(&q->queued, &q->lock);
+        }
+        // Let the batch gather until the window after its oldest change is over
+        int64_t deadline_us = q->first_queued_us + wal_window_us;
+        struct timespec deadline = { deadline_us / 1000000, (deadline_us % 1000000) * 1000 };
+        while (q->used < WAL_QUEUE_BYTES / 2 && monotonic_us() < deadline_us &&
+               pthread_cond_timedwait(&q->queued, &q->lock, &deadline) != ETIMEDOUT) {
+        }
+        
+        size_t len = q->used;
+        uint64_t first = q->durable_seq + 1;
+        uint64_t last = q->next_seq - 1;
+        memcpy(wal_batch, q->data, len);
+        q->used = 0;
+        pthread_cond_broadcast(&q->room);
+        pthread_mutex_unlock(&q->lock);
+        
+        int64_t start = monotonic_us();
+        int ret = wal_write_batch(wal_batch, len);
+        
+        pthread_mutex_lock(&q->lock);
+        q->batches++;
+        q->sync_us += monotonic_us() - start;
+        if ((long)(last - first + 1) > q->max_batch) {
+            q->max_batch = last - first + 1;
+        }
+        if (ret < 0) {
+            // A run of failed batches is one range; a new run takes the oldest one's place
+            long i = (q->failed_runs + WAL_FAILED_RUNS - 1) % WAL_FAILED_RUNS;
+            if (q->failed_runs > 0 && q->failed_last[i] + 1 == first) {
+                q->failed_last[i] = last;
+            } else {
+                i = q->failed_runs % WAL_FAILED_RUNS;
+                if (q->failed_runs >= WAL_FAILED_RUNS) {
+                    q->failed_forgotten = q->failed_last[i];
+                }
+                q->failed_first[i] = first;
+                q->failed_last[i] = last;
+                q->failed_runs++;
+            }
+        }
+        __atomic_store_n(&q->durable_seq, last, __ATOMIC_SEQ_CST);
+        pthread_cond_broadcast(&q->durable);
+        pthread_mutex_unlock(&q->lock);
+        wal_wake_reactors();
+        pthread_mutex_lock(&q->lock);
+    }
+    return NULL;
+}
+
+// The writer and the compactor run in the process that opened the log
+void wal_start(void) {
+    pthread_t thread;
+    
+    if (pthread_create(&thread, NULL, wal_writer_thread, NULL) != 0) {
+        erro("Error creating the storage writer");
+    }
+    pthread_detach(thread);
+    if (pthread_create(&thread, NULL, wal_compactor_thread, NULL) != 0) {
+        erro("Error creating the write-ahead log compactor");
+    }
+    pthread_detach(thread);
+}
+
+void print_wal_stats(void) {
+    WalQueue *q = wal_queue;
+    struct stat st;
+    
+    if (q == NULL || fstat(wal_fd, &st) < 0) {
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    long appends = q->appends, bytes = q->bytes, batches = q->batches, max_batch = q->max_batch;
+    long sync_us = q->sync_us, commits = q->commits, commit_us = q->commit_us, store_syncs = q->store_syncs;
+    pthread_mutex_unlock(&q->lock);
+    
+    printf("Storage writer: %ld changes in %ld batches (%.1f per fdatasync, %ld at most), "
+           "%.0f us per batch, %.0f us until acknowledged, window %ld us",
+           appends, batches, batches > 0 ? (double)appends / batches : 0.0, max_batch,
+           batches > 0 ? (double)sync_us / batches : 0.0, commits > 0 ? (double)commit_us / commits : 0.0,
+           wal_window_us);
+    if (store_syncs > 0) {
+        printf(", %ld synced through the store", store_syncs);
+    }
+    printf("\n");
+    printf("Write-ahead log: %ld KB logged, %ld compactions, %ld KB not folded yet, %ld replayed at startup\n",
+           bytes / 1024, __atomic_load_n(&q->compactions, __ATOMIC_RELAXED), (long)(st.st_size / 1024),
+           q->replayed);
+}
+
+// ===================== Username filter =====================
+// A counting Bloom filter over every active and pending username, in front
+// of username_exists() and is_pending_user(). Registering almost always
+// picks a new name, and a name the filter has never seen is a definite
+// miss: no index probe and, when the index gave up, no walk over the records.
+// Only names the filter may hold go on to the authoritative lookup.
+//
+// Each name bumps FILTER_HASHES one-byte counters (saturating at 255, which
+// then stay put) and a removal takes them back down, so deletions need no
+// rebuild. The record store counts a name in when it adds its record and out
+// when it frees it; approvals change neither. Shared with the prefork and
+// fork workers like the index, and reloaded with it.
+
+typedef struct {
+    long size;                  // counters, a power of two
+    int valid;                  // 0 while the files may hold names it hasn't seen
+    long checks;
+    long misses;                // definite misses
+    long false_positives;       // maybe, but the lookup found nothing
+    uint8_t counters[];
+} UsernameFilter;
+
+UsernameFilter *username_filter = NULL;
+
+// Two 32-bit hashes from one 64-bit FNV-1a; counter i is h1 + i * h2
+void filter_hashes(const char *username, uint32_t *h1, uint32_t *h2) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+        hash = (hash ^ *p) * 1099511628211ull;
+    }
+    *h1 = (uint32_t)hash;
+    *h2 = (uint32_t)(hash >> 32) | 1;
+}
+
+void filter_init(long users) {
+    long size = 1024;
+    
+    while (size < users * FILTER_COUNTERS_PER_USER) {
+        size *= 2;
+    }
+    username_filter = mmap(NULL, sizeof(UsernameFilter) + size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (username_filter == MAP_FAILED) {
+        erro("error creating the username filter");
+    }
+    username_filter->size = size;
+}
+
+// Forget every name; valid again once the caller has added them back
+void filter_clear(void) {
+    UsernameFilter *f = username_filter;
+    
+    __atomic_store_n(&f->valid, 0, __ATOMIC_RELEASE);
+    memset(f->counters, 0, f->size);
+}
+
+void filter_set_valid(int valid) {
+    __atomic_store_n(&username_filter->valid, valid, __ATOMIC_RELEASE);
+}
+
+// The store added a record for username; storage_lock held
+void filter_add(const char *username) {
+    UsernameFilter *f = username_filter;
+    uint32_t h1, h2;
+    
+    if (f == NULL) {
+        return;
+    }
+    filter_hashes(username, &h1, &h2);
+    for (int i = 0; i < FILTER_HASHES; i++) {
+        uint8_t *c = &f->counters[(h1 + i * h2) & (f->size - 1)];
+        if (*c < UINT8_MAX) {
+            __atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// The store freed username's record; only for a name that was added
+void filter_remove(const char *username) {
+    UsernameFilter *f = username_filter;
+    uint32_t h1, h2;
+    
+    if (f == NULL) {
+        return;
+    }
+    filter_hashes(username, &h1, &h2);
+    for (int i = 0; i < FILTER_HASHES; i++) {
+        uint8_t *c = &f->counters[(h1 + i * h2) & (f->size - 1)];
+        // A saturated counter no longer knows how many names it holds
+        if (*c > 0 && *c < UINT8_MAX) {
+            __atomic_store_n(c, *c - 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// 0 when username is certainly neither active nor pending
+int filter_may_contain(const char *username) {
+    UsernameFilter *f = username_filter;
+    uint32_t h1, h2;
+    
+    if (f == NULL || !__atomic_load_n(&f->valid, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+    __atomic_add_fetch(&f->checks, 1, __ATOMIC_RELAXED);
+    filter_hashes(username, &h1, &h2);
+    for (int i = 0; i < FILTER_HASHES; i++) {
+        if (__atomic_load_n(&f->counters[(h1 + i * h2) & (f->size - 1)], __ATOMIC_RELAXED) == 0) {
+            __atomic_add_fetch(&f->misses, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The filter let a name through that the lookup then didn't find
+void filter_false_positive(void) {
+    if (username_filter != NULL) {
+        __atomic_add_fetch(&username_filter->false_positives, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void print_filter_stats(void) {
+    UsernameFilter *f = username_filter;
+    if (f == NULL) {
+        return;
+    }
+    long misses = __atomic_load_n(&f->misses, __ATOMIC_RELAXED);
+    long false_positives = __atomic_load_n(&f->false_positives, __ATOMIC_RELAXED);
+    printf("Username filter: %ld counters (%ld KB), %d hashes, %ld checks, %ld definite misses, "
+           "%ld false positives (%.2f%% of unknown names)%s\n",
+           f->size, f->size / 1024, FILTER_HASHES, __atomic_load_n(&f->checks, __ATOMIC_RELAXED),
+           misses, false_positives,
+           misses + false_positives > 0 ? 100.0 * false_positives / (misses + false_positives) : 0.0,
+           f->valid ? "" : ", waiting for a reload");
+}
+
+// ===================== Credentials index =====================
+// Every account and pending registration, keyed by username in an
+// open-addressing hash table with linear probing. A login or a name check
+// is one lookup instead of a walk over the record store, and the entry
+// gives the number of the user's record. The store stays the record: the
+// table is loaded from it at startup, and the store's write functions
+// update it while holding storage_lock.
+//
+// The table lives in shared memory so prefork and fork workers see each
+// other's writes. Readers take no lock: a sequence number, odd while a writer
+// is busy, tells them to look again. A shared table can't be reallocated
+// under the other processes, so it is sized at startup for twice -U accounts
+// (or twice what the store holds); should it fill up anyway, lookups go back
+// to reading the records.
+
+typedef struct {
+    uint32_t hash;
+    uint8_t state;              // INDEX_*
+    uint8_t user_type;
+    uint32_t slot;              // its record in the store
+    char username[MAX_USERNAME_LENGTH];
+    char password[MAX_PASSWORD_LENGTH];
+} IndexEntry;
+
+typedef struct {
+    uint64_t seq;               // odd while a writer changes the table
+    long capacity;              // slots, a power of two
+    long count;                 // active and pending users
+    long deleted;               // slots left as tombstones by removals
+    int full;                   // gave up: lookups read the records
+    int64_t bypass_until_ms;    // hot restart: the old process may add users the table lacks until then
+    long lookups;
+    long probes;
+    IndexEntry slots[];
+} UserIndex;
+
+UserIndex *user_index = NULL;
+long index_min_users = INDEX_MIN_USERS;
+
+// FNV-1a
+uint32_t index_hash(const char *username) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+// The slot holding username, or with insert the one it would go to;
+// NULL when neither exists. *probes counts the slots looked at
+IndexEntry *index_slot(UserIndex *idx, const char *username, uint32_t hash, int insert, long *probes) {
+    long mask = idx->capacity - 1;
+    IndexEntry *free_slot = NULL;
+    
+    for (long i = 0; i < idx->capacity; i++) {
+        IndexEntry *e = &idx->slots[(hash + i) & mask];
+        (*probes)++;
+        if (e->state == INDEX_EMPTY) {
+            return insert ? (free_slot ? free_slot : e) : NULL;
+        }
+        if (e->state == INDEX_DELETED) {
+            if (free_slot == NULL) {
+                free_slot = e;
+            }
+        } else if (e->hash == hash && strcmp(e->username, username) == 0) {
+            return e;
+        }
+    }
+    return insert ? free_slot : NULL;
+}
+
+// Insert or update without telling readers; 0, or -1 when no slot is left
+int index_store(UserIndex *idx, const char *username, const char *password, int user_type, int state, long slot) {
+    uint32_t hash = index_hash(username);
+    long probes = 0;
+    IndexEntry *e = index_slot(idx, username, hash, 1, &probes);
+    
+    if (e == NULL) {
+        return -1;
+    }
+    if (e->state == INDEX_DELETED) {
+        idx->deleted--;
+    }
+    if (e->state != INDEX_ACTIVE && e->state != INDEX_PENDING) {
+        idx->count++;
+    }
+    e->hash = hash;
+    e->user_type = user_type;
+    e->slot = slot;
+    snprintf(e->username, sizeof(e->username), "%s", username);
+    snprintf(e->password, sizeof(e->password), "%s", password);
+    e->state = state;
+    return 0;
+}
+
+void index_write_begin(UserIndex *idx) {
+    __atomic_add_fetch(&idx->seq, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void index_write_end(UserIndex *idx) {
+    __atomic_add_fetch(&idx->seq, 1, __ATOMIC_RELEASE);
+}
+
+// Fill the table from the records; storage_lock held once readers exist
+void index_load(UserIndex *idx) {
+    StoreCursor c;
+    Record *r;
+    
+    index_write_begin(idx);
+    filter_clear();
+    memset(idx->slots, 0, idx->capacity * sizeof(IndexEntry));
+    idx->count = 0;
+    idx->deleted = 0;
+    idx->full = 0;
+    store_cursor_init(&c);
+    while ((r = store_next(&c)) != NULL) {
+        if (r->state == RECORD_FREE) {
+            continue;
+        }
+        // The filter takes every name, also once the table is full
+        filter_add(r->username);
+        if (!idx->full && index_store(idx, r->username, r->password, r->user_type, r->state, c.slot) < 0) {
+            idx->full = 1;
+        }
+    }
+    if (c.failed || idx->count > idx->capacity * 3 / 4) {
+        idx->full = 1;
+    }
+    index_write_end(idx);
+    filter_set_valid(!c.failed);
+    if (idx->full) {
+        printf("Credentials index: more than %ld users, looking them up in the records (raise -U)\n",
+               idx->capacity * 3 / 4);
+    }
+}
+
+void index_init(void) {
+    long users = store_users();
+    long capacity = 1024;
+    
+    if (users < index_min_users) {
+        users = index_min_users;
+    }
+    while (capacity < users * 2) {
+        capacity *= 2;
+    }
+    // Only the pages the hashes land on ever become resident
+    size_t size = sizeof(UserIndex) + capacity * sizeof(IndexEntry);
+    user_index = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (user_index == MAP_FAILED) {
+        erro("error creating the credentials index");
+    }
+    user_index->capacity = capacity;
+    filter_init(users);
+    index_load(user_index);
+    printf("Credentials index: %ld users, %ld slots\n", user_index->count, capacity);
+}
+
+// A hot restart took over from a process whose sessions may add users for seconds more
+void index_bypass(int seconds) {
+    user_index->bypass_until_ms = monotonic_ms() + (int64_t)seconds * 1000;
+    filter_set_valid(0);
+}
+
+// INDEX_ACTIVE or INDEX_PENDING with the user's password, type and record,
+// INDEX_EMPTY for an unknown name, -1 when the index can't tell and the records must be read
+int index_find(const char *username, char *password, int *user_type, long *slot) {
+    UserIndex *idx = user_index;
+    uint64_t seq;
+    int state;
+    
+    if (idx == NULL || idx->full) {
+        return -1;
+    }
+    if (idx->bypass_until_ms != 0) {
+        // Load what the old process wrote once it is gone; meanwhile the records answer
+        if (monotonic_ms() < idx->bypass_until_ms || pthread_mutex_trylock(storage_lock) != 0) {
+            return -1;
+        }
+        if (idx->bypass_until_ms != 0) {
+            index_load(idx);
+            idx->bypass_until_ms = 0;
+        }
+        pthread_mutex_unlock(storage_lock);
+    }
+    
+    uint32_t hash = index_hash(username);
+    long probes;
+    do {
+        while ((seq = __atomic_load_n(&idx->seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        probes = 0;
+        IndexEntry *e = index_slot(idx, username, hash, 0, &probes);
+        state = (e != NULL) ? e->state : INDEX_EMPTY;
+        if (e != NULL && password != NULL) {
+            memcpy(password, e->password, MAX_PASSWORD_LENGTH);
+            password[MAX_PASSWORD_LENGTH - 1] = '\0';
+        }
+        if (e != NULL && user_type != NULL) {
+            *user_type = e->user_type;
+        }
+        if (e != NULL && slot != NULL) {
+            *slot = e->slot;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&idx->seq, __ATOMIC_RELAXED) != seq);
+    
+    __atomic_add_fetch(&idx->lookups, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&idx->probes, probes, __ATOMIC_RELAXED);
+    return state;
+}
+
+// Drop the tombstones by inserting the live entries again; the caller told readers
+void index_rebuild(UserIndex *idx) {
+    IndexEntry *live = malloc(idx->count * sizeof(IndexEntry));
+    long count = 0;
+    
+    if (live == NULL) {
+        return;
+    }
+    for (long i = 0; i < idx->capacity; i++) {
+        if (idx->slots[i].state == INDEX_ACTIVE || idx->slots[i].state == INDEX_PENDING) {
+            live[count++] = idx->slots[i];
+        }
+    }
+    memset(idx->slots, 0, idx->capacity * sizeof(IndexEntry));
+    idx->count = 0;
+    idx->deleted = 0;
+    for (long i = 0; i < count; i++) {
+        index_store(idx, live[i].username, live[i].password, live[i].user_type, live[i].state, live[i].slot);
+    }
+    free(live);
+}
+
+// Record that username is now active or pending in record slot; storage_lock held
+void index_put(const char *username, const char *password, int user_type, int state, long slot) {
+    UserIndex *idx = user_index;
+    
+    if (idx == NULL || idx->full) {
+        return;
+    }
+    index_write_begin(idx);
+    if (idx->count + idx->deleted >= idx->capacity * 3 / 4 && idx->deleted > 0) {
+        index_rebuild(idx);
+    }
+    if (idx->count >= idx->capacity * 3 / 4 || index_store(idx, username, password, user_type, state, slot) < 0) {
+        idx->full = 1;
+        printf("Credentials index: full at %ld users, looking them up in the records (raise -U)\n", idx->count);
+    }
+    index_write_end(idx);
+}
+
+// Record that username is gone; storage_lock held
+void index_remove(const char *username) {
+    UserIndex *idx = user_index;
+    long probes = 0;
+    
+    if (idx == NULL || idx->full) {
+        return;
+    }
+    IndexEntry *e = index_slot(idx, username, index_hash(username), 0, &probes);
+    if (e == NULL) {
+        return;
+    }
+    index_write_begin(idx);
+    e->state = INDEX_DELETED;
+    idx->count--;
+    idx->deleted++;
+    index_write_end(idx);
+}
+
+void print_index_stats(void) {
+    UserIndex *idx = user_index;
+    if (idx == NULL) {
+        return;
+    }
+    long lookups = __atomic_load_n(&idx->lookups, __ATOMIC_RELAXED);
+    printf("Credentials index: %ld users in %ld slots (%ld KB), %ld lookups, %.2f slots probed per lookup%s\n",
+           idx->count, idx->capacity, (long)(idx->capacity * sizeof(IndexEntry) / 1024), lookups,
+           lookups > 0 ? (double)__atomic_load_n(&idx->probes, __ATOMIC_RELAXED) / lookups : 0.0,
+           idx->full ? ", full: reading the records" : "");
+}
+
+// ===================== Input framing =====================
+// Clients may send several answers in one segment ("1\nalice\nsecret\n") or
+// one answer over several segments. Received bytes go into a per-connection
+// ring buffer and the handlers take them out one complete line at a time.
+
+void input_reset(InputBuffer *in) {
+    in->start = 0;
+    in->len = 0;
+}
+
+// recv() straight into the free part of the ring; returns what recv() returned
+int input_read(InputBuffer *in, int fd) {
+    struct iovec iov[2];
+    int end = (in->start + in->len) % INPUT_BUF_SIZE;
+    int free_space = INPUT_BUF_SIZE - in->len;
+    int count = 1;
+    
+    if (free_space == 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    iov[0].iov_base = in->data + end;
+    iov[0].iov_len = (end + free_space <= INPUT_BUF_SIZE) ? free_space : INPUT_BUF_SIZE - end;
+    if (iov[0].iov_len < free_space) {
+        // Free space wraps around to the front of the ring
+        iov[1].iov_base = in->data;
+        iov[1].iov_len = free_space - iov[0].iov_len;
+        count = 2;
+    }
+    
+    int n = readv(fd, iov, count);
+    if (n > 0) {
+        in->len += n;
+    }
+    return n;
+}
+
+// Copy in as much of data as fits; returns how many bytes were taken
+int input_append(InputBuffer *in, const char *data, int n) {
+    int taken = 0;
+    
+    while (taken < n && in->len < INPUT_BUF_SIZE) {
+        int end = (in->start + in->len) % INPUT_BUF_SIZE;
+        int chunk = INPUT_BUF_SIZE - in->len;
+        if (chunk > INPUT_BUF_SIZE - end)
+            chunk = INPUT_BUF_SIZE - end;
+        if (chunk > n - taken)
+            chunk = n - taken;
+        memcpy(in->data + end, data + taken, chunk);
+        in->len += chunk;
+        taken += chunk;
+    }
+    return taken;
+}
+
+// Take the next line out of the ring into line (NUL-terminated, newline dropped).
+// Returns its length, or -1 while no complete line has arrived. A full ring
+// without a newline is handed over as it is, like an over-long recv() was before.
+int input_next_line(InputBuffer *in, char *line, int size) {
+    int n, consumed;
+    
+    for (n = 0; n < in->len; n++) {
+        if (in->data[(in->start + n) % INPUT_BUF_SIZE] == '\n')
+            break;
+    }
+    if (n < in->len) {
+        consumed = n + 1;
+    } else if (in->len == INPUT_BUF_SIZE) {
+        n = consumed = (in->len < size - 1) ? in->len : size - 1;
+    } else {
+        return -1;
+    }
+    if (n > size - 1) {
+        n = size - 1;  // the rest of an over-long line is dropped
+    }
+    
+    for (int i = 0; i < n; i++) {
+        line[i] = in->data[(in->start + i) % INPUT_BUF_SIZE];
+    }
+    line[n] = '\0';
+    in->start = (in->start + consumed) % INPUT_BUF_SIZE;
+    in->len -= consumed;
+    return n;
+}
+
+// Copy out and consume the next n bytes; returns 0, or -1 when fewer have arrived
+int input_take(InputBuffer *in, char *dest, int n) {
+    if (in->len < n) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        dest[i] = in->data[(in->start + i) % INPUT_BUF_SIZE];
+    }
+    in->start = (in->start + n) % INPUT_BUF_SIZE;
+    in->len -= n;
+    return 0;
+}
+
+// Take the next binary frame (u32 length, then that many bytes) out of the ring.
+// *body points at the bytes inside the ring, or at scratch when they wrap around
+// its end; either way they stay valid until the next read into the ring.
+// Returns the body length, -1 while incomplete, -2 if the frame can never fit.
+int input_next_frame(InputBuffer *in, char *scratch, char **body) {
+    unsigned char header[4];
+    
+    if (in->len < 4) {
+        return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        header[i] = in->data[(in->start + i) % INPUT_BUF_SIZE];
+    }
+    uint32_t len = ((uint32_t)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+    if (len == 0 || len > INPUT_BUF_SIZE - 4) {
+        return -2;
+    }
+    if (in->len < 4 + (int)len) {
+        return -1;
+    }
+    
+    int at = (in->start + 4) % INPUT_BUF_SIZE;
+    if (at + len <= INPUT_BUF_SIZE) {
+        *body = in->data + at;
+    } else {
+        int first = INPUT_BUF_SIZE - at;
+        memcpy(scratch, in->data + at, first);
+        memcpy(scratch + first, in->data, len - first);
+        *body = scratch;
+    }
+    in->start = (in->start + 4 + len) % INPUT_BUF_SIZE;
+    in->len -= 4 + len;
+    return len;
+}
+
+// ===================== Socket tuning =====================
+// Options applied to the listening and client sockets, each switched with -S
+// (e.g. -S nocork,busypoll=50):
+//   defer[=s]     TCP_DEFER_ACCEPT: the listener wakes up only once a client has
+//                 sent something. Off by default: the server speaks first, so a
+//                 client waiting for the menu is accepted only when the wait runs
+//                 out. Pays off for command and binary clients, which send first
+//   fastopen[=n]  TCP Fast Open: a returning client's first request rides on the
+//                 SYN (the net.ipv4.tcp_fastopen sysctl must allow the server side)
+//   nodelay       TCP_NODELAY: a prompt leaves at once, not after the client
+//                 acknowledged the previous one
+//   cork          TCP_CORK while a prompt is written in more than one send, so
+//                 the pieces still leave as full segments
+//   busypoll=us   SO_BUSY_POLL: spin on the device queue before sleeping (off)
+
+typedef struct {
+    int defer_accept;           // seconds, 0 = off
+    int fastopen;               // queue length, 0 = off
+    int nodelay;
+    int cork;
+    int busy_poll;              // microseconds, 0 = off
+} SocketTuning;
+
+SocketTuning tuning = { 0, FASTOPEN_QUEUE, 1, 1, 0 };
+
+// io_uring sends complete later, so a cork set now could not bracket them
+__thread int thread_cork_allowed = 1;
+
+int parse_socket_tuning(const char *list) {
+    char copy[BUF_SIZE];
+    char *saveptr;
+    
+    snprintf(copy, sizeof(copy), "%s", list);
+    for (char *opt = strtok_r(copy, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr)) {
+        int on = 1;
+        if (strncmp(opt, "no", 2) == 0 && strncmp(opt, "nodelay", 7) != 0) {
+            on = 0;
+            opt += 2;
+        }
+        char *value = strchr(opt, '=');
+        if (value != NULL) {
+            *value++ = '\0';
+            if (!on || !is_valid_integer(value) || value[0] == '\0' || atoi(value) <= 0) {
+                return -1;
+            }
+        }
+        
+        if (strcmp(opt, "defer") == 0) {
+            tuning.defer_accept = on ? (value ? atoi(value) : DEFER_ACCEPT_SECONDS) : 0;
+        } else if (strcmp(opt, "fastopen") == 0) {
+            tuning.fastopen = on ? (value ? atoi(value) : FASTOPEN_QUEUE) : 0;
+        } else if (strcmp(opt, "nodelay") == 0 && value == NULL) {
+            tuning.nodelay = on;
+        } else if (strcmp(opt, "cork") == 0 && value == NULL) {
+            tuning.cork = on;
+        } else if (strcmp(opt, "busypoll") == 0 && (value != NULL || !on)) {
+            tuning.busy_poll = on ? atoi(value) : 0;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Before listen(); a failure only costs the optimization
+void tune_listen_socket(int fd) {
+    if (tuning.defer_accept > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &tuning.defer_accept, sizeof(tuning.defer_accept)) < 0) {
+        perror("Error in setsockopt TCP_DEFER_ACCEPT");
+    }
+    if (tuning.fastopen > 0 &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &tuning.fastopen, sizeof(tuning.fastopen)) < 0) {
+        perror("Error in setsockopt TCP_FASTOPEN");
+    }
+    if (tuning.busy_poll > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &tuning.busy_poll, sizeof(tuning.busy_poll)) < 0) {
+        perror("Error in setsockopt SO_BUSY_POLL");
+    }
+}
+
+// Right after accept()
+void tune_client_socket(int fd) {
+    int opt = 1;
+    
+    if (tuning.nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+        perror("Error in setsockopt TCP_NODELAY");
+    }
+    if (tuning.busy_poll > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &tuning.busy_poll, sizeof(tuning.busy_poll)) < 0) {
+        perror("Error in setsockopt SO_BUSY_POLL");
+    }
+}
+
+// Returns 0 when the socket is (un)corked
+int socket_cork(int fd, int on) {
+    if (!tuning.cork || !thread_cork_allowed) {
+        return -1;
+    }
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0) {
+        if (errno != EBADF && errno != ENOTSOCK) {
+            perror("Error in setsockopt TCP_CORK");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+void print_socket_tuning(void) {
+    printf("Socket tuning:");
+    if (tuning.defer_accept > 0)
+        printf(" defer=%ds", tuning.defer_accept);
+    if (tuning.fastopen > 0)
+        printf(" fastopen=%d", tuning.fastopen);
+    if (tuning.nodelay)
+        printf(" nodelay");
+    if (tuning.cork)
+        printf(" cork");
+    if (tuning.busy_poll > 0)
+        printf(" busypoll=%dus", tuning.busy_poll);
+    printf("\n");
+    
+    // Bit 2 of the sysctl enables the server side of Fast Open
+    FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    int sysctl_value;
+    if (tuning.fastopen > 0 && f != NULL && fscanf(f, "%d", &sysctl_value) == 1 && !(sysctl_value & 2)) {
+        printf("Note: net.ipv4.tcp_fastopen=%d leaves Fast Open off for servers (needs bit 2)\n", sysctl_value);
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+}
+
+// ===================== Output buffering =====================
+// A prompt is usually several send_message() calls (text, menu, "Enter ...: ").
+// They are appended to the client's output buffer and written with one send()
+// when the client is next asked for input, instead of one syscall (and with
+// TCP_NODELAY one packet) each. Blocking handlers and reactor menus use a
+// per-thread buffer, dialogue coroutines carry their own since they can be
+// suspended with replies pending.
+
+__thread OutputBuffer thread_output;
+__thread OutputBuffer *current_output = NULL;  // where send_message() collects, if anywhere
+
+// Collect what is sent to client_socket from now on; queue is the reactor session's, or NULL
+void output_begin(int client_socket, OutQueue *queue) {
+    thread_output.fd = client_socket;
+    thread_output.len = 0;
+    thread_output.queue = queue;
+    current_output = &thread_output;
+}
+
+void output_append(OutputBuffer *out, const char *data, size_t len) {
+    if (out->capture) {
+        // Status messages for a binary response: keep what fits
+        if (len > OUTPUT_BUF_SIZE - out->len)
+            len = OUTPUT_BUF_SIZE - out->len;
+        memcpy(out->data + out->len, data, len);
+        out->len += len;
+        return;
+    }
+    if (out->len + len > OUTPUT_BUF_SIZE) {
+        output_flush_partial(out);
+        if (len > OUTPUT_BUF_SIZE) {
+            if (out->queue != NULL) {
+                outq_send(out->fd, out->queue, data, len);
+            } else {
+                send_bytes(out->fd, data, len);
+            }
+            return;
+        }
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+// Write out what was collected
+void output_send(OutputBuffer *out) {
+    if (out->len == 0 || out->capture) {
+        return;
+    }
+    if (out == &thread_output && thread_timed_out) {
+        out->len = 0;  // the handlers' replies while they unwind after a timeout
+        return;
+    }
+    int len = out->len;
+    out->len = 0;
+    if (out->queue != NULL) {
+        outq_send(out->fd, out->queue, out->data, len);
+    } else {
+        send_bytes(out->fd, out->data, len);
+    }
+}
+
+// The prompt is complete: send it, and let go of the cork if part of it went earlier
+void output_flush(OutputBuffer *out) {
+    if (out == NULL) {
+        return;
+    }
+    output_send(out);
+    if (out->corked) {
+        out->corked = 0;
+        socket_cork(out->fd, 0);
+    }
+}
+
+// More of this prompt follows: what goes now waits in the kernel for the rest
+void output_flush_partial(OutputBuffer *out) {
+    if (out == NULL) {
+        return;
+    }
+    if (!out->corked && out->len > 0 && !out->capture) {
+        out->corked = (socket_cork(out->fd, 1) == 0);
+    }
+    output_send(out);
+}
+
+// Send what is left and go back to sending directly
+void output_end(void) {
+    if (current_output != NULL) {
+        output_flush(current_output);
+        current_output = NULL;
+    }
+}
+
+// ===================== Outbound queues =====================
+// A reactor never blocks in send(). What a client's socket does not take
+// waits in the session's queue; the session then waits for EPOLLOUT instead
+// of input, so a client that stops reading stops being served without
+// holding anyone else up. Past outq_limit bytes the client is disconnected,
+// or under the drop policy the reply that does not fit is lost.
+
+// Queued bytes and casualties, shared by all reactor threads
+typedef struct {
+    long queued;               // bytes waiting in all queues
+    long disconnected;         // clients closed for leaving too much unread
+    long dropped;              // replies dropped under the drop policy
+} OutQueueStats;
+
+OutQueueStats outq_stats;
+
+// Send now if nothing is queued ahead, queue whatever the socket does not take
+void outq_send(int client_socket, OutQueue *q, const char *data, size_t len) {
+    if (q->discard) {
+        return;
+    }
+    while (q->head == NULL && len > 0) {
+        ssize_t n = send(client_socket, data, len, 0);
+        if (n > 0) {
+            data += n;
+            len -= n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            perror("Error sending message");
+            q->discard = 1;  // the reactor sees the error on its next read
+            return;
+        }
+    }
+    if (len == 0) {
+        return;
+    }
+    
+    if (q->bytes + len > outq_limit) {
+        if (outq_policy == OUTQ_DROP) {
+            __atomic_fetch_add(&outq_stats.dropped, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_add(&outq_stats.disconnected, 1, __ATOMIC_RELAXED);
+            printf("Client not reading its replies, disconnecting\n");
+            q->discard = 1;
+        }
+        return;
+    }
+    
+    OutChunk *chunk = malloc(sizeof(OutChunk) + len);
+    if (chunk == NULL) {
+        perror("Error queueing message");
+        return;
+    }
+    chunk->next = NULL;
+    chunk->len = len;
+    chunk->sent = 0;
+    memcpy(chunk->data, data, len);
+    if (q->tail != NULL) {
+        q->tail->next = chunk;
+    } else {
+        q->head = chunk;
+    }
+    q->tail = chunk;
+    q->bytes += len;
+    __atomic_fetch_add(&outq_stats.queued, len, __ATOMIC_RELAXED);
+}
+
+// Write as much of the queue as the socket takes; -1 when the connection is broken
+int outq_drain(int client_socket, OutQueue *q) {
+    while (q->head != NULL) {
+        struct iovec iov[OUTQ_IOV];
+        int count = 0;
+        for (OutChunk *c = q->head; c != NULL && count < OUTQ_IOV; c = c->next, count++) {
+            iov[count].iov_base = c->data + c->sent;
+            iov[count].iov_len = c->len - c->sent;
+        }
+        
+        ssize_t n = writev(client_socket, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("Error sending message");
+            return -1;
+        }
+        
+        q->bytes -= n;
+        __atomic_fetch_sub(&outq_stats.queued, n, __ATOMIC_RELAXED);
+        while (n > 0) {
+            OutChunk *c = q->head;
+            size_t left = c->len - c->sent;
+            if ((size_t)n < left) {
+                c->sent += n;
+                break;
+            }
+            n -= left;
+            q->head = c->next;
+            free(c);
+        }
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+    }
+    return 0;
+}
+
+void outq_free(OutQueue *q) {
+    while (q->head != NULL) {
+        OutChunk *c = q->head;
+        q->head = c->next;
+        free(c);
+    }
+    q->tail = NULL;
+    __atomic_fetch_sub(&outq_stats.queued, q->bytes, __ATOMIC_RELAXED);
+    q->bytes = 0;
+}
+
+void print_outq_stats(void) {
+    printf("Output queues: %ld bytes unread, %ld slow clients disconnected, %ld replies dropped (limit %zu KB, %s)\n",
+           __atomic_load_n(&outq_stats.queued, __ATOMIC_RELAXED),
+           __atomic_load_n(&outq_stats.disconnected, __ATOMIC_RELAXED),
+           __atomic_load_n(&outq_stats.dropped, __ATOMIC_RELAXED),
+           outq_limit / 1024, outq_policy == OUTQ_DROP ? "drop" : "disconnect");
+}
+
+// ===================== Command mode =====================
+// Machine clients can skip the menus: at the login menu a line such as
+// "LOGIN alice secret" or "LIST ENGINEERS" switches the connection to one
+// command per line. Each command reuses the interactive handlers, and its
+// response ends with a line that is exactly OK or ERR. The output buffer
+// sends the whole response in one write.
+
+// The line or frame a task started for it, which it copies before its first yield: the buffer it lies in is reused
+__thread const char *task_request;
+__thread int task_request_len;
+
+// Split off the next space-separated word of *p (NUL-terminated in place)
+char *next_word(char **p) {
+    char *word = *p + strspn(*p, " ");
+    if (*word == '\0') {
+        return NULL;
+    }
+    char *end = word + strcspn(word, " ");
+    if (*end != '\0') {
+        *end++ = '\0';
+    }
+    *p = end;
+    return word;
+}
+
+// Split fields at '|' into at most max pointers; returns how many there were
+int split_fields(char *text, char **fields, int max) {
+    int count = 0;
+    
+    while (1) {
+        char *bar = strchr(text, '|');
+        if (count == max) {
+            return max + 1;  // too many
+        }
+        fields[count++] = text;
+        if (bar == NULL) {
+            return count;
+        }
+        *bar = '\0';
+        text = bar + 1;
+    }
+}
+
+int is_command(const char *line) {
+    static const char *commands[] = { "LOGIN", "LOGOUT", "REGISTER", "LIST", "VIEW", "QUIT" };
+    size_t len = strcspn(line, " ");
+    
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if (strlen(commands[i]) == len && strncmp(line, commands[i], len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Send an error line followed by the ERR status; returns 0 so callers can "return command_error(...)"
+int command_error(int client_socket, const char *message) {
+    send_message(client_socket, message);
+    send_message(client_socket, "ERR\n");
+    return 0;
+}
+
+// Log the session in; sends the welcome or the reason it failed. Returns 0 on success.
+// Shared by command mode and the binary protocol.
+int do_login(Session *s, const char *username, const char *password) {
+    if (s->logged_in) {
+        send_message(s->fd, "Already logged in. LOGOUT first.\n");
+        return -1;
+    }
+    if (strlen(username) == 0 || strlen(username) >= MAX_USERNAME_LENGTH) {
+        send_message(s->fd, "Error: Invalid username (empty or to long).\n");
+        return -1;
+    }
+    if (strlen(password) == 0 || strlen(password) >= MAX_PASSWORD_LENGTH) {
+        send_message(s->fd, "Error: Invalid password (empty or to long).\n");
+        return -1;
+    }
+    if (contains_invalid_chars(username) || contains_invalid_chars(password)) {
+        send_message(s->fd, "Error: Username or password contains invalid characters.\n");
+        return -1;
+    }
+    if (!admit_login(s->fd, s->addr)) {
+        return -1;
+    }
+    if (is_pending_user(username)) {
+        send_message(s->fd, "Your account is pending approval by an administrator.\n");
+        return -1;
+    }
+    
+    strcpy(s->username, username);
+    strcpy(s->password, password);
+    int user_type = check_credentials(s->fd, s->username, s->password);
+    if (user_type <= 0) {
+        send_message(s->fd, "Invalid username or password. Please try again.\n");
+        return -1;
+    }
+    
+    char success_msg[BUF_SIZE];
+    snprintf(success_msg, BUF_SIZE, "Login successful! Welcome, %s!\n", s->username);
+    send_message(s->fd, success_msg);
+    s->user_type = user_type;
+    s->logged_in = 1;
+    add_user_to_online_list(s->username, s->password, user_type, s->fd);
+    return 0;
+}
+
+// Same checks as process_registration() and register_engineer(), all done before anything is
+// written. fields is the profile without the username (4 for engineers, 3 for organizations).
+int do_register(int client_socket, const char *username, const char *password, int user_type,
+                char **fields, int count) {
+    if (user_type != 1 && user_type != 2) {
+        send_message(client_socket, "Invalid user type. Registration failed.\n");
+        return -1;
+    }
+    if (user_type == 1 && count != 4) {
+        send_message(client_socket, "Engineer profile: <specialization>|<experience>|<education>|<skills>\n");
+        return -1;
+    }
+    if (user_type == 2 && count != 3) {
+        send_message(client_socket, "Organization profile: <name>|<industry>|<description>\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strpbrk(fields[i], "|\n") != NULL) {
+            send_message(client_socket, "Error: profile fields can't contain '|' or newlines.\n");
+            return -1;
+        }
+    }
+    
+    if (strlen(username) == 0 || strlen(username) >= MAX_USERNAME_LENGTH) {
+        send_message(client_socket, "Error: Invalid username (empty or to long).\n");
+        return -1;
+    }
+    if (contains_invalid_chars(username) || contains_invalid_file_chars(username)) {
+        send_message(client_socket, "Error: username contains invalid characters.\n");
+        return -1;
+    }
+    if (username_exists(username)) {
+        send_message(client_socket, "Username already exists. Please choose another one.\n");
+        return -1;
+    }
+    if (strlen(password) < 4 || strlen(password) >= MAX_PASSWORD_LENGTH) {
+        send_message(client_socket, "Error: Invalid password (minimum 4 characters, maximum reached).\n");
+        return -1;
+    }
+    if (contains_invalid_file_chars(password)) {
+        send_message(client_socket, "Error: password contains invalid characters.\n");
+        return -1;
+    }
+    if (user_type == 1) {
+        if (!is_valid_integer(fields[1]) || fields[1][0] == '\0') {
+            send_message(client_socket, "Invalid input. Enter a number.\n");
+            return -1;
+        }
+        if (atoi(fields[1]) > 60) {
+            send_message(client_socket, "Too many years of experience. Try again.\n");
+            return -1;
+        }
+        if (!is_valid_integer(fields[2]) || fields[2][0] == '\0') {
+            send_message(client_socket, "Education not in years. Try again.\n");
+            return -1;
+        }
+    }
+    
+    if (add_pending_user(client_socket, username, password, user_type) < 0) {
+        return -1;
+    }
+    int saved = (user_type == 1)
+        ? save_engineer_profile(client_socket, username, fields[0], fields[1], fields[2], fields[3])
+        : save_organization_profile(client_socket, username, fields[0], fields[1], fields[2]);
+    if (saved < 0) {
+        return -1;
+    }
+    
+    send_message(client_socket, "Your registration is pending approval by an administrator.\n");
+    return 0;
+}
+
+int command_login(Session *s, char *args) {
+    char *username = next_word(&args);
+    char *password = next_word(&args);
+    
+    if (username == NULL || password == NULL || next_word(&args) != NULL) {
+        return command_error(s->fd, "Usage: LOGIN <username> <password>\n");
+    }
+    send_message(s->fd, do_login(s, username, password) == 0 ? "OK\n" : "ERR\n");
+    return 0;
+}
+
+int command_register(Session *s, char *args) {
+    char *username = next_word(&args);
+    char *password = next_word(&args);
+    char *type = next_word(&args);
+    char *fields[4];
+    int user_type = 0;
+    
+    if (username == NULL || password == NULL || type == NULL) {
+        return command_error(s->fd, "Usage: REGISTER <username> <password> ENGINEER|ORGANIZATION <profile>\n");
+    }
+    if (strcmp(type, "ENGINEER") == 0) {
+        user_type = 1;
+    } else if (strcmp(type, "ORGANIZATION") == 0) {
+        user_type = 2;
+    }
+    
+    // The profile is the rest of the line, fields separated by '|' as in the profile files
+    int count = split_fields(args + strspn(args, " "), fields, 4);
+    send_message(s->fd, do_register(s->fd, username, password, user_type, fields, count) == 0 ? "OK\n" : "ERR\n");
+    return 0;
+}
+
+// REGISTER as a task: the thread serves other clients while its changes reach the disk
+void command_register_task(int client_socket) {
+    char args[BUF_SIZE];
+    
+    snprintf(args, sizeof(args), "%s", task_request);
+    command_register(current_coroutine->session, args);
+}
+
+// LIST as a task: the OK that ends the response comes after the last slice
+void command_list_engineers(int client_socket) {
+    send_message(client_socket, list_engineers(client_socket) < 0 ? "ERR\n" : "OK\n");
+}
+
+void command_list_organizations(int client_socket) {
+    send_message(client_socket, list_organizations(client_socket) < 0 ? "ERR\n" : "OK\n");
+}
+
+// Run one command line; returns -1 when the client asked to quit
+int command_execute(Session *s, char *line) {
+    char *args = line;
+    char *command = next_word(&args);
+    char *what = NULL;
+    
+    if (command == NULL) {
+        return command_error(s->fd, "Empty command.\n");
+    }
+    
+    if (strcmp(command, "LOGIN") == 0) {
+        return command_login(s, args);
+    } else if (strcmp(command, "REGISTER") == 0) {
+        task_request = args;
+        if (session_start_task(s, command_register_task)) {
+            return 0;
+        }
+        return command_register(s, args);
+    } else if (strcmp(command, "QUIT") == 0) {
+        send_message(s->fd, "Goodbye!\n");
+        send_message(s->fd, "OK\n");
+        return -1;
+    } else if (!is_command(command)) {
+        return command_error(s->fd, "Unknown command.\n");
+    }
+    
+    // The rest need a logged in user
+    if (!s->logged_in) {
+        return command_error(s->fd, "Not logged in. Use LOGIN <username> <password>.\n");
+    }
+    what = next_word(&args);
+    
+    if (strcmp(command, "LOGOUT") == 0) {
+        send_message(s->fd, "Logging out...\n");
+        remove_user_from_online_list(s->username);
+        s->logged_in = 0;
+    } else if (strcmp(command, "VIEW") == 0 && what != NULL && strcmp(what, "PROFILE") == 0) {
+        if (s->user_type == 3) {
+            return command_error(s->fd, "The admin has no profile.\n");
+        }
+        view_profile(s->fd, s->username, s->user_type);
+    } else if (strcmp(command, "LIST") == 0 && what != NULL && strcmp(what, "ENGINEERS") == 0) {
+        // Same lists the menus offer: organizations see engineers, engineers see organizations
+        if (s->user_type == 1) {
+            return command_error(s->fd, "Engineers can list organizations only.\n");
+        }
+        if (!session_start_task(s, command_list_engineers)) {
+            command_list_engineers(s->fd);  // no task here: it runs at once, OK or ERR included
+        }
+        return 0;
+    } else if (strcmp(command, "LIST") == 0 && what != NULL && strcmp(what, "ORGANIZATIONS") == 0) {
+        if (s->user_type == 2) {
+            return command_error(s->fd, "Organizations can list engineers only.\n");
+        }
+        if (!session_start_task(s, command_list_organizations)) {
+            command_list_organizations(s->fd);
+        }
+        return 0;
+    } else {
+        return command_error(s->fd, "Unknown command.\n");
+    }
+    
+    send_message(s->fd, "OK\n");
+    return 0;
+}
+
+// ===================== Binary protocol =====================
+// Integration services can exchange length-prefixed frames on the same port.
+// The client's first bytes are BINARY_MAGIC and BINARY_VERSION. A typed answer
+// never starts with a NUL, so they can't be mistaken for one. The server answers
+// with the same five bytes, after the text banner it sent on connect, so the
+// client skips everything up to them.
+//
+// Request:  u32 length | u8 type | fields                 (length counts type and fields)
+// Response: u32 length | u8 type | u8 status | str message | payload
+// str:      u16 length | bytes | NUL
+//
+// Integers are in network byte order. Strings keep their NUL on the wire, so
+// both sides use them where they lie in the receive buffer, without copying.
+// message is the text the menus would have shown, e.g. why a login failed.
+//
+// LOGIN              str username, str password   ->  u8 user_type
+// LOGOUT, QUIT                                    ->  -
+// REGISTER           str username, str password, u8 user_type, u8 n, n x str profile field  ->  -
+// VIEW_PROFILE                                    ->  u8 user_type, str username, u8 n, n x str profile field
+// LIST_ENGINEERS                                  ->  u16 n, n x (str username, str specialization, str experience, u8 online)
+// LIST_ORGANIZATIONS                              ->  u16 n, n x (str username, str name, str industry, u8 online)
+// LIST_PENDING       (admin)                      ->  u16 n, n x (str username, u8 user_type)
+// APPROVE            (admin) str username         ->  -
+// DELETE             (admin) str username         ->  -
+//
+// A list longer than its u16 count can say is refused with FAILED, not cut short.
+
+enum {
+    BIN_LOGIN = 1,
+    BIN_LOGOUT,
+    BIN_REGISTER,
+    BIN_VIEW_PROFILE,
+    BIN_LIST_ENGINEERS,
+    BIN_LIST_ORGANIZATIONS,
+    BIN_LIST_PENDING,
+    BIN_APPROVE,
+    BIN_QUIT,
+    BIN_DELETE
+};
+
+enum {
+    BIN_OK = 0,
+    BIN_FAILED,          // refused, message says why
+    BIN_BAD_REQUEST,     // malformed frame or unknown type
+    BIN_DENIED           // not logged in, or not allowed for this user type
+};
+
+// Response payload under construction, reused by every request of the thread
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;          // out of memory: the payload is incomplete
+} Frame;
+
+__thread Frame thread_payload;
+
+void frame_put(Frame *f, const void *data, size_t len) {
+    if (f->len + len > f->cap) {
+        size_t cap = f->cap ? f->cap : BUF_SIZE;
+        while (cap < f->len + len)
+            cap *= 2;
+        char *grown = realloc(f->data, cap);
+        if (grown == NULL) {
+            perror("Error allocating binary response");
+            f->failed = 1;
+            return;
+        }
+        f->data = grown;
+        f->cap = cap;
+    }
+    memcpy(f->data + f->len, data, len);
+    f->len += len;
+}
+
+void frame_u8(Frame *f, int value) {
+    unsigned char byte = value;
+    frame_put(f, &byte, 1);
+}
+
+void frame_u16(Frame *f, int value) {
+    uint16_t net = htons(value);
+    frame_put(f, &net, 2);
+}
+
+void frame_str(Frame *f, const char *str) {
+    size_t len = strlen(str);
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+    frame_u16(f, len);
+    frame_put(f, str, len);
+    frame_u8(f, 0);
+}
+
+// Reads fields in place from a request body
+typedef struct {
+    char *p;
+    int left;
+    int bad;             // ran past the end or found a malformed string
+} Reader;
+
+int read_u8(Reader *r) {
+    if (r->left < 1) {
+        r->bad = 1;
+        return 0;
+    }
+    r->left--;
+    return (unsigned char)*r->p++;
+}
+
+int read_u16(Reader *r) {
+    int high = read_u8(r);
+    return (high << 8) | read_u8(r);
+}
+
+// A NUL-terminated string inside the request; "" when malformed
+char *read_str(Reader *r) {
+    int len = read_u16(r);
+    if (r->bad || r->left < len + 1 || r->p[len] != '\0' || (int)strlen(r->p) != len) {
+        r->bad = 1;
+        return "";
+    }
+    char *str = r->p;
+    r->p += len + 1;
+    r->left -= len + 1;
+    return str;
+}
+
+// Raw bytes to the client, through its output buffer when it has one
+void binary_write(int client_socket, const void *data, size_t len) {
+    OutputBuffer *out = current_output;
+    if (out != NULL && out->fd == client_socket) {
+        output_append(out, data, len);
+    } else {
+        send_bytes(client_socket, data, len);
+    }
+}
+
+// Profile records being added to a response
+typedef struct {
+    Frame *frame;
+    int count;
+} RecordList;
+
+void add_engineer_record(void *ctx, char **fields) {
+    RecordList *list = ctx;
+    frame_str(list->frame, fields[0]);   // username
+    frame_str(list->frame, fields[1]);   // specialization
+    frame_str(list->frame, fields[2]);   // experience
+    frame_u8(list->frame, is_user_online(fields[0]));
+    list->count++;
+}
+
+void add_organization_record(void *ctx, char **fields) {
+    RecordList *list = ctx;
+    frame_str(list->frame, fields[0]);   // username
+    frame_str(list->frame, fields[1]);   // organization name
+    frame_str(list->frame, fields[2]);   // industry
+    frame_u8(list->frame, is_user_online(fields[0]));
+    list->count++;
+}
+
+// Fill in the u16 count of the list that starts at count_at; a list that
+// couldn't be read, or whose count doesn't fit, is dropped and refused
+int binary_list_end(Session *s, Frame *f, size_t count_at, long count) {
+    if (count < 0 || count > UINT16_MAX) {
+        f->len = count_at;
+        send_message(s->fd, (count < 0) ? "Error opening user database!\n" : "Too many users to list.\n");
+        return BIN_FAILED;
+    }
+    if (!f->failed) {
+        uint16_t net = htons(count);
+        memcpy(f->data + count_at, &net, 2);
+    }
+    return BIN_OK;
+}
+
+// Profiles of the users of user_type, preceded by their count
+int binary_list_profiles(Session *s, Frame *f, int user_type, int max, void (*add)(void *ctx, char **fields)) {
+    RecordList list = { f, 0 };
+    size_t count_at = f->len;
+    
+    frame_u16(f, 0);
+    if (for_each_profile(user_type, max, add, &list) < 0) {
+        return binary_list_end(s, f, count_at, -1);
+    }
+    return binary_list_end(s, f, count_at, list.count);
+}
+
+// Pending users, preceded by their count, read straight from the store
+int binary_list_pending(Session *s, Frame *f) {
+    StoreCursor c;
+    Record *r;
+    long count = 0;
+    size_t count_at = f->len;
+    
+    frame_u16(f, 0);
+    store_cursor_init(&c);
+    while ((r = store_next(&c)) != NULL) {
+        if (r->state != RECORD_PENDING || strcmp(r->username, "admin") == 0) {
+            continue;
+        }
+        frame_str(f, r->username);
+        frame_u8(f, r->user_type);
+        count++;
+    }
+    if (c.failed) {
+        return binary_list_end(s, f, count_at, -1);
+    }
+    if (count == 0) {
+        send_message(s->fd, "No pending users to approve.\n");
+    }
+    return binary_list_end(s, f, count_at, count);
+}
+
+// Handle one request body; returns the status, or -1 after QUIT
+int binary_handle(Session *s, int type, Reader *r, Frame *payload) {
+    switch (type) {
+        case BIN_LOGIN: {
+            char *username = read_str(r);
+            char *password = read_str(r);
+            if (r->bad)
+                return BIN_BAD_REQUEST;
+            if (do_login(s, username, password) < 0)
+                return BIN_FAILED;
+            frame_u8(payload, s->user_type);
+            return BIN_OK;
+        }
+        case BIN_REGISTER: {
+            char *fields[4];
+            char *username = read_str(r);
+            char *password = read_str(r);
+            int user_type = read_u8(r);
+            int count = read_u8(r);
+            for (int i = 0; i < count && i < 4; i++)
+                fields[i] = read_str(r);
+            if (r->bad || count > 4)
+                return BIN_BAD_REQUEST;
+            return do_register(s->fd, username, password, user_type, fields, count) == 0 ? BIN_OK : BIN_FAILED;
+        }
+        case BIN_QUIT:
+            send_message(s->fd, "Goodbye!\n");
+            return -1;
+        case BIN_LOGOUT:
+        case BIN_VIEW_PROFILE:
+        case BIN_LIST_ENGINEERS:
+        case BIN_LIST_ORGANIZATIONS:
+        case BIN_LIST_PENDING:
+        case BIN_APPROVE:
+        case BIN_DELETE:
+            break;
+        default:
+            send_message(s->fd, "Unknown request type.\n");
+            return BIN_BAD_REQUEST;
+    }
+    
+    // The rest need a logged in user
+    if (!s->logged_in) {
+        send_message(s->fd, "Not logged in.\n");
+        return BIN_DENIED;
+    }
+    
+    switch (type) {
+        case BIN_LOGOUT:
+            send_message(s->fd, "Logging out...\n");
+            remove_user_from_online_list(s->username);
+            s->logged_in = 0;
+            return BIN_OK;
+        case BIN_VIEW_PROFILE: {
+            char line[BUF_SIZE * 4];
+            char *fields[5];
+            int max = (s->user_type == 1) ? 5 : 4;
+            if (s->user_type == 3) {
+                send_message(s->fd, "The admin has no profile.\n");
+                return BIN_DENIED;
+            }
+            int found = find_profile(s->user_type, s->username, line, sizeof(line), fields, max);
+            if (found < 0) {
+                send_message(s->fd, "Error retrieving profile information!\n");
+                return BIN_FAILED;
+            }
+            frame_u8(payload, s->user_type);
+            frame_str(payload, s->username);
+            frame_u8(payload, found ? max - 1 : 0);
+            for (int i = 1; found && i < max; i++)
+                frame_str(payload, fields[i]);
+            return BIN_OK;
+        }
+        case BIN_LIST_ENGINEERS:
+            // Same lists the menus offer: organizations see engineers, engineers see organizations
+            if (s->user_type == 1) {
+                send_message(s->fd, "Engineers can list organizations only.\n");
+                return BIN_DENIED;
+            }
+            return binary_list_profiles(s, payload, 1, 5, add_engineer_record);
+        case BIN_LIST_ORGANIZATIONS:
+            if (s->user_type == 2) {
+                send_message(s->fd, "Organizations can list engineers only.\n");
+                return BIN_DENIED;
+            }
+            return binary_list_profiles(s, payload, 2, 4, add_organization_record);
+        default:
+            break;
+    }
+    
+    // Approvals and deletions are for the admin
+    if (s->user_type != 3) {
+        send_message(s->fd, "Only the admin can do this.\n");
+        return BIN_DENIED;
+    }
+    
+    if (type == BIN_DELETE) {
+        char *username = read_str(r);
+        if (r->bad)
+            return BIN_BAD_REQUEST;
+        int user_type = active_user_type(username);
+        if (user_type < 0) {
+            send_message(s->fd, "Error opening user database!\n");
+            return BIN_FAILED;
+        }
+        if (user_type == 0 || strcmp(username, "admin") == 0) {
+            send_message(s->fd, "No user with that name.\n");
+            return BIN_FAILED;
+        }
+        if (remove_user(s->fd, username) != 0)
+            return BIN_FAILED;
+        send_message(s->fd, "User successfully deleted.\n");
+        return BIN_OK;
+    }
+    
+    if (type == BIN_LIST_PENDING)
+        return binary_list_pending(s, payload);
+    
+    char *username = read_str(r);
+    if (r->bad)
+        return BIN_BAD_REQUEST;
+    int state = user_state(username, NULL, NULL, NULL);
+    if (state < 0) {
+        send_message(s->fd, "Error accessing pending users!\n");
+        return BIN_FAILED;
+    }
+    if (state != RECORD_PENDING || strcmp(username, "admin") == 0) {
+        send_message(s->fd, "No pending user with that name.\n");
+        return BIN_FAILED;
+    }
+    if (move_user_from_pending_to_active(username) < 0) {
+        send_message(s->fd, "Error accessing user database!\n");
+        return BIN_FAILED;
+    }
+    send_message(s->fd, "User successfully approved.\n");
+    return BIN_OK;
+}
+
+// Answer one request frame; returns -1 when the connection should close
+int binary_request(Session *s, char *body, int len) {
+    Reader r = { body, len, 0 };
+    Frame task_payload = { NULL, 0, 0, 0 };
+    // A task may park in the middle (see wal_commit()) while the thread answers others
+    Frame *payload = (current_coroutine != NULL) ? &task_payload : &thread_payload;
+    OutputBuffer *out = current_output;
+    OutputBuffer capture = { .fd = s->fd, .capture = 1 };
+    
+    int type = read_u8(&r);
+    payload->len = 0;
+    payload->failed = 0;
+    
+    // Messages the shared handlers send become the response's message field
+    current_output = &capture;
+    int status = binary_handle(s, type, &r, payload);
+    current_output = out;
+    
+    if (status == BIN_BAD_REQUEST && capture.len == 0) {
+        const char *bad = "Malformed request.\n";
+        capture.len = strlen(bad);
+        memcpy(capture.data, bad, capture.len);
+    }
+    if (payload->failed || status == BIN_BAD_REQUEST) {
+        payload->len = 0;
+    }
+    
+    unsigned char header[8];
+    uint32_t total = htonl(1 + 1 + 2 + capture.len + 1 + payload->len);
+    uint16_t message_len = htons(capture.len);
+    memcpy(header, &total, 4);
+    header[4] = type;
+    header[5] = (status < 0) ? BIN_OK : status;
+    memcpy(header + 6, &message_len, 2);
+    
+    binary_write(s->fd, header, sizeof(header));
+    binary_write(s->fd, capture.data, capture.len);
+    binary_write(s->fd, "", 1);
+    if (payload->len > 0) {
+        binary_write(s->fd, payload->data, payload->len);
+    }
+    free(task_payload.data);
+    return status < 0 ? -1 : 0;
+}
+
+// A request that changes the store, as a task: the thread serves other clients while the change reaches the disk
+void binary_request_task(int client_socket) {
+    char body[INPUT_BUF_SIZE];
+    int len = task_request_len;
+    
+    memcpy(body, task_request, len);
+    binary_request(current_coroutine->session, body, len);
+}
+
+// Check the handshake, then answer every complete frame buffered in `in`
+// (the session's ring in the reactor, thread_input in the blocking models);
+// returns -1 to close the connection
+int binary_process(Session *s, InputBuffer *in) {
+    char scratch[INPUT_BUF_SIZE];
+    char *body;
+    int len = 0;
+    
+    if (s->binary == 1) {
+        char hello[BINARY_MAGIC_LEN + 1];
+        if (input_take(in, hello, sizeof(hello)) < 0) {
+            return 0;  // wait for the rest of it
+        }
+        
+        // Answer with what this server speaks; a client with another version hangs up
+        binary_write(s->fd, BINARY_MAGIC, BINARY_MAGIC_LEN);
+        binary_write(s->fd, (char[]){ BINARY_VERSION }, 1);
+        if (memcmp(hello, BINARY_MAGIC, BINARY_MAGIC_LEN) != 0 || hello[BINARY_MAGIC_LEN] != BINARY_VERSION) {
+            printf("Binary handshake failed\n");
+            return -1;
+        }
+        s->binary = 2;
+    }
+    
+    // Frames behind a task wait until it has finished
+    while (!session_task_pending(s) && (len = input_next_frame(in, scratch, &body)) >= 0) {
+        if (len > 0 && (body[0] == BIN_REGISTER || body[0] == BIN_APPROVE || body[0] == BIN_DELETE)) {
+            task_request = body;
+            task_request_len = len;
+            if (session_start_task(s, binary_request_task)) {
+                continue;
+            }
+        }
+        if (binary_request(s, body, len) < 0) {
+            return -1;
+        }
+    }
+    if (len == -2) {
+        fprintf(stderr, "Binary frame too large, closing connection\n");
+        return -1;
+    }
+    return 0;
+}
+
+// ===================== HTTP API =====================
+// With -P port the reactors also accept HTTP/1.1 on that port, in the same
+// event loops as the menu clients, and answer read-only JSON:
+//
+// GET /engineers         [{"username", "specialization", "experience", "education", "skills", "online"}, ...]
+// GET /organizations     [{"username", "name", "industry", "description", "online"}, ...]
+// GET /profile/{user}    one of the above plus "type": "engineer" or "organization"
+//
+// Connections are kept alive (unless the client says otherwise) and requests
+// may be pipelined. A list is sent with chunked encoding, one chunk per
+// record (split_profile(), as the menus read them), only as fast as the
+// socket takes it: once replies wait in the outbound queue the list stops,
+// with its file still open, and goes on when the queue has drained. So a
+// response is never built whole. There is no login: serve it on a port
+// only the dashboards can reach.
+
+int http_port = 0;   // -P: 0 leaves the HTTP API off
+long http_requests;  // answered, in all threads
+
+typedef struct {
+    char method[16];
+    char path[BUF_SIZE];
+    int chunked;      // HTTP/1.1: lists can be sent in chunks
+    int keep_alive;   // the connection stays open after the response
+} HttpRequest;
+
+// JSON text of one response or list record
+typedef struct {
+    char data[BUF_SIZE * 8];
+    size_t len;
+    int full;         // something didn't fit and was left out
+} Json;
+
+void json_raw(Json *j, const char *text) {
+    size_t len = strlen(text);
+    if (j->len + len >= sizeof(j->data)) {
+        j->full = 1;
+        return;
+    }
+    memcpy(j->data + j->len, text, len);
+    j->len += len;
+}
+
+// A quoted string; the newline ending a profile record is left out
+void json_str(Json *j, const char *str) {
+    size_t len = strlen(str);
+    while (len > 0 && (str[len - 1] == '\n' || str[len - 1] == '\r')) {
+        len--;
+    }
+    
+    json_raw(j, "\"");
+    for (size_t i = 0; i < len && !j->full; i++) {
+        unsigned char c = str[i];
+        char escaped[8] = { c, '\0' };
+        if (c == '"' || c == '\\') {
+            snprintf(escaped, sizeof(escaped), "\\%c", c);
+        } else if (c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        }
+        json_raw(j, escaped);
+    }
+    json_raw(j, "\"");
+}
+
+// "name": "value", after a comma unless it is the first member
+void json_field(Json *j, const char *name, const char *value) {
+    if (j->len > 0 && j->data[j->len - 1] != '{') {
+        json_raw(j, ",");
+    }
+    json_str(j, name);
+    json_raw(j, ":");
+    json_str(j, value);
+}
+
+void json_engineer(Json *j, char **fields) {
+    json_field(j, "username", fields[0]);
+    json_field(j, "specialization", fields[1]);
+    json_field(j, "experience", fields[2]);
+    json_field(j, "education", fields[3]);
+    json_field(j, "skills", fields[4]);
+    json_raw(j, is_user_online(fields[0]) ? ",\"online\":true}" : ",\"online\":false}");
+}
+
+void json_organization(Json *j, char **fields) {
+    json_field(j, "username", fields[0]);
+    json_field(j, "name", fields[1]);
+    json_field(j, "industry", fields[2]);
+    json_field(j, "description", fields[3]);
+    json_raw(j, is_user_online(fields[0]) ? ",\"online\":true}" : ",\"online\":false}");
+}
+
+// 1 once the ring holds a whole request head, up to its empty line.
+// Empty lines before a request line are skipped, as clients may send them.
+int http_head_complete(InputBuffer *in) {
+    int line_len = 0, lines = 0;
+    
+    for (int i = 0; i < in->len; i++) {
+        char c = in->data[(in->start + i) % INPUT_BUF_SIZE];
+        if (c == '\n') {
+            if (line_len == 0 && lines > 0)
+                return 1;
+            if (line_len > 0)
+                lines++;
+            line_len = 0;
+        } else if (c != '\r') {
+            line_len++;
+        }
+    }
+    return 0;
+}
+
+// Next line of the head without its CRLF
+int http_next_line(InputBuffer *in, char *line, int size) {
+    int len = input_next_line(in, line, size);
+    if (len > 0 && line[len - 1] == '\r') {
+        line[--len] = '\0';
+    }
+    return len;
+}
+
+void http_write(Session *s, const char *data, size_t len) {
+    binary_write(s->fd, data, len);
+}
+
+// Status line and headers; length < 0 sends the body chunked (or up to the close under HTTP/1.0)
+void http_head(Session *s, HttpRequest *req, const char *status, long length) {
+    char head[256];
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: application/json\r\n", status);
+    
+    if (length >= 0) {
+        n += snprintf(head + n, sizeof(head) - n, "Content-Length: %ld\r\n", length);
+    } else if (req->chunked) {
+        n += snprintf(head + n, sizeof(head) - n, "Transfer-Encoding: chunked\r\n");
+    } else {
+        req->keep_alive = 0;  // the end of the body is the end of the connection
+    }
+    if (!req->keep_alive) {
+        n += snprintf(head + n, sizeof(head) - n, "Connection: close\r\n");
+    }
+    n += snprintf(head + n, sizeof(head) - n, "\r\n");
+    http_write(s, head, n);
+}
+
+void http_respond(Session *s, HttpRequest *req, const char *status, const char *body) {
+    http_head(s, req, status, strlen(body));
+    http_write(s, body, strlen(body));
+}
+
+void http_error(Session *s, HttpRequest *req, const char *status) {
+    Json j = { .len = 0, .full = 0 };
+    json_raw(&j, "{");
+    json_field(&j, "error", status + 4);  // the reason phrase
+    json_raw(&j, "}");
+    j.data[j.len] = '\0';
+    http_respond(s, req, status, j.data);
+}
+
+// Piece of a body sent with http_head(..., -1)
+void http_chunk(Session *s, HttpRequest *req, const char *data, size_t len) {
+    if (req->chunked) {
+        char size[16];
+        int n = snprintf(size, sizeof(size), "%zx\r\n", len);
+        http_write(s, size, n);
+    }
+    http_write(s, data, len);
+    if (req->chunked) {
+        http_write(s, "\r\n", 2);
+    }
+}
+
+// Send list records until the store ends or the socket stops taking them.
+// Returns 1 once the list is complete, 0 while it waits for the socket
+// (http_process() goes on with it), -1 if the response can't be finished.
+int http_stream_list(Session *s) {
+    HttpPending *p = &s->http_pending;
+    HttpRequest req = { .chunked = p->chunked, .keep_alive = p->keep_alive };
+    char line[BUF_SIZE * 4];
+    char *fields[5];
+    int max = p->engineers ? 5 : 4;
+    Record *r;
+    
+    // Only the epoll reactor has a queue to watch; io_uring sends it all at once
+    while (s->outq.head == NULL && (r = store_next(p->cursor)) != NULL) {
+        Json j = { .len = 0, .full = 0 };
+        
+        if (r->state == RECORD_FREE || r->user_type != (p->engineers ? 1 : 2) || r->profile_len == 0) {
+            continue;
+        }
+        if (record_line(r, line, sizeof(line)) < 0) {
+            p->cursor->failed = 1;
+            break;
+        }
+        if (split_profile(line, fields, max) < 3) {
+            continue;
+        }
+        json_raw(&j, p->count == 0 ? "[{" : ",{");
+        if (p->engineers) {
+            json_engineer(&j, fields);
+        } else {
+            json_organization(&j, fields);
+        }
+        if (j.full) {
+            fprintf(stderr, "Warning: profile of %s too long for the HTTP API\n", fields[0]);
+            continue;  // a truncated record would break the whole list
+        }
+        if (p->count++ == 0) {
+            http_head(s, &req, "200 OK", -1);
+            p->keep_alive = req.keep_alive;  // HTTP/1.0 ends the body by closing
+        }
+        http_chunk(s, &req, j.data, j.len);
+    }
+    if (s->outq.head != NULL) {
+        return 0;
+    }
+    if (p->cursor->failed) {
+        perror("Error reading profiles");
+        http_pending_end(s);
+        return -1;  // the client sees the chunks stop short
+    }
+    
+    if (p->count == 0) {
+        http_respond(s, &req, "200 OK", "[]");
+    } else {
+        http_chunk(s, &req, "]", 1);
+        if (req.chunked) {
+            http_write(s, "0\r\n\r\n", 5);
+        }
+    }
+    http_pending_end(s);
+    return 1;
+}
+
+void http_list(Session *s, HttpRequest *req, int engineers) {
+    HttpPending *p = &s->http_pending;
+    
+    p->cursor = malloc(sizeof(StoreCursor));
+    if (p->cursor == NULL) {
+        http_error(s, req, "500 Internal Server Error");
+        return;
+    }
+    store_cursor_init(p->cursor);
+    p->engineers = engineers;
+    p->chunked = req->chunked;
+    p->keep_alive = req->keep_alive;
+    p->count = 0;
+    int ret = http_stream_list(s);
+    if (ret != 0) {
+        req->keep_alive = (ret > 0) && p->keep_alive;
+    }
+}
+
+void http_pending_end(Session *s) {
+    free(s->http_pending.cursor);
+    s->http_pending.cursor = NULL;
+}
+
+void http_profile(Session *s, HttpRequest *req, const char *username) {
+    char line[BUF_SIZE * 4];
+    char *fields[5];
+    Json j = { .len = 0, .full = 0 };
+    
+    // Same records as view_profile(): engineers have 5 fields, organizations 4
+    int found = find_profile(1, username, line, sizeof(line), fields, 5);
+    if (found > 0) {
+        json_raw(&j, "{\"type\":\"engineer\"");
+        json_engineer(&j, fields);
+    } else if (found == 0) {
+        found = find_profile(2, username, line, sizeof(line), fields, 4);
+        if (found > 0) {
+            json_raw(&j, "{\"type\":\"organization\"");
+            json_organization(&j, fields);
+        }
+    }
+    
+    if (found < 0 || j.full) {
+        http_error(s, req, "500 Internal Server Error");
+    } else if (found == 0) {
+        http_error(s, req, "404 Not Found");
+    } else {
+        j.data[j.len] = '\0';
+        http_respond(s, req, "200 OK", j.data);
+    }
+}
+
+void http_route(Session *s, HttpRequest *req) {
+    char *query = strchr(req->path, '?');
+    if (query != NULL) {
+        *query = '\0';  // no endpoint takes parameters
+    }
+    
+    if (strcmp(req->method, "GET") != 0) {
+        http_error(s, req, "405 Method Not Allowed");
+    } else if (strcmp(req->path, "/engineers") == 0) {
+        http_list(s, req, 1);
+    } else if (strcmp(req->path, "/organizations") == 0) {
+        http_list(s, req, 0);
+    } else if (strncmp(req->path, "/profile/", 9) == 0 && req->path[9] != '\0' &&
+               strchr(req->path + 9, '/') == NULL) {
+        http_profile(s, req, req->path + 9);
+    } else {
+        http_error(s, req, "404 Not Found");
+    }
+}
+
+// Answer every complete request received so far, in order; -1 closes the connection
+int http_process(Session *s, InputBuffer *in) {
+    char line[BUF_SIZE];
+    int len;
+    
+    // A list the client's socket stopped taking is finished first
+    if (s->http_pending.cursor != NULL) {
+        int ret = (s->outq.head != NULL) ? 0 : http_stream_list(s);
+        if (ret <= 0) {
+            return ret;
+        }
+        if (!s->http_pending.keep_alive) {
+            return -1;
+        }
+    }
+    
+    while (s->outq.head == NULL && http_head_complete(in)) {
+        HttpRequest req;
+        int major = 0, minor = 0, has_body = 0;
+        
+        while ((len = http_next_line(in, line, sizeof(line))) == 0) {
+        }
+        if (sscanf(line, "%15s %1023s HTTP/%d.%d", req.method, req.path, &major, &minor) != 4 || major != 1) {
+            req.chunked = req.keep_alive = 0;
+            http_error(s, &req, "400 Bad Request");
+            return -1;
+        }
+        req.chunked = req.keep_alive = (minor >= 1);
+        
+        while ((len = http_next_line(in, line, sizeof(line))) > 0) {
+            char *value = strchr(line, ':');
+            if (value == NULL)
+                continue;
+            *value++ = '\0';
+            if (strcasecmp(line, "Connection") == 0) {
+                if (strcasestr(value, "close") != NULL)
+                    req.keep_alive = 0;
+                else if (strcasestr(value, "keep-alive") != NULL)
+                    req.keep_alive = 1;
+            } else if (strcasecmp(line, "Transfer-Encoding") == 0 ||
+                       (strcasecmp(line, "Content-Length") == 0 && atol(value) != 0)) {
+                has_body = 1;
+            }
+        }
+        if (has_body) {
+            req.keep_alive = 0;  // no endpoint reads a body, so the next request can't be found
+        }
+        
+        http_route(s, &req);
+        __atomic_fetch_add(&http_requests, 1, __ATOMIC_RELAXED);
+        s->http = 2;
+        if (s->http_pending.cursor != NULL) {
+            return 0;  // the rest of the list goes out as the socket takes it
+        }
+        if (!req.keep_alive) {
+            return -1;
+        }
+    }
+    if (in->len == INPUT_BUF_SIZE && !http_head_complete(in)) {
+        HttpRequest req = { .chunked = 0, .keep_alive = 0 };
+        http_error(s, &req, "431 Request Header Fields Too Large");
+        return -1;
+    }
+    return 0;
+}
+
+void print_http_stats(void) {
+    if (http_port > 0) {
+        printf("HTTP: %ld requests answered on port %d\n",
+               __atomic_load_n(&http_requests, __ATOMIC_RELAXED), http_port);
+    }
+}
+
+// ===================== Coroutines =====================
+// Dialogues such as process_registration() are written as blocking code.
+// In the reactor they run as coroutines: receive_string() swaps back to the
+// event loop instead of blocking (send_message() goes through the session's
+// outbound queue and never blocks), and the loop swaps the dialogue back in
+// once the client has answered. Each dialogue gets a small
+// mmap'ed stack with a guard page; stacks are pooled per thread so starting
+// a dialogue costs no syscalls once the pool is warm.
+
+__thread Coroutine *current_coroutine = NULL;
+__thread char *stack_pool[STACK_POOL_SIZE];
+__thread int stack_pool_count = 0;
+
+// Coroutine stack usage, shared by all reactor threads
+typedef struct {
+    long started;
+    long stacks_mapped;        // stacks currently mmap'ed, pooled or in use
+    long suspended;            // dialogues currently waiting on a client
+    long suspended_bytes;      // stack bytes in use by the suspended dialogues
+    long peak_bytes;           // deepest stack use seen at a suspension point
+    long peak_resident;        // most stack bytes a finished dialogue left resident
+} CoroutineStats;
+
+CoroutineStats coroutine_stats;
+
+char *stack_get(void) {
+    if (stack_pool_count > 0) {
+        return stack_pool[--stack_pool_count];
+    }
+    
+    // Lowest page stays PROT_NONE so an overflow faults instead of corrupting memory
+    long page = sysconf(_SC_PAGESIZE);
+    char *mem = mmap(NULL, COROUTINE_STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    mprotect(mem, page, PROT_NONE);
+    __atomic_add_fetch(&coroutine_stats.stacks_mapped, 1, __ATOMIC_RELAXED);
+    return mem + page;
+}
+
+// Bytes of the stack backed by physical pages, i.e. what the dialogue really cost
+long stack_resident_bytes(char *stack) {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned char pages[COROUTINE_STACK_SIZE / 4096 + 1];
+    long resident = 0;
+    
+    if (mincore(stack, COROUTINE_STACK_SIZE, pages) < 0) {
+        return 0;
+    }
+    for (long i = 0; i < COROUTINE_STACK_SIZE / page; i++) {
+        if (pages[i] & 1)
+            resident += page;
+    }
+    return resident;
+}
+
+void stack_put(char *stack) {
+    long resident = stack_resident_bytes(stack);
+    long peak = __atomic_load_n(&coroutine_stats.peak_resident, __ATOMIC_RELAXED);
+    while (resident > peak && !__atomic_compare_exchange_n(&coroutine_stats.peak_resident, &peak, resident,
+                                                           0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    
+    if (stack_pool_count < STACK_POOL_SIZE) {
+        stack_pool[stack_pool_count++] = stack;
+        return;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    munmap(stack - page, COROUTINE_STACK_SIZE + page);
+    __atomic_sub_fetch(&coroutine_stats.stacks_mapped, 1, __ATOMIC_RELAXED);
+}
+
+// makecontext() only passes ints, so the pointer travels in two halves
+void coroutine_main(unsigned int low, unsigned int high) {
+    Coroutine *co = (Coroutine *)(((uintptr_t)high << 32) | (uintptr_t)low);
+    co->entry(co->fd);
+    output_flush(&co->output);
+    co->done = 1;
+    // Returning resumes co->caller through uc_link
+}
+
+// Swap back to the event loop; returns when the loop resumes this dialogue
+void coroutine_yield(void) {
+    Coroutine *co = current_coroutine;
+    char marker;
+    long used = (co->stack + COROUTINE_STACK_SIZE) - &marker;
+    
+    __atomic_add_fetch(&coroutine_stats.suspended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&coroutine_stats.suspended_bytes, used, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&coroutine_stats.peak_bytes, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&coroutine_stats.peak_bytes, &peak, used, 0,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    
+    current_coroutine = NULL;
+    swapcontext(&co->context, &co->caller);
+    current_coroutine = co;
+    
+    __atomic_sub_fetch(&coroutine_stats.suspended, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&coroutine_stats.suspended_bytes, used, __ATOMIC_RELAXED);
+}
+
+void coroutine_resume(Coroutine *co) {
+    OutputBuffer *caller_output = current_output;
+    
+    current_coroutine = co;
+    current_output = &co->output;
+    swapcontext(&co->caller, &co->context);
+    current_coroutine = NULL;
+    current_output = caller_output;
+}
+
+// Start entry(fd) on a pooled stack and run it up to its first suspension
+Coroutine *coroutine_start(void (*entry)(int), int fd, OutQueue *queue, void *session) {
+    Coroutine *co = calloc(1, sizeof(Coroutine));
+    if (co == NULL) {
+        return NULL;
+    }
+    co->stack = stack_get();
+    if (co->stack == NULL) {
+        free(co);
+        return NULL;
+    }
+    co->entry = entry;
+    co->fd = fd;
+    co->nread = -1;
+    co->output.fd = fd;
+    co->output.queue = queue;
+    co->session = session;
+    
+    getcontext(&co->context);
+    co->context.uc_stack.ss_sp = co->stack;
+    co->context.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+    co->context.uc_link = &co->caller;
+    uintptr_t ptr = (uintptr_t)co;
+    makecontext(&co->context, (void (*)(void))coroutine_main, 2,
+                (unsigned int)(ptr & 0xffffffffu), (unsigned int)(ptr >> 32));
+    
+    __atomic_add_fetch(&coroutine_stats.started, 1, __ATOMIC_RELAXED);
+    coroutine_resume(co);
+    return co;
+}
+
+void coroutine_free(Coroutine *co) {
+    if (co == NULL) {
+        return;
+    }
+    stack_put(co->stack);
+    free(co);
+}
+
+// receive_string() for a dialogue: wait for the reactor to hand over the next line
+char *coroutine_receive_string(Coroutine *co) {
+    output_flush(&co->output);
+    if (!co->eof) {
+        co->nread = -1;
+        coroutine_yield();
+    }
+    if (co->eof || co->nread < 0) {
+        return NULL;
+    }
+    return co->input;
+}
+
+// send_bytes() for a dialogue; its replies normally go through the session's queue instead
+void coroutine_send_bytes(Coroutine *co, int client_socket, const char *data, size_t len) {
+    if (co->eof) {
+        return;  // nobody left to read it
+    }
+#ifdef HAVE_LIBURING
+    if (uring_send_bytes(client_socket, data, len)) {
+        return;
+    }
+#endif
+    // Not a reactor session's socket: nothing to queue it in
+    if (send(client_socket, data, len, MSG_DONTWAIT) != (ssize_t)len) {
+        perror("Error sending message");
+    }
+}
+
+void print_coroutine_stats(void) {
+    long suspended = __atomic_load_n(&coroutine_stats.suspended, __ATOMIC_RELAXED);
+    long suspended_bytes = __atomic_load_n(&coroutine_stats.suspended_bytes, __ATOMIC_RELAXED);
+    
+    printf("Coroutines: %ld started, %ld suspended, %ld stacks of %d KB mapped\n",
+           __atomic_load_n(&coroutine_stats.started, __ATOMIC_RELAXED), suspended,
+           __atomic_load_n(&coroutine_stats.stacks_mapped, __ATOMIC_RELAXED), COROUTINE_STACK_SIZE / 1024);
+    printf("Coroutine stack in use: %ld bytes per suspended dialogue, %ld bytes peak, %ld bytes resident at most\n",
+           suspended > 0 ? suspended_bytes / suspended : 0,
+           __atomic_load_n(&coroutine_stats.peak_bytes, __ATOMIC_RELAXED),
+           __atomic_load_n(&coroutine_stats.peak_resident, __ATOMIC_RELAXED));
+}
+
+// ===================== Latency classes =====================
+// A reactor thread serves every client on one stack, so a long listing or a
+// rewrite of the data files delays every keystroke that arrives meanwhile.
+// Work that may take long therefore runs as a task: a coroutine like the
+// dialogues, which calls sched_yield_point() where it may be interrupted.
+// There the task goes to the thread's run queue of its class. Each loop
+// iteration first handles the events that arrived, i.e. the interactive
+// work, and then gives queued tasks SCHED_BUDGET_US: admin writes before bulk
+// slices, in turn within a class. While a task is queued the loop doesn't
+// sleep, and its session takes no more lines until it has finished.
+//
+// A task waiting for the storage writer parks instead (see sched_park()):
+// it is off the run queues until its changes are durable, and the writer's
+// eventfd wakes the loop for it. Then it goes back to the queue of its own
+// class; a dialogue that parked goes to the interactive one, ahead of the rest.
+//
+// Latencies are kept per class: an interactive line from the loop waking up to
+// its reply, a task from its first yield point to its end. kill -USR1 prints them.
+
+const char *latency_class_names[CLASS_COUNT] = { "interactive", "admin", "bulk" };
+
+// Sessions whose task waits to run, one queue per class
+typedef struct {
+    Session *head[CLASS_COUNT];
+    Session *tail[CLASS_COUNT];
+    int queued;
+    int enabled;        // a reactor loop runs the queues of this thread
+    Session *parked;    // tasks waiting for the storage writer
+    int parked_count;   // read by the writer thread
+    int wake_fd;        // the writer's eventfd for this loop, -1: parked tasks can't be woken
+} RunQueue;
+
+__thread RunQueue thread_run_queue;
+__thread int64_t thread_wake_us;   // when the loop last woke up
+
+// Histogram of one class, shared by all reactor threads
+typedef struct {
+    long count;
+    long max_us;
+    long buckets[LATENCY_BUCKETS];
+} LatencyStats;
+
+LatencyStats latency_stats[CLASS_COUNT];
+
+int64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void latency_record(LatencyClass c, int64_t us) {
+    LatencyStats *l = &latency_stats[c];
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us >= ((int64_t)1 << bucket)) {
+        bucket++;
+    }
+    __atomic_add_fetch(&l->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&l->buckets[bucket], 1, __ATOMIC_RELAXED);
+    long max = __atomic_load_n(&l->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&l->max_us, &max, (long)us, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Upper bound of the bucket holding the p-th fraction of the samples
+long latency_percentile(LatencyStats *l, long count, double p) {
+    long rank = (long)(count * p);
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&l->buckets[i], __ATOMIC_RELAXED);
+        if (seen > rank) {
+            return 1L << i;
+        }
+    }
+    return 1L << (LATENCY_BUCKETS - 1);
+}
+
+void sched_enqueue(Session *s, LatencyClass c) {
+    RunQueue *q = &thread_run_queue;
+    s->run_next = NULL;
+    if (q->tail[c] != NULL) {
+        q->tail[c]->run_next = s;
+    } else {
+        q->head[c] = s;
+    }
+    q->tail[c] = s;
+    s->run_queued = 1;
+    q->queued++;
+}
+
+// Take s out of its run queue, or off the parked list, when it closes
+void sched_remove(Session *s) {
+    RunQueue *q = &thread_run_queue;
+    if (s->dialogue != NULL && s->dialogue->durable_wait != 0) {
+        for (Session **link = &q->parked; *link != NULL; link = &(*link)->park_next) {
+            if (*link == s) {
+                *link = s->park_next;
+                break;
+            }
+        }
+        s->dialogue->durable_wait = 0;
+        __atomic_sub_fetch(&q->parked_count, 1, __ATOMIC_SEQ_CST);
+    }
+    if (!s->run_queued) {
+        return;
+    }
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        Session *prev = NULL;
+        for (Session *it = q->head[c]; it != NULL; prev = it, it = it->run_next) {
+            if (it != s) {
+                continue;
+            }
+            if (prev != NULL) {
+                prev->run_next = s->run_next;
+            } else {
+                q->head[c] = s->run_next;
+            }
+            if (q->tail[c] == s) {
+                q->tail[c] = prev;
+            }
+            s->run_queued = 0;
+            q->queued--;
+            return;
+        }
+    }
+}
+
+// Let interactive work go first: a task of a reactor session stops here and
+// goes on later from its run queue; elsewhere (prefork, fork, dialogues
+// outside the reactors) nothing happens
+void sched_yield_point(LatencyClass c) {
+    Coroutine *co = current_coroutine;
+    if (co == NULL || co->session == NULL || co->eof) {
+        return;  // no scheduler, or the session is closing and wants it finished
+    }
+    
+    output_flush(&co->output);
+    co->runnable = 1;
+    co->latency_class = c;
+    if (co->queued_us == 0) {
+        co->queued_us = monotonic_us();
+    }
+    Session *s = co->session;
+    if (s->outq.head == NULL) {
+        sched_enqueue(s, c);
+    }
+    // Otherwise the client is behind on reading: sched_wake() queues it once the socket took everything
+    coroutine_yield();
+}
+
+// Queue the parked tasks whose changes the storage writer has synced
+void sched_unpark(void) {
+    RunQueue *q = &thread_run_queue;
+    Session **link = &q->parked;
+    
+    while (*link != NULL) {
+        Session *s = *link;
+        if (!wal_durable(s->dialogue->durable_wait)) {
+            link = &s->park_next;
+            continue;
+        }
+        *link = s->park_next;
+        s->dialogue->durable_wait = 0;
+        __atomic_sub_fetch(&q->parked_count, 1, __ATOMIC_SEQ_CST);
+        if (s->outq.head == NULL) {
+            sched_enqueue(s, s->dialogue->latency_class);
+        }
+        // Otherwise sched_wake() queues it once the socket took everything
+    }
+}
+
+// Let the task wait for change seq to reach the disk without holding up the
+// thread: it parks, taking no lines, until the storage writer wakes the loop.
+// 0 when the caller must block instead: no reactor task, the session is
+// closing or finishing its task at once, or nothing would wake the loop
+int sched_park(uint64_t seq) {
+    Coroutine *co = current_coroutine;
+    RunQueue *q = &thread_run_queue;
+    if (co == NULL || co->session == NULL || co->eof || co->finishing || q->wake_fd < 0 || !q->enabled) {
+        return 0;
+    }
+    
+    Session *s = co->session;
+    OutputBuffer *out = current_output;  // a binary request answers into its capture
+    output_flush(&co->output);
+    co->runnable = 1;  // it keeps its latency class: sched_unpark() queues it there
+    if (co->queued_us == 0) {
+        co->queued_us = monotonic_us();
+    }
+    co->durable_wait = seq;
+    s->park_next = q->parked;
+    q->parked = s;
+    __atomic_add_fetch(&q->parked_count, 1, __ATOMIC_SEQ_CST);
+    if (wal_durable(seq)) {
+        sched_unpark();  // the writer may have looked before the count went up
+    }
+    coroutine_yield();
+    current_output = out;
+    return 1;
+}
+
+// The queued replies of s were sent: its task may run again
+void sched_wake(Session *s) {
+    if (s->dialogue != NULL && s->dialogue->runnable && s->dialogue->durable_wait == 0 &&
+        !s->run_queued && s->outq.head == NULL) {
+        sched_enqueue(s, s->dialogue->latency_class);
+    }
+}
+
+// A task of the session is waiting to run: its next lines wait until it has finished
+int session_task_pending(Session *s) {
+    return s->dialogue != NULL && s->dialogue->runnable;
+}
+
+// Run the task of s up to its next yield point; when it is over, the session
+// goes back to its menu and takes the lines that arrived meanwhile
+int session_run_task(Session *s) {
+    Coroutine *co = s->dialogue;
+    LatencyClass c = co->latency_class;
+    int64_t queued_us = co->queued_us;
+    
+    co->runnable = 0;
+    coroutine_resume(co);
+    if (co->done) {
+        latency_record(c, monotonic_us() - queued_us);
+    }
+    session_dialogue_resumed(s);
+    return session_process_input(s);
+}
+
+// Run the task of s to its end at once, e.g. when its input has no room left to wait in
+int session_finish_task(Session *s) {
+    while (session_task_pending(s)) {
+        Coroutine *co = s->dialogue;
+        sched_remove(s);
+        co->finishing = 1;  // waits for the storage writer in place
+        if (session_run_task(s) < 0) {
+            return -1;
+        }
+        if (s->dialogue == co) {
+            co->finishing = 0;
+        }
+    }
+    return 0;
+}
+
+// Run queued tasks for at most SCHED_BUDGET_US, most urgent class first (an
+// interactive one is only queued back from sched_park()); run(s) is the
+// reactor's way to give the task of s one slice
+void sched_run(void (*run)(Session *s)) {
+    RunQueue *q = &thread_run_queue;
+    int64_t deadline = monotonic_us() + SCHED_BUDGET_US;
+    
+    while (q->queued > 0) {
+        int c = CLASS_INTERACTIVE;
+        while (q->head[c] == NULL) {
+            c++;
+        }
+        Session *s = q->head[c];
+        q->head[c] = s->run_next;
+        if (q->head[c] == NULL) {
+            q->tail[c] = NULL;
+        }
+        s->run_queued = 0;
+        q->queued--;
+        
+        if (s->outq.head != NULL) {
+            continue;  // still sending an earlier slice: sched_wake() queues it again
+        }
+        run(s);  // a task that stops at another yield point is queued at the tail again
+        if (monotonic_us() >= deadline) {
+            break;
+        }
+    }
+}
+
+// How long the loop may sleep: not at all while tasks are queued
+int sched_wait_ms(int timeout_ms) {
+    return thread_run_queue.queued > 0 ? 0 : timeout_ms;
+}
+
+void print_latency_stats(void) {
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        LatencyStats *l = &latency_stats[c];
+        long count = __atomic_load_n(&l->count, __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        printf("Latency %s: %ld requests, p50 < %ld us, p99 < %ld us, max %ld us\n",
+               latency_class_names[c], count, latency_percentile(l, count, 0.5),
+               latency_percentile(l, count, 0.99), __atomic_load_n(&l->max_us, __ATOMIC_RELAXED));
+    }
+}
+
+// ===================== Server statistics =====================
+// kill -USR1 <pid> makes the next reactor that wakes up print these.
+
+volatile sig_atomic_t stats_requested = 0;
+
+void handle_stats_request(int sig) {
+    stats_requested = 1;
+}
+
+void print_server_stats(void) {
+    printf("===== Server statistics =====\n");
+    print_coroutine_stats();
+    print_latency_stats();
+    print_timeout_stats();
+    print_admission_stats();
+    print_outq_stats();
+    print_memory_stats();
+    print_http_stats();
+    print_store_stats();
+    print_wal_stats();
+    print_index_stats();
+    print_filter_stats();
+    fflush(stdout);
+}
+
+void check_stats_request(void) {
+    if (stats_requested) {
+        stats_requested = 0;
+        print_server_stats();
+    }
+}
+
+// ===================== Timer wheel =====================
+// Each reactor thread keeps the deadlines of its sessions in its own wheel.
+// Re-arming a deadline on every input is two list operations and no syscall;
+// the loop reads the clock when it wakes up and, while any deadline is
+// pending, sleeps no longer than the next tick.
+
+__thread TimerWheel thread_timers;
+
+// Sessions closed for missing their deadline, in all threads (or this process)
+typedef struct {
+    long prompt;               // while at a prompt
+    long idle;                 // while idle in a main menu
+} TimeoutStats;
+
+TimeoutStats timeout_stats;
+
+uint64_t timer_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+void timer_wheel_init(TimerWheel *w) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            Timer *head = &w->slots[level][i];
+            head->next = head->prev = head;
+        }
+    }
+    w->now = timer_ticks();
+    w->count = 0;
+    w->ready = 1;
+}
+
+// Link t into the slot its expiry falls in, on the finest level that reaches that far
+void timer_link(TimerWheel *w, Timer *t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    
+    Timer *head = &w->slots[level][(t->expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+// (Re)schedule t to fire at the given tick
+void timer_add(TimerWheel *w, Timer *t, uint64_t expires) {
+    uint64_t max = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    
+    if (!w->ready) {
+        timer_wheel_init(w);
+    }
+    timer_cancel(w, t);
+    if (expires <= w->now) {
+        expires = w->now + 1;
+    } else if (expires - w->now > max) {
+        expires = w->now + max;
+    }
+    t->expires = expires;
+    timer_link(w, t);
+    w->count++;
+}
+
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (t->next == NULL) {
+        return;
+    }
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    w->count--;
+}
+
+// The current slot of a coarser level has come up: spread its timers over the finer levels
+void timer_cascade(TimerWheel *w, int level) {
+    Timer *head = &w->slots[level][(w->now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+    Timer *t = head->next;
+    
+    head->next = head->prev = head;
+    while (t != head) {
+        Timer *next = t->next;
+        timer_link(w, t);
+        t = next;
+    }
+}
+
+// Fire every timer that is due; expire() gets each one already unlinked and may free it
+void timer_advance(TimerWheel *w, void (*expire)(Timer *t)) {
+    if (!w->ready) {
+        return;
+    }
+    
+    uint64_t now = timer_ticks();
+    while (w->now < now && w->count > 0) {
+        w->now++;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS &&
+             ((w->now >> (TIMER_WHEEL_BITS * (level - 1))) & (TIMER_WHEEL_SLOTS - 1)) == 0; level++) {
+            timer_cascade(w, level);
+        }
+        
+        Timer *head = &w->slots[0][w->now & (TIMER_WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            Timer *t = head->next;
+            timer_cancel(w, t);
+            expire(t);
+        }
+    }
+    if (w->count == 0) {
+        w->now = now;  // nothing scheduled, no need to walk the ticks in between
+    }
+}
+
+// How long the event loop may sleep: until the next tick, or forever when nothing is scheduled
+int timer_wait_ms(TimerWheel *w) {
+    if (w->count == 0) {
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long into_tick = ((ts.tv_sec % TIMER_TICK_MS) * 1000 + ts.tv_nsec / 1000000) % TIMER_TICK_MS;
+    return TIMER_TICK_MS - into_tick + 1;
+}
+
+// Waiting in a main menu (or logged in on a command/binary connection, or
+// between two HTTP requests) gets the long deadline
+int session_is_idle(Session *s) {
+    return s->state == ST_MAIN_MENU || s->state == ST_ADMIN_MENU ||
+           (s->logged_in && (s->command_mode || s->binary)) ||
+           (s->http == 2 && s->input == NULL);
+}
+
+// Called whenever the session starts waiting for the client again
+void session_arm_timer(Session *s) {
+    int seconds = session_is_idle(s) ? idle_timeout : prompt_timeout;
+    
+    s->timer.data = s;
+    timer_add(&thread_timers, &s->timer, timer_ticks() + (uint64_t)seconds * 1000 / TIMER_TICK_MS);
+}
+
+// Tell the client why it is being dropped; the reactor then closes the session
+void session_timed_out(Session *s) {
+    printf("Timeout: client didn't respond in time.\n");
+    count_timeout(session_is_idle(s));
+    if (s->http) {
+        return;  // an HTTP client just sees the connection close
+    }
+    
+    output_begin(s->fd, thread_epfd >= 0 ? &s->outq : NULL);  // io_uring queues on its ring
+    send_message(s->fd, TIMEOUT_MESSAGE);
+    output_end();
+}
+
+void count_timeout(int idle) {
+    __atomic_fetch_add(idle ? &timeout_stats.idle : &timeout_stats.prompt, 1, __ATOMIC_RELAXED);
+}
+
+void print_timeout_stats(void) {
+    printf("Timeouts: %ld sessions closed at a prompt (%d s), %ld idle in a menu (%d s)\n",
+           __atomic_load_n(&timeout_stats.prompt, __ATOMIC_RELAXED), prompt_timeout,
+           __atomic_load_n(&timeout_stats.idle, __ATOMIC_RELAXED), idle_timeout);
+}
+
+// ===================== Admission control =====================
+// Connections and logins are refused before they cost anything. Past the
+// connection limit, or once the client's address has used up its bucket,
+// the new socket gets one short message and is closed; an address out of
+// login tokens is refused before the credentials are looked up.
+// The table is a shared mapping so the limits hold across worker processes.
+
+Admission *admission = NULL;
+
+void admission_init(void) {
+    admission = mmap(NULL, sizeof(Admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission == MAP_FAILED)
+        erro("error creating admission table");
+    
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    for (int i = 0; i < ADMISSION_LOCKS; i++) {
+        pthread_mutex_init(&admission->locks[i], &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+}
+
+int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Refill the buckets of addr and take one token for a connection or a login; 0 when there is none
+int ip_bucket_take(uint32_t addr, int login) {
+    int rate = login ? login_rate : conn_rate;
+    if (rate <= 0) {
+        return 1;
+    }
+    
+    int64_t now = monotonic_ms();
+    unsigned set = ((ntohl(addr) * 2654435761u) >> 16) % ADMISSION_SETS;
+    IpBucket *ways = admission->buckets[set];
+    IpBucket *b = NULL, *oldest = &ways[0];
+    int ok = 0;
+    
+    pthread_mutex_lock(&admission->locks[set % ADMISSION_LOCKS]);
+    for (int i = 0; i < ADMISSION_WAYS && b == NULL; i++) {
+        if (ways[i].addr == addr) {
+            b = &ways[i];
+        } else if (ways[i].last_ms < oldest->last_ms) {
+            oldest = &ways[i];
+        }
+    }
+    if (b == NULL) {
+        // First time seen (or forgotten): full buckets, in place of the least recently seen address
+        b = oldest;
+        b->addr = addr;
+        b->conn_tokens = CONN_BURST * 1000000LL;
+        b->login_tokens = LOGIN_BURST * 1000000LL;
+        b->last_ms = now;
+    }
+    
+    // rate per minute is rate * 1000000 / 60000 millionths of a token per millisecond
+    int64_t elapsed = now - b->last_ms;
+    b->last_ms = now;
+    b->conn_tokens += elapsed * conn_rate * 50 / 3;
+    if (b->conn_tokens > CONN_BURST * 1000000LL)
+        b->conn_tokens = CONN_BURST * 1000000LL;
+    b->login_tokens += elapsed * login_rate * 50 / 3;
+    if (b->login_tokens > LOGIN_BURST * 1000000LL)
+        b->login_tokens = LOGIN_BURST * 1000000LL;
+    
+    int64_t *tokens = login ? &b->login_tokens : &b->conn_tokens;
+    if (*tokens >= 1000000) {
+        *tokens -= 1000000;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&admission->locks[set % ADMISSION_LOCKS]);
+    return ok;
+}
+
+// Called right after accept(); when it returns 0 the caller just closes the socket
+int admit_connection(int client_socket, uint32_t addr) {
+    if (__atomic_add_fetch(&admission->active, 1, __ATOMIC_RELAXED) > max_connections && max_connections > 0) {
+        __atomic_fetch_add(&admission->shed_full, 1, __ATOMIC_RELAXED);
+    } else if (!ip_bucket_take(addr, 0)) {
+        __atomic_fetch_add(&admission->shed_rate, 1, __ATOMIC_RELAXED);
+    } else {
+        return 1;
+    }
+    
+    __atomic_fetch_sub(&admission->active, 1, __ATOMIC_RELAXED);
+    send(client_socket, BUSY_MESSAGE, strlen(BUSY_MESSAGE), MSG_DONTWAIT | MSG_NOSIGNAL);
+    return 0;
+}
+
+// An admitted connection has been closed
+void release_connection(void) {
+    __atomic_fetch_sub(&admission->active, 1, __ATOMIC_RELAXED);
+}
+
+// Before a login touches the files; tells the client when it is refused
+int admit_login(int client_socket, uint32_t addr) {
+    if (ip_bucket_take(addr, 1)) {
+        return 1;
+    }
+    __atomic_fetch_add(&admission->shed_login, 1, __ATOMIC_RELAXED);
+    send_message(client_socket, LOGIN_LIMIT_MESSAGE);
+    return 0;
+}
+
+uint32_t peer_address(int client_socket) {
+    struct sockaddr_in addr;
+    socklen_t addr_size = sizeof(addr);
+    
+    if (getpeername(client_socket, (struct sockaddr *)&addr, &addr_size) < 0) {
+        return 0;
+    }
+    return addr.sin_addr.s_addr;
+}
+
+void print_admission_stats(void) {
+    printf("Connections: %ld active (max %d), refused %ld at the limit and %ld over the per-IP rate\n",
+           __atomic_load_n(&admission->active, __ATOMIC_RELAXED), max_connections,
+           __atomic_load_n(&admission->shed_full, __ATOMIC_RELAXED),
+           __atomic_load_n(&admission->shed_rate, __ATOMIC_RELAXED));
+    printf("Logins: %ld attempts refused over the per-IP rate\n",
+           __atomic_load_n(&admission->shed_login, __ATOMIC_RELAXED));
+}
+
+// ===================== Hot restart =====================
+// A server started with -H path also listens on that Unix socket. A new
+// build started with the same -H path connects there first: the running
+// server passes its listening sockets over (SCM_RIGHTS) and the new one
+// serves them as they are, without bind(), so the accept queue survives and
+// no connection is refused in between. Once the new process confirms it is
+// ready, the old one stops accepting and lets its sessions finish, for at
+// most -D seconds. Nobody ever clears O_NONBLOCK on a listener, so every
+// mode copes with one that a reactor made non-blocking.
+
+char *handoff_path = NULL;
+int drain_timeout = DRAIN_TIMEOUT;
+int handoff_fd = -1;                // where the next build asks for the listeners
+int handoff_peer = -1;              // new process: the old one, until we confirm
+int inherited_fds[HANDOFF_MAX_FDS]; // taken over from the old process, not used yet
+int inherited_count = 0;
+int listen_fds[HANDOFF_MAX_FDS];    // listening sockets of this process
+int listen_count = 0;
+int drain_pipe[2] = { -1, -1 };     // readable once the listeners were handed over
+volatile int draining = 0;
+int64_t drain_deadline_ms;
+__thread int thread_sessions = 0;   // open sessions of this reactor thread
+
+// New process: ask a running server for its listening sockets
+void handoff_take_over(void) {
+    struct sockaddr_un addr;
+    
+    if (handoff_path == NULL) {
+        return;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", handoff_path);
+    
+    int peer = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (peer < 0) {
+        erro("error in socket function");
+    }
+    if (connect(peer, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(peer);  // nobody there: a cold start
+        return;
+    }
+    
+    int count = 0;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = { &count, sizeof(count) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    ssize_t n = recvmsg(peer, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(count) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        count <= 0 || count > HANDOFF_MAX_FDS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count)) {
+        fprintf(stderr, "Hot restart: no listening sockets received from %s\n", handoff_path);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(inherited_fds, CMSG_DATA(cmsg), sizeof(int) * count);
+    inherited_count = count;
+    handoff_peer = peer;
+    printf("Hot restart: took over %d listening socket(s) from the running server\n", count);
+    fflush(stdout);
+}
+
+// Port a listening socket is bound to
+int socket_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) < 0 || addr.sin_family != AF_INET) {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+// An inherited listener on port, now ours to serve; -1 when none is left
+int take_inherited(int port) {
+    for (int i = 0; i < inherited_count; i++) {
+        if (socket_port(inherited_fds[i]) == port) {
+            int fd = inherited_fds[i];
+            inherited_fds[i] = inherited_fds[--inherited_count];
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// How many inherited listeners are on port; *reuse_port tells whether they share it
+int inherited_listeners(int port, int *reuse_port) {
+    int count = 0;
+    
+    for (int i = 0; i < inherited_count; i++) {
+        if (socket_port(inherited_fds[i]) == port) {
+            socklen_t len = sizeof(*reuse_port);
+            getsockopt(inherited_fds[i], SOL_SOCKET, SO_REUSEPORT, reuse_port, &len);
+            count++;
+        }
+    }
+    return count;
+}
+
+// Our listeners are in place: release the old process and wait for the next build
+void handoff_ready(int use_thread) {
+    struct sockaddr_un addr;
+    
+    if (inherited_count > 0) {
+        printf("Hot restart: %d inherited listening socket(s) not used in this mode, closing them\n",
+               inherited_count);
+        while (inherited_count > 0) {
+            close(inherited_fds[--inherited_count]);
+        }
+    }
+    if (handoff_peer >= 0) {
+        send(handoff_peer, "1", 1, MSG_NOSIGNAL);
+        close(handoff_peer);
+        handoff_peer = -1;
+    }
+    if (handoff_path == NULL) {
+        return;
+    }
+    
+    if (pipe(drain_pipe) < 0) {
+        erro("error creating drain pipe");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", handoff_path);
+    
+    // The old process no longer answers on the path, it is ours now
+    unlink(handoff_path);
+    if ((handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        erro("error in socket function");
+    if (bind(handoff_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        erro("error binding the hot restart socket");
+    if (listen(handoff_fd, 1) < 0)
+        erro("error in listen function");
+    
+    if (use_thread) {
+        // Reactors only learn about it through the drain pipe
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, handoff_thread, NULL) != 0)
+            erro("error creating hot restart thread");
+        pthread_detach(thread);
+    }
+}
+
+// Old process: hand the listeners to the build that connected; 1 once it took them
+int handoff_serve(void) {
+    int peer = accept(handoff_fd, NULL, NULL);
+    if (peer < 0) {
+        if (errno != EINTR)
+            perror("Error accepting hot restart");
+        return 0;
+    }
+    
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = { &listen_count, sizeof(listen_count) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * listen_count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listen_count);
+    memcpy(CMSG_DATA(cmsg), listen_fds, sizeof(int) * listen_count);
+    
+    // Keep serving unless the new process confirms it has its listeners up
+    struct timeval tv = { .tv_sec = HANDOFF_ACK_TIMEOUT, .tv_usec = 0 };
+    char ack;
+    ssize_t n;
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while ((n = sendmsg(peer, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    if (n > 0) {
+        while ((n = recv(peer, &ack, 1, 0)) < 0 && errno == EINTR) {
+        }
+    }
+    if (n != 1) {
+        printf("Hot restart: the new process did not take over, still serving\n");
+        close(peer);
+        return 0;
+    }
+    close(peer);
+    close(handoff_fd);  // not unlinked: the path belongs to the new process now
+    handoff_fd = -1;
+    
+    draining = 1;
+    drain_deadline_ms = monotonic_ms() + (int64_t)drain_timeout * 1000;
+    printf("Hot restart: listeners handed over, finishing %ld connection(s) within %d s\n",
+           __atomic_load_n(&admission->active, __ATOMIC_RELAXED), drain_timeout);
+    fflush(stdout);
+    if (write(drain_pipe[1], "1", 1) < 0) {
+        perror("Error waking the reactors");
+    }
+    return 1;
+}
+
+void *handoff_thread(void *arg) {
+    while (!handoff_serve()) {
+    }
+    return NULL;
+}
+
+// While draining: 1 once nothing is left open or the deadline has passed
+int drain_over(long open) {
+    if (open > 0 && monotonic_ms() < drain_deadline_ms) {
+        return 0;
+    }
+    if (open > 0) {
+        printf("Hot restart: drain deadline reached, closing %ld connection(s)\n", open);
+    }
+    return 1;
+}
+
+// ===================== Admin control socket =====================
+// With -A path a thread of the main process listens on that Unix socket
+// (mode 0600) for bulk admin work, one batch per line:
+//
+//   approve <user>...                 make pending users active
+//   delete [--type=1|2] <user>...     remove them and their profiles (--type: only users of that type)
+//   pending                           list who is waiting for approval
+//
+// A batch takes the storage lock once and then costs one index lookup and
+// one in-place write of the record store per user it names. Every line gets
+// one line of JSON:
+//
+//   {"command":"approve","requested":3,"done":2,"failed":[{"user":"carol","error":"not pending"}],"ms":1}
+//
+// Try it with:  echo "approve alice bob" | socat - UNIX-CONNECT:admin.sock
+
+char *admin_path = NULL;
+int admin_fd = -1;
+
+// The users named by one batch, sorted so a name given twice is applied once
+typedef struct {
+    char **names;
+    int count;
+    int *result;        // per name: the type of the user it was applied to, 0 none found,
+                        // minus the type of a user delete had to leave alone
+} AdminBatch;
+
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Make every pending user of the batch active; storage_lock held
+int admin_approve(AdminBatch *b) {
+    for (int i = 0; i < b->count; i++) {
+        Record r;
+        long slot = store_find(b->names[i], &r);
+        if (slot == -2) {
+            return -1;
+        }
+        if (slot >= 0 && r.state == RECORD_PENDING) {
+            if (store_set_state(slot, &r, RECORD_ACTIVE) < 0) {
+                return -1;
+            }
+            b->result[i] = r.user_type;
+        }
+    }
+    return 0;
+}
+
+// Remove the users of the batch (only those of only_type when it isn't 0); storage_lock held
+int admin_delete(AdminBatch *b, int only_type) {
+    for (int i = 0; i < b->count; i++) {
+        Record r;
+        long slot = store_find(b->names[i], &r);
+        if (slot == -2) {
+            return -1;
+        }
+        if (slot < 0 || r.state != RECORD_ACTIVE) {
+            continue;
+        }
+        if ((r.user_type != 1 && r.user_type != 2) || (only_type != 0 && r.user_type != only_type)) {
+            b->result[i] = -r.user_type;  // the admin, or not of only_type
+            continue;
+        }
+        if (store_remove(slot, &r) < 0) {
+            return -1;
+        }
+        b->result[i] = r.user_type;
+    }
+    return 0;
+}
+
+// Why a user of a finished batch was not applied
+const char *admin_failure(const char *command, int result) {
+    if (strcmp(command, "approve") == 0) {
+        return "not pending";
+    }
+    if (result == -3) {
+        return "the admin can't be deleted";
+    }
+    return result < 0 ? "not of that type" : "no such user";
+}
+
+// Write reply to the admin client; MSG_NOSIGNAL because prefork and fork don't ignore SIGPIPE
+int admin_send(int fd, const char *reply, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, reply, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        reply += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// One Json per record keeps a reply of thousands of users from filling it up
+void admin_json(FILE *out, Json *j) {
+    fwrite(j->data, 1, j->len, out);
+    j->len = 0;
+    j->full = 0;
+}
+
+void admin_error(FILE *out, const char *command, const char *reason) {
+    Json j = { .len = 0, .full = 0 };
+    json_raw(&j, "{");
+    json_field(&j, "command", command);
+    json_field(&j, "error", reason);
+    json_raw(&j, "}\n");
+    admin_json(out, &j);
+}
+
+// {"command":"pending","count":N,"users":[{"user":"alice","type":1},...]}
+void admin_pending(FILE *out) {
+    Json j = { .len = 0, .full = 0 };
+    char number[16];
+    int count = 0;
+    StoreCursor c;
+    Record *r;
+    
+    json_raw(&j, "{\"command\":\"pending\",\"users\":[");
+    admin_json(out, &j);
+    store_cursor_init(&c);
+    while ((r = store_next(&c)) != NULL) {
+        if (r->state != RECORD_PENDING) {
+            continue;
+        }
+        json_raw(&j, count++ ? ",{" : "{");
+        json_field(&j, "user", r->username);
+        snprintf(number, sizeof(number), ",\"type\":%d}", r->user_type);
+        json_raw(&j, number);
+        admin_json(out, &j);
+    }
+    
+    fprintf(out, "],\"count\":%d%s}\n", count, c.failed ? ",\"error\":\"can't read the record store\"" : "");
+}
+
+// Run one command line, writing its JSON reply to out
+void admin_execute(FILE *out, char *line) {
+    char *saveptr;
+    char *command = strtok_r(line, " \t\r\n", &saveptr);
+    int only_type = 0;
+    
+    if (command == NULL) {
+        return;
+    }
+    if (strcmp(command, "pending") == 0) {
+        admin_pending(out);
+        return;
+    }
+    if (strcmp(command, "approve") != 0 && strcmp(command, "delete") != 0) {
+        admin_error(out, command, "unknown command (use approve, delete or pending)");
+        return;
+    }
+    
+    // The names point into line; sorting drops the repeated ones
+    AdminBatch b = { .names = NULL, .count = 0, .result = NULL };
+    int capacity = 0;
+    for (char *word = strtok_r(NULL, " \t\r\n", &saveptr); word; word = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        if (strncmp(word, "--type=", 7) == 0 && strcmp(command, "delete") == 0) {
+            only_type = atoi(word + 7);
+            if (only_type != 1 && only_type != 2) {
+                admin_error(out, command, "--type must be 1 (engineers) or 2 (organizations)");
+                free(b.names);
+                return;
+            }
+            continue;
+        }
+        if (b.count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **names = realloc(b.names, capacity * sizeof(char *));
+            if (names == NULL) {
+                admin_error(out, command, "out of memory");
+                free(b.names);
+                return;
+            }
+            b.names = names;
+        }
+        b.names[b.count++] = word;
+    }
+    if (b.count == 0) {
+        admin_error(out, command, "no users given");
+        return;
+    }
+    qsort(b.names, b.count, sizeof(char *), compare_names);
+    int unique = 1;
+    for (int i = 1; i < b.count; i++) {
+        if (strcmp(b.names[i], b.names[unique - 1]) != 0) {
+            b.names[unique++] = b.names[i];
+        }
+    }
+    b.count = unique;
+    b.result = calloc(b.count, sizeof(int));
+    if (b.result == NULL) {
+        admin_error(out, command, "out of memory");
+        free(b.names);
+        return;
+    }
+    
+    int64_t start = monotonic_ms();
+    pthread_mutex_lock(storage_lock);
+    int ret = (strcmp(command, "approve") == 0) ? admin_approve(&b) : admin_delete(&b, only_type);
+    pthread_mutex_unlock(storage_lock);
+    // One wait for the whole batch: its changes reach the disk together
+    if (ret == 0 && wal_commit() < 0) {
+        ret = -1;
+    }
+    int64_t elapsed = monotonic_ms() - start;
+    
+    int done = 0;
+    for (int i = 0; i < b.count; i++) {
+        if (b.result[i] > 0) {
+            done++;
+        }
+    }
+    printf("Admin socket: %s of %d user(s), %d done in %lld ms\n", command, b.count, done, (long long)elapsed);
+    
+    Json j = { .len = 0, .full = 0 };
+    json_raw(&j, "{");
+    json_field(&j, "command", command);
+    fprintf(out, "%.*s,\"requested\":%d,\"done\":%d,\"failed\":[", (int)j.len, j.data, b.count, done);
+    j.len = 0;
+    int failed = 0;
+    for (int i = 0; i < b.count; i++) {
+        if (b.result[i] > 0) {
+            continue;
+        }
+        json_raw(&j, failed++ ? ",{" : "{");
+        json_field(&j, "user", b.names[i]);
+        json_field(&j, "error", admin_failure(command, b.result[i]));
+        json_raw(&j, "}");
+        admin_json(out, &j);
+    }
+    fprintf(out, "],\"ms\":%lld", (long long)elapsed);
+    if (ret != 0) {
+        fprintf(out, ",\"error\":\"storage error, the batch may be partly applied\"");
+    }
+    fprintf(out, "}\n");
+    
+    free(b.names);
+    free(b.result);
+}
+
+// Serve one admin client until it closes, answering line by line
+void admin_serve(int client_fd) {
+    FILE *in = fdopen(client_fd, "r");
+    if (in == NULL) {
+        close(client_fd);
+        return;
+    }
+    
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, in) > 0) {
+        char *reply = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&reply, &len);
+        if (out == NULL) {
+            break;
+        }
+        admin_execute(out, line);
+        fclose(out);
+        int ret = admin_send(client_fd, reply, len);
+        free(reply);
+        if (ret < 0) {
+            break;
+        }
+    }
+    free(line);
+    fclose(in);
+}
+
+// Clients are served one at a time: their batches are serialized by storage_lock anyway
+void *admin_thread(void *arg) {
+    while (1) {
+        int client_fd = accept(admin_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("Error accepting an admin connection");
+                sleep(1);
+            }
+            continue;
+        }
+        admin_serve(client_fd);
+    }
+    return NULL;
+}
+
+// Listen on admin_path and start the admin thread
+void admin_start(void) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+    
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(admin_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Admin socket path too long: %s\n", admin_path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, admin_path);
+    
+    admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_fd < 0) {
+        erro("Error creating admin socket");
+    }
+    // A socket left behind by an earlier run (or a process being replaced by hot restart)
+    unlink(admin_path);
+    mode_t old_umask = umask(0077);
+    int ret = bind(admin_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (ret < 0) {
+        erro("Error binding admin socket");
+    }
+    if (listen(admin_fd, 16) < 0) {
+        erro("Error listening on admin socket");
+    }
+    if (pthread_create(&thread, NULL, admin_thread, NULL) != 0) {
+        erro("Error creating admin thread");
+    }
+    pthread_detach(thread);
+    printf("Admin socket at %s\n", admin_path);
+}
+
+// ===================== Connection memory =====================
+// With thousands of idle clients the per-connection footprint is what counts.
+// Sessions come from per-thread slabs (a session never leaves the reactor that
+// accepted it, so no locking), and the input ring is only attached while a
+// partial line waits for the rest: complete lines are handled straight from a
+// per-thread scratch buffer. Slab chunks are kept for reuse, never unmapped.
+
+#define SLAB_CHUNK (64 * 1024)
+
+// Totals over every thread's slab of one kind
+typedef struct {
+    const char *name;
+    long in_use;                // objects handed out
+    long mapped;                // bytes of chunks mapped
+} SlabStats;
+
+// Fixed-size objects carved from mmap'd chunks, recycled through a free list
+typedef struct {
+    size_t size;                // multiple of 16, at least a pointer
+    void *free_list;            // each free object starts with the next one
+    char *next;                 // unused part of the current chunk
+    char *end;
+    SlabStats *stats;
+} Slab;
+
+#define SLAB_OBJECT(type) (((sizeof(type) + 15) / 16) * 16)
+
+SlabStats session_slab_stats = { "sessions", 0, 0 };
+SlabStats input_slab_stats = { "input buffers", 0, 0 };
+__thread Slab session_slab = { SLAB_OBJECT(Session), NULL, NULL, NULL, &session_slab_stats };
+__thread Slab input_slab = { SLAB_OBJECT(InputBuffer), NULL, NULL, NULL, &input_slab_stats };
+__thread InputBuffer session_scratch_input;
+
+long baseline_resident_kb = -1;  // before any client connected
+
+void *slab_alloc(Slab *slab) {
+    void *obj = slab->free_list;
+    
+    if (obj != NULL) {
+        slab->free_list = *(void **)obj;
+    } else {
+        if (slab->next == NULL || slab->next + slab->size > slab->end) {
+            char *chunk = mmap(NULL, SLAB_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk == MAP_FAILED) {
+                return NULL;
+            }
+            slab->next = chunk;
+            slab->end = chunk + SLAB_CHUNK;
+            __atomic_fetch_add(&slab->stats->mapped, SLAB_CHUNK, __ATOMIC_RELAXED);
+        }
+        obj = slab->next;
+        slab->next += slab->size;
+    }
+    memset(obj, 0, slab->size);
+    __atomic_fetch_add(&slab->stats->in_use, 1, __ATOMIC_RELAXED);
+    return obj;
+}
+
+void slab_free(Slab *slab, void *obj) {
+    *(void **)obj = slab->free_list;
+    slab->free_list = obj;
+    __atomic_fetch_sub(&slab->stats->in_use, 1, __ATOMIC_RELAXED);
+}
+
+// Where this read's bytes go: the session's own ring if a partial line waits, else the scratch
+InputBuffer *session_input_begin(Session *s) {
+    if (s->input == NULL) {
+        session_scratch_input.start = 0;
+        session_scratch_input.len = 0;
+        s->input = &session_scratch_input;
+    }
+    return s->input;
+}
+
+// After the bytes were handled: keep what is left in a ring of the session's
+// own, and give the ring back once everything in it was consumed
+int session_input_end(Session *s) {
+    InputBuffer *in = s->input;
+    
+    if (in == NULL) {
+        return 0;
+    }
+    if (in->len == 0) {
+        if (in != &session_scratch_input) {
+            slab_free(&input_slab, in);
+        }
+        s->input = NULL;
+    } else if (in == &session_scratch_input) {
+        InputBuffer *kept = slab_alloc(&input_slab);
+        if (kept == NULL) {
+            perror("Error allocating input buffer");
+            s->input = NULL;
+            return -1;
+        }
+        kept->len = in->len;
+        input_take(in, kept->data, kept->len);
+        s->input = kept;
+    }
+    return 0;
+}
+
+void session_input_release(Session *s) {
+    if (s->input != NULL && s->input != &session_scratch_input) {
+        slab_free(&input_slab, s->input);
+    }
+    s->input = NULL;
+}
+
+long resident_kb(void) {
+    long pages = -1;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fscanf(f, "%*s %ld", &pages) != 1) {
+        pages = -1;
+    }
+    fclose(f);
+    return pages < 0 ? -1 : pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void print_memory_stats(void) {
+    long sessions = __atomic_load_n(&session_slab_stats.in_use, __ATOMIC_RELAXED);
+    long resident = resident_kb();
+    
+    printf("Session size: %zu bytes (input ring of %zu bytes attached only with a partial line)\n",
+           session_slab.size, input_slab.size);
+    printf("Slabs: %ld sessions in %ld KB, %ld input buffers in %ld KB\n",
+           sessions, __atomic_load_n(&session_slab_stats.mapped, __ATOMIC_RELAXED) / 1024,
+           __atomic_load_n(&input_slab_stats.in_use, __ATOMIC_RELAXED),
+           __atomic_load_n(&input_slab_stats.mapped, __ATOMIC_RELAXED) / 1024);
+    if (resident >= 0 && baseline_resident_kb >= 0) {
+        printf("Resident: %ld KB, %ld KB more than at startup", resident, resident - baseline_resident_kb);
+        if (sessions > 0) {
+            printf(", %ld bytes per open session (target < 1024)",
+                   (resident - baseline_resident_kb) * 1024 / sessions);
+        }
+        printf("\n");
+    }
+}
+
+// ===================== Event-driven reactor =====================
+// One process serves every client: each connection is a Session whose state
+// says which prompt it is waiting on, and each recv() advances it one step.
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+Session *session_open(int client_fd, uint32_t addr, int http) {
+    Session *s = slab_alloc(&session_slab);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->fd = client_fd;
+    s->addr = addr;
+    s->http = http;
+    s->state = ST_LOGIN_MENU;  // the caller sends the menu, unless it is an HTTP client
+    session_arm_timer(s);
+    thread_sessions++;
+    return s;
+}
+
+void session_close(Session *s) {
+    if (current_output != NULL && current_output->fd == s->fd) {
+        output_end();  // e.g. "Goodbye!"
+    }
+    if (s->logged_in) {
+        remove_user_from_online_list(s->username);
+    }
+    timer_cancel(&thread_timers, &s->timer);
+    sched_remove(s);
+    s->outq.discard = 1;
+    if (s->dialogue != NULL) {
+        // Let the dialogue unwind: every receive_string() now returns NULL
+        s->dialogue->eof = 1;
+        while (!s->dialogue->done) {
+            coroutine_resume(s->dialogue);
+        }
+        coroutine_free(s->dialogue);
+    }
+    outq_free(&s->outq);
+    session_input_release(s);
+    http_pending_end(s);
+    close(s->fd);
+    slab_free(&session_slab, s);
+    thread_sessions--;
+    release_connection();
+    printf("Connection with client closed\n");
+}
+
+void session_enter_login_menu(Session *s) {
+    send_login_menu(s->fd);
+    s->state = ST_LOGIN_MENU;
+}
+
+// Main menu for engineers/organizations, admin menu for the admin
+void session_enter_menu(Session *s) {
+    if (s->user_type == 3) {
+        send_admin_menu(s->fd);
+        s->state = ST_ADMIN_MENU;
+    } else {
+        send_user_menu(s->fd, s->user_type);
+        s->state = ST_MAIN_MENU;
+    }
+}
+
+void session_logout(Session *s) {
+    send_message(s->fd, "Logging out...\n");
+    remove_user_from_online_list(s->username);
+    s->logged_in = 0;
+    session_enter_login_menu(s);
+}
+
+// Same steps as process_login(), one prompt at a time
+void session_login_username(Session *s, const char *input) {
+    if (strlen(input) == 0 || strlen(input) >= MAX_USERNAME_LENGTH) {
+        send_message(s->fd, "Error: Invalid username (empty or to long).\n");
+    } else if (contains_invalid_chars(input)) {
+        send_message(s->fd, "Error: Username contains invalid characters.Please try again. .\n");
+    } else if (!admit_login(s->fd, s->addr)) {
+        // refused before reading any file
+    } else if (is_pending_user(input)) {
+        send_message(s->fd, "Your account is pending approval by an administrator.\n");
+    } else {
+        strcpy(s->username, input);
+        send_message(s->fd, "Enter password: ");
+        s->state = ST_LOGIN_PASSWORD;
+        return;
+    }
+    session_enter_login_menu(s);
+}
+
+void session_login_password(Session *s, const char *input) {
+    if (strlen(input) == 0 || strlen(input) >= MAX_PASSWORD_LENGTH) {
+        send_message(s->fd, "Error: Invalid password (empty or to long).\n");
+    } else if (contains_invalid_chars(input)) {
+        send_message(s->fd, "Erro: Password contains invalid characters.\n");
+    } else {
+        strcpy(s->password, input);
+        int user_type = check_credentials(s->fd, s->username, s->password);
+        if (user_type > 0) {
+            char success_msg[BUF_SIZE];
+            snprintf(success_msg, BUF_SIZE, "Login successful! Welcome, %s!\n", s->username);
+            send_message(s->fd, success_msg);
+            
+            s->user_type = user_type;
+            s->logged_in = 1;
+            add_user_to_online_list(s->username, s->password, user_type, s->fd);
+            session_enter_menu(s);
+            return;
+        }
+        send_message(s->fd, "Invalid username or password. Please try again.\n");
+    }
+    session_enter_login_menu(s);
+}
+
+// Run a blocking dialogue as a coroutine; the session comes back to the given menu afterwards
+void session_start_dialogue(Session *s, void (*dialogue)(int), SessionState after) {
+    output_flush_partial(current_output);  // whatever the menu already said goes first
+    s->dialogue = coroutine_start(dialogue, s->fd, current_output != NULL ? current_output->queue : NULL, s);
+    if (s->dialogue == NULL) {
+        perror("Error starting dialogue");
+    }
+    s->after_dialogue = after;
+    s->state = ST_DIALOGUE;
+    session_dialogue_resumed(s);
+}
+
+// Run task(fd) as a task of the session, queued behind the interactive work;
+// 0 when no reactor runs tasks in this thread and the caller must run it itself
+int session_start_task(Session *s, void (*task)(int)) {
+    if (!thread_run_queue.enabled) {
+        return 0;
+    }
+    session_start_dialogue(s, task, s->state);
+    return 1;
+}
+
+// Called each time the dialogue coroutine suspends or returns
+void session_dialogue_resumed(Session *s) {
+    if (s->dialogue != NULL && !s->dialogue->done) {
+        return;
+    }
+    
+    coroutine_free(s->dialogue);
+    s->dialogue = NULL;
+    if (s->command_mode || s->binary) {
+        s->state = s->after_dialogue;  // commands and frames get no menus
+    } else if (s->after_dialogue == ST_LOGIN_MENU) {
+        session_enter_login_menu(s);
+    } else {
+        session_enter_menu(s);
+    }
+}
+
+void session_user_menu(Session *s, int choice) {
+    switch (choice) {
+        case 1:
+            view_profile(s->fd, s->username, s->user_type);
+            break;
+        case 2:
+            session_start_task(s, s->user_type == 1 ? list_organizations_task : list_engineers_task);
+            return;
+        case 3:
+            send_message(s->fd, "Start conversation functionality not yet implemented.\n");
+            break;
+        case 4:
+            send_message(s->fd, "View conversations functionality not yet implemented.\n");
+            break;
+        case 5:
+            send_message(s->fd, "Block/Unblock users functionality not yet implemented.\n");
+            break;
+        case 6:
+            session_logout(s);
+            return;
+        default:
+            send_message(s->fd, "Invalid choice. Please try again.\n");
+    }
+    session_enter_menu(s);
+}
+
+void session_admin_menu(Session *s, int choice) {
+    switch (choice) {
+        case 1:
+            session_start_task(s, list_engineers_task);
+            return;
+        case 2:
+            session_start_task(s, list_organizations_task);
+            return;
+        case 3:
+            session_start_dialogue(s, accept_new_user, ST_ADMIN_MENU);
+            return;
+        case 4:
+            session_start_dialogue(s, delete_user, ST_ADMIN_MENU);
+            return;
+        case 5:
+            session_logout(s);
+            return;
+        default:
+            send_message(s->fd, "Invalid choice. Please try again.\n");
+    }
+    session_enter_menu(s);
+}
+
+// Act on one line of input (newline already dropped); returns -1 when the session is over
+int session_handle_line(Session *s, char *input, int len) {
+    if (s->command_mode || (s->state == ST_LOGIN_MENU && is_command(input))) {
+        s->command_mode = 1;
+        return command_execute(s, input);
+    }
+    
+    if (s->state == ST_DIALOGUE) {
+        // Waiting in receive_string(): hand it the line
+        memcpy(s->dialogue->input, input, len + 1);
+        s->dialogue->nread = len;
+        coroutine_resume(s->dialogue);
+        session_dialogue_resumed(s);
+        return 0;
+    }
+    
+    switch (s->state) {
+        case ST_LOGIN_MENU:
+            switch (atoi(input)) {
+                case 1: // Login
+                    send_message(s->fd, "Enter username: ");
+                    s->state = ST_LOGIN_USERNAME;
+                    break;
+                case 2: // Register
+                    session_start_dialogue(s, process_registration, ST_LOGIN_MENU);
+                    break;
+                case 3: // Exit
+                    send_message(s->fd, "Goodbye!\n");
+                    return -1;
+                default:
+                    send_message(s->fd, "Invalid choice! Please try again.\n");
+                    session_enter_login_menu(s);
+            }
+            break;
+        case ST_LOGIN_USERNAME:
+            session_login_username(s, input);
+            break;
+        case ST_LOGIN_PASSWORD:
+            session_login_password(s, input);
+            break;
+        case ST_MAIN_MENU:
+            session_user_menu(s, atoi(input));
+            break;
+        case ST_ADMIN_MENU:
+            session_admin_menu(s, atoi(input));
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+// Handle every complete line received so far, in order. Stops early while
+// replies wait in the outbound queue, the rest stays buffered. Returns -1 when the session is over.
+int session_process_input(Session *s) {
+    char line[BUF_SIZE];
+    int len;
+    
+    if (s->outq.head != NULL) {
+        return 0;  // the client is not reading: take no more requests from it for now
+    }
+    if (s->input == NULL) {
+        return 0;  // nothing received since the last complete line
+    }
+    if (s->http) {
+        return http_process(s, s->input);
+    }
+    
+    // A binary client's handshake starts with a NUL, which no typed answer does
+    if (!s->binary && s->state == ST_LOGIN_MENU && !s->command_mode &&
+        s->input->len > 0 && s->input->data[s->input->start] == '\0') {
+        s->binary = 1;
+    }
+    if (s->binary) {
+        return binary_process(s, s->input);
+    }
+    
+    while (s->outq.head == NULL && !session_task_pending(s) &&
+           (len = input_next_line(s->input, line, sizeof(line))) >= 0) {
+        if (session_handle_line(s, line, len) < 0) {
+            return -1;
+        }
+        if (!session_task_pending(s)) {
+            latency_record(CLASS_INTERACTIVE, monotonic_us() - thread_wake_us);
+        }
+    }
+    return 0;
+}
+
+// Add bytes received by io_uring to the session's input and act on them
+int session_feed(Session *s, const char *data, int n) {
+    session_input_begin(s);
+    while (n > 0) {
+        int taken = input_append(s->input, data, n);
+        data += taken;
+        n -= taken;
+        if (session_process_input(s) < 0) {
+            return -1;
+        }
+        if (taken == 0 && s->input->len == INPUT_BUF_SIZE && session_task_pending(s)) {
+            // The lines behind a task fill the buffer: the rest of the data can't wait for it
+            if (session_finish_task(s) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (taken == 0 && s->input->len == INPUT_BUF_SIZE) {
+            fprintf(stderr, "Warning: input buffer full, dropping %d bytes\n", n);
+            break;
+        }
+    }
+    return 0;
+}
+
+// Read whatever the client sent; returns -1 when the connection must be closed
+int session_read(Session *s) {
+    int nread = input_read(session_input_begin(s), s->fd);
+    if (nread == 0) {
+        printf("Client desconnected.\n");
+        return -1;
+    } else if (nread < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOBUFS) {
+            return session_process_input(s);
+        }
+        perror("Error receiving data from client");
+        return -1;
+    }
+    
+    return session_process_input(s);
+}
+
+// Epoll instance of the reactor running in this thread (-1 under io_uring)
+__thread int thread_epfd = -1;
+
+// A session with replies queued waits for EPOLLOUT, otherwise it waits for input
+void reactor_watch_output(Session *s, int want_output) {
+    if (thread_epfd < 0 || s->watching_output == want_output) {
+        return;
+    }
+    
+    struct epoll_event ev;
+    ev.events = want_output ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(thread_epfd, EPOLL_CTL_MOD, s->fd, &ev) < 0) {
+        perror("Error in epoll_ctl");
+        return;
+    }
+    s->watching_output = want_output;
+}
+
+// Accept every pending connection on the (non-blocking) listening socket
+void reactor_accept(int epfd, int fd, int http) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_size = sizeof(client_addr);
+        
+        int client = accept4(fd, (struct sockaddr *)&client_addr, &client_addr_size, SOCK_NONBLOCK);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Error in accept function");
+            return;
+        }
+        if (!admit_connection(client, client_addr.sin_addr.s_addr)) {
+            close(client);
+            continue;
+        }
+        tune_client_socket(client);
+        
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        printf("New connection established from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
+        
+        Session *s = session_open(client, client_addr.sin_addr.s_addr, http);
+        if (s == NULL) {
+            perror("Error allocating session");
+            close(client);
+            release_connection();
+            continue;
+        }
+        if (!http) {
+            output_begin(client, &s->outq);
+            session_enter_login_menu(s);
+            output_end();
+        }
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev) < 0) {
+            perror("Error in epoll_ctl");
+            session_close(s);
+        }
+    }
+}
+
+// Give the queued task of s its next slice
+void reactor_run_task(Session *s) {
+    output_begin(s->fd, &s->outq);
+    if (session_run_task(s) < 0 || session_input_end(s) < 0) {
+        session_close(s);
+        return;
+    }
+    session_arm_timer(s);
+    output_end();
+    
+    if (s->outq.discard) {
+        session_close(s);
+        return;
+    }
+    reactor_watch_output(s, s->outq.head != NULL);
+}
+
+// A session missed its deadline
+void reactor_expire(Timer *t) {
+    Session *s = t->data;
+    session_timed_out(s);
+    session_close(s);
+}
+
+void run_epoll_reactor(int fd, int http_fd) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        erro("error in epoll_create1");
+    thread_epfd = epfd;
+    
+    if (set_nonblocking(fd) < 0)
+        erro("error setting listening socket non-blocking");
+    
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // NULL marks the listening socket
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        erro("error in epoll_ctl");
+    
+    if (http_fd >= 0) {
+        if (set_nonblocking(http_fd) < 0)
+            erro("error setting listening socket non-blocking");
+        ev.data.ptr = &http_port;  // marks the HTTP listener
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, http_fd, &ev) < 0)
+            erro("error in epoll_ctl");
+    }
+    
+    if (drain_pipe[0] >= 0) {
+        ev.data.ptr = drain_pipe;  // the listeners were handed over
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, drain_pipe[0], &ev) < 0)
+            erro("error in epoll_ctl");
+    }
+    
+    thread_run_queue.wake_fd = wal_register_reactor(&thread_run_queue.parked_count);
+    if (thread_run_queue.wake_fd >= 0) {
+        ev.data.ptr = &thread_run_queue;  // the storage writer synced changes parked tasks wait for
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, thread_run_queue.wake_fd, &ev) < 0)
+            erro("error in epoll_ctl");
+    }
+    
+    thread_run_queue.enabled = 1;
+    while (!draining || !drain_over(thread_sessions)) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, sched_wait_ms(timer_wait_ms(&thread_timers)));
+        thread_wake_us = monotonic_us();
+        if (n < 0) {
+            if (errno != EINTR)
+                erro("error in epoll_wait");
+            check_stats_request();
+            n = 0;
+        }
+        
+        for (int i = 0; i < n; i++) {
+            Session *s = events[i].data.ptr;
+            if (s == NULL) {
+                if (fd >= 0)
+                    reactor_accept(epfd, fd, 0);
+                continue;
+            }
+            if ((void *)s == (void *)&http_port) {
+                if (http_fd >= 0)
+                    reactor_accept(epfd, http_fd, 1);
+                continue;
+            }
+            if ((void *)s == (void *)drain_pipe) {
+                // The new process accepts from now on (the pipe stays readable for the other threads)
+                epoll_ctl(epfd, EPOLL_CTL_DEL, drain_pipe[0], NULL);
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+                close(fd);
+                fd = -1;
+                if (http_fd >= 0) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, http_fd, NULL);
+                    close(http_fd);
+                    http_fd = -1;
+                }
+                continue;
+            }
+            if ((void *)s == (void *)&thread_run_queue) {
+                uint64_t count;
+                if (read(thread_run_queue.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("Error reading the storage writer's eventfd");
+                continue;  // sched_unpark() below queues the tasks
+            }
+            
+            // Replies to this event leave in one send() once the session waits again
+            output_begin(s->fd, &s->outq);
+            if (s->watching_output) {
+                // The client is reading again: send what waited, then take the lines that arrived meanwhile
+                if (outq_drain(s->fd, &s->outq) < 0 || session_process_input(s) < 0) {
+                    session_close(s);
+                    continue;
+                }
+                sched_wake(s);
+            } else if (session_read(s) < 0) {
+                session_close(s);
+                continue;
+            }
+            if (session_input_end(s) < 0) {
+                session_close(s);
+                continue;
+            }
+            session_arm_timer(s);
+            output_end();
+            
+            if (s->outq.discard) {
+                session_close(s);  // left too much unread, or the socket broke
+                continue;
+            }
+            reactor_watch_output(s, s->outq.head != NULL);
+        }
+        
+        // Interactive work first, then what waits in the run queues
+        sched_unpark();
+        sched_run(reactor_run_task);
+        timer_advance(&thread_timers, reactor_expire);
+    }
+    wal_unregister_reactor(thread_run_queue.wake_fd);
+    thread_run_queue.wake_fd = -1;
+}
+
+#ifdef HAVE_LIBURING
+// ===================== io_uring backend =====================
+// Same sessions as the epoll reactor, but accept, recv and send are queued
+// on a ring: one multishot accept for the listening socket, one multishot
+// recv per client reading into kernel-picked provided buffers, and every
+// flushed output buffer becomes a send SQE linked to the previous one for the same
+// client. A whole loop iteration is submitted with one io_uring_enter().
+
+// Kinds of requests, kept in the low bits of the SQE user_data
+#define URING_ACCEPT   1
+#define URING_RECV     2
+#define URING_SEND     3
+#define URING_SHUTDOWN 4
+#define URING_TICK     5         // timeout that wakes the loop for the timer wheel
+#define URING_DRAIN    6         // poll of the drain pipe: the listeners were handed over
+#define URING_CANCEL   7
+#define URING_HTTP     8         // with URING_ACCEPT: the HTTP listener
+#define URING_WAL      8         // with URING_DRAIN: poll of the storage writer's eventfd
+#define URING_KIND(data)  ((data) & 7)
+#define URING_PTR(data)   ((void *)(uintptr_t)((data) & ~(uint64_t)7))
+
+typedef struct {
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;                   // URING_BUFFERS provided buffers of BUF_SIZE bytes
+    int listen_fd;
+    int http_fd;                     // -1 without the HTTP API
+    int last_send_fd;                // client of the most recent, still unsubmitted, send
+    struct io_uring_sqe *last_send;
+    struct __kernel_timespec tick;   // wait of the pending URING_TICK timeout
+    int tick_armed;
+} UringLoop;
+
+// Set while this thread runs an io_uring loop; send_message() then queues instead of sending
+__thread UringLoop *thread_uring = NULL;
+
+struct io_uring_sqe *uring_get_sqe(UringLoop *u) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+    if (sqe == NULL) {
+        // Submission queue full: flush it and try again
+        io_uring_submit(&u->ring);
+        u->last_send = NULL;
+        sqe = io_uring_get_sqe(&u->ring);
+    }
+    return sqe;
+}
+
+// Link a new request for fd after the previous send to the same client, so they complete in order
+void uring_link_after_send(UringLoop *u, int fd, struct io_uring_sqe *sqe) {
+    if (u->last_send != NULL && u->last_send_fd == fd) {
+        u->last_send->flags |= IOSQE_IO_LINK;
+    }
+    u->last_send = sqe;
+    u->last_send_fd = fd;
+}
+
+// Queue a copy of the data; returns 0 when no io_uring loop runs in this thread
+int uring_send_bytes(int client_socket, const char *data, size_t len) {
+    UringLoop *u = thread_uring;
+    if (u == NULL) {
+        return 0;
+    }
+    
+    char *copy = malloc(len + 1);
+    struct io_uring_sqe *sqe = (copy != NULL) ? uring_get_sqe(u) : NULL;
+    if (sqe == NULL) {
+        free(copy);
+        perror("Error sending message");
+        return 1;
+    }
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    
+    io_uring_prep_send(sqe, client_socket, copy, len, 0);
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)copy | URING_SEND);
+    uring_link_after_send(u, client_socket, sqe);
+    return 1;
+}
+
+void uring_arm_accept(UringLoop *u, int http) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    io_uring_prep_multishot_accept(sqe, http ? u->http_fd : u->listen_fd, NULL, NULL, 0);
+    io_uring_sqe_set_data64(sqe, http ? URING_ACCEPT | URING_HTTP : URING_ACCEPT);
+}
+
+void uring_arm_recv(UringLoop *u, Session *s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    io_uring_prep_recv_multishot(sqe, s->fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)s | URING_RECV);
+}
+
+// Shut the socket down once the replies already queued for it are sent;
+// the recv then ends and the session is freed.
+void uring_finish_session(UringLoop *u, Session *s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    io_uring_prep_shutdown(sqe, s->fd, SHUT_RDWR);
+    io_uring_sqe_set_data64(sqe, URING_SHUTDOWN);
+    uring_link_after_send(u, s->fd, sqe);
+    s->closing = 1;
+    timer_cancel(&thread_timers, &s->timer);
+}
+
+void uring_expire(Timer *t) {
+    Session *s = t->data;
+    session_timed_out(s);
+    uring_finish_session(thread_uring, s);
+}
+
+// Wake the loop when the storage writer signals its eventfd
+void uring_arm_wal(UringLoop *u) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    io_uring_prep_poll_add(sqe, thread_run_queue.wake_fd, POLLIN);
+    io_uring_sqe_set_data64(sqe, URING_DRAIN | URING_WAL);
+}
+
+// Wake the loop at the next tick while the wheel has deadlines pending
+void uring_arm_tick(UringLoop *u) {
+    int ms = timer_wait_ms(&thread_timers);
+    if (u->tick_armed || ms < 0) {
+        return;
+    }
+    
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    u->tick.tv_sec = ms / 1000;
+    u->tick.tv_nsec = (long long)(ms % 1000) * 1000000;
+    io_uring_prep_timeout(sqe, &u->tick, 0, 0);
+    io_uring_sqe_set_data64(sqe, URING_TICK);
+    u->tick_armed = 1;
+}
+
+// Give the queued task of s its next slice
+void uring_run_task(Session *s) {
+    if (s->closing) {
+        return;
+    }
+    output_begin(s->fd, NULL);
+    int ret = session_run_task(s);
+    if (ret == 0) {
+        ret = session_input_end(s);
+    }
+    if (ret < 0) {
+        session_input_release(s);
+        output_end();
+        uring_finish_session(thread_uring, s);
+    } else {
+        session_arm_timer(s);
+        output_end();
+    }
+}
+
+void uring_close_session(UringLoop *u, Session *s) {
+    // Submit anything still queued for this fd before its number can be reused
+    io_uring_submit(&u->ring);
+    u->last_send = NULL;
+    session_close(s);
+}
+
+void uring_handle_accept(UringLoop *u, struct io_uring_cqe *cqe) {
+    int http = (cqe->user_data & URING_HTTP) != 0;
+    
+    if (cqe->res == -ECANCELED) {
+        return;  // stopped accepting for a hot restart
+    } else if (cqe->res < 0) {
+        errno = -cqe->res;
+        perror("Error in accept function");
+    } else {
+        int client = cqe->res;
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_size = sizeof(client_addr);
+        char client_ip[INET_ADDRSTRLEN] = "?";
+        
+        memset(&client_addr, 0, sizeof(client_addr));
+        if (getpeername(client, (struct sockaddr *)&client_addr, &client_addr_size) == 0) {
+            inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        }
+        
+        if (!admit_connection(client, client_addr.sin_addr.s_addr)) {
+            close(client);
+        } else {
+            tune_client_socket(client);
+            printf("New connection established from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
+            
+            Session *s = session_open(client, client_addr.sin_addr.s_addr, http);
+            if (s == NULL) {
+                perror("Error allocating session");
+                close(client);
+                release_connection();
+            } else {
+                if (!http) {
+                    output_begin(client, NULL);  // sends are queued on the ring
+                    session_enter_login_menu(s);
+                    output_end();
+                }
+                uring_arm_recv(u, s);
+            }
+        }
+    }
+    
+    if (!(cqe->flags & IORING_CQE_F_MORE) && (http ? u->http_fd : u->listen_fd) >= 0) {
+        uring_arm_accept(u, http);
+    }
+}
+
+void uring_handle_recv(UringLoop *u, Session *s, struct io_uring_cqe *cqe) {
+    int finished = 0;
+    
+    if (cqe->res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *data = u->buffers + (size_t)bid * BUF_SIZE;
+        
+        if (!s->closing) {
+            output_begin(s->fd, NULL);
+            int ret = session_feed(s, data, cqe->res);
+            if (ret == 0) {
+                ret = session_input_end(s);
+            }
+            if (ret < 0) {
+                session_input_release(s);
+                output_end();
+                uring_finish_session(u, s);
+            } else {
+                session_arm_timer(s);
+                output_end();
+            }
+        }
+        
+        // Hand the provided buffer back to the kernel
+        io_uring_buf_ring_add(u->buf_ring, data, BUF_SIZE - 1, bid,
+                              io_uring_buf_ring_mask(URING_BUFFERS), 0);
+        io_uring_buf_ring_advance(u->buf_ring, 1);
+    } else if (cqe->res == 0) {
+        if (!s->closing)
+            printf("Client desconnected.\n");
+        finished = 1;
+    } else if (cqe->res != -ENOBUFS) {
+        if (!s->closing) {
+            errno = -cqe->res;
+            perror("Error receiving data from client");
+        }
+        finished = 1;
+    }
+    
+    // A multishot recv without F_MORE is over: re-arm it, or free the session if it ended
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (finished || s->closing) {
+            uring_close_session(u, s);
+        } else {
+            uring_arm_recv(u, s);
+        }
+    }
+}
+
+void uring_handle_send(struct io_uring_cqe *cqe) {
+    char *message = URING_PTR(cqe->user_data);
+    
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            perror("Error sending message");
+        }
+    } else if ((size_t)cqe->res < strlen(message)) {
+        fprintf(stderr, "Warning: Message sent partially\n");
+    }
+    free(message);
+}
+
+// Returns -1 without serving anything when io_uring can't be set up here
+int run_uring_reactor(int fd, int http_fd) {
+    UringLoop u;
+    int ret;
+    
+    memset(&u, 0, sizeof(u));
+    u.listen_fd = fd;
+    u.http_fd = http_fd;
+    u.last_send_fd = -1;
+    
+    if ((ret = io_uring_queue_init(URING_ENTRIES, &u.ring, 0)) < 0) {
+        errno = -ret;
+        perror("io_uring_queue_init");
+        return -1;
+    }
+    
+    u.buf_ring = io_uring_setup_buf_ring(&u.ring, URING_BUFFERS, URING_BUF_GROUP, 0, &ret);
+    u.buffers = malloc((size_t)URING_BUFFERS * BUF_SIZE);
+    if (u.buf_ring == NULL || u.buffers == NULL) {
+        errno = (u.buf_ring == NULL) ? -ret : ENOMEM;
+        perror("io_uring provided buffers");
+        free(u.buffers);
+        io_uring_queue_exit(&u.ring);
+        return -1;
+    }
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        io_uring_buf_ring_add(u.buf_ring, u.buffers + (size_t)i * BUF_SIZE, BUF_SIZE - 1, i,
+                              io_uring_buf_ring_mask(URING_BUFFERS), i);
+    }
+    io_uring_buf_ring_advance(u.buf_ring, URING_BUFFERS);
+    
+    thread_uring = &u;
+    thread_cork_allowed = 0;
+    uring_arm_accept(&u, 0);
+    if (http_fd >= 0) {
+        uring_arm_accept(&u, 1);
+    }
+    if (drain_pipe[0] >= 0) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&u);
+        io_uring_prep_poll_add(sqe, drain_pipe[0], POLLIN);
+        io_uring_sqe_set_data64(sqe, URING_DRAIN);
+    }
+    thread_run_queue.wake_fd = wal_register_reactor(&thread_run_queue.parked_count);
+    if (thread_run_queue.wake_fd >= 0) {
+        uring_arm_wal(&u);
+    }
+    
+    thread_run_queue.enabled = 1;
+    while (!draining || !drain_over(thread_sessions)) {
+        uring_arm_tick(&u);
+        // No waiting while tasks are queued
+        ret = thread_run_queue.queued > 0 ? io_uring_submit(&u.ring) : io_uring_submit_and_wait(&u.ring, 1);
+        thread_wake_us = monotonic_us();
+        u.last_send = NULL;
+        if (ret == -EINTR) {
+            check_stats_request();
+        } else if (ret < 0) {
+            errno = -ret;
+            erro("error in io_uring_submit_and_wait");
+        }
+        
+        struct io_uring_cqe *cqe;
+        unsigned head, seen = 0;
+        io_uring_for_each_cqe(&u.ring, head, cqe) {
+            switch (URING_KIND(cqe->user_data)) {
+                case URING_ACCEPT:
+                    uring_handle_accept(&u, cqe);
+                    break;
+                case URING_RECV:
+                    uring_handle_recv(&u, URING_PTR(cqe->user_data), cqe);
+                    break;
+                case URING_SEND:
+                    uring_handle_send(cqe);
+                    break;
+                case URING_TICK:
+                    u.tick_armed = 0;
+                    break;
+                case URING_DRAIN: {
+                    if (cqe->user_data & URING_WAL) {
+                        uint64_t count;
+                        if (read(thread_run_queue.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                            perror("Error reading the storage writer's eventfd");
+                        uring_arm_wal(&u);  // sched_unpark() below queues the tasks
+                        break;
+                    }
+                    // The new process accepts from now on
+                    struct io_uring_sqe *sqe = uring_get_sqe(&u);
+                    io_uring_prep_cancel64(sqe, URING_ACCEPT, 0);
+                    io_uring_sqe_set_data64(sqe, URING_CANCEL);
+                    close(u.listen_fd);
+                    u.listen_fd = -1;
+                    if (u.http_fd >= 0) {
+                        sqe = uring_get_sqe(&u);
+                        io_uring_prep_cancel64(sqe, URING_ACCEPT | URING_HTTP, 0);
+                        io_uring_sqe_set_data64(sqe, URING_CANCEL);
+                        close(u.http_fd);
+                        u.http_fd = -1;
+                    }
+                    break;
+                }
+                default:
+                    break;  // shutdowns and cancels need no follow-up
+            }
+            seen++;
+        }
+        io_uring_cq_advance(&u.ring, seen);
+        
+        sched_unpark();
+        sched_run(uring_run_task);
+        timer_advance(&thread_timers, uring_expire);
+    }
+    wal_unregister_reactor(thread_run_queue.wake_fd);
+    thread_run_queue.wake_fd = -1;
+    return 0;
+}
+#endif
+
+void run_reactor(int fd, int http_fd) {
+#ifdef HAVE_LIBURING
+    if (io_backend == BACKEND_URING && run_uring_reactor(fd, http_fd) == 0) {
+        return;
+    }
+    if (io_backend == BACKEND_URING) {
+        printf("io_uring unavailable, falling back to epoll\n");
+    }
+#endif
+    run_epoll_reactor(fd, http_fd);
+}
+
+// Each worker thread runs its own reactor on its own SO_REUSEPORT sockets
+void *reactor_thread(void *arg) {
+    int *fds = arg;  // menu listener, HTTP listener
+    run_reactor(fds[0], fds[1]);
+    return NULL;
+}
+
+// The kernel spreads incoming connections over the workers' listening sockets
+void run_threaded_reactors(int num_workers) {
+    // Every inherited socket has its own accept queue: serve them all. One
+    // bound without SO_REUSEPORT can't get siblings, so then serve just those
+    int reuse = 0;
+    int inherited = inherited_listeners(SERVER_PORT, &reuse);
+    if (inherited > 0) {
+        if (num_workers < inherited || (!reuse && num_workers > inherited)) {
+            printf("Hot restart: %d listening socket(s) inherited, running as many workers\n", inherited);
+            num_workers = inherited;
+        }
+    }
+    pthread_t *threads = calloc(num_workers, sizeof(pthread_t));
+    int *fds = calloc(num_workers * 2, sizeof(int));
+    if (threads == NULL || fds == NULL)
+        erro("error allocating worker threads");
+    
+    // All listeners first: nothing is served if one of them can't be opened
+    for (int i = 0; i < num_workers; i++) {
+        fds[2 * i] = open_listen_socket(SERVER_PORT, 1);
+        fds[2 * i + 1] = http_port > 0 ? open_listen_socket(http_port, 1) : -1;
+    }
+    // The drain pipe must exist before any reactor looks for it
+    handoff_ready(1);
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&threads[i], NULL, reactor_thread, &fds[2 * i]) != 0)
+            erro("error creating worker thread");
+    }
+    
+    printf("Server started on port %d with %d worker threads. Waiting for connections...\n",
+           SERVER_PORT, num_workers);
+    if (http_port > 0) {
+        printf("HTTP API on port %d\n", http_port);
+    }
+    
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(fds);
+    free(threads);
+}
+
+// Create a listening socket on port; reuse_port lets several sockets share the port
+int open_listen_socket(int port, int reuse_port) {
+    int fd;
+    struct sockaddr_in addr;
+    
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(SERVER_PORT);
+    addr.sin_port = htons(port);
     
-    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        erro("error in socket function");
+    // Hot restart: already bound and listening, with its queue of pending clients
+    fd = take_inherited(port);
+    if (fd < 0) {
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            erro("error in socket function");
+        
+        // Set socket option to reuse address
+        int opt = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+            erro("error in setsockopt");
+        
+        if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+            erro("error in setsockopt SO_REUSEPORT");
+        
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+            erro("error in bind function");
+    }
     
-    // Set socket option to reuse address
-    int opt = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
-        erro("error in setsockopt");
+    tune_listen_socket(fd);
+    if (listen(fd, listen_backlog) < 0)
+        erro("error in listen function");
     
-    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-        erro("error in bind function");
+    if (listen_count < HANDOFF_MAX_FDS) {
+        listen_fds[listen_count++] = fd;
+    }
+    return fd;
+}
+
+// ===================== Prefork worker pool =====================
+// Workers are forked once and each serves many clients in turn with the
+// blocking handlers. The master only watches the scoreboard: it replaces
+// workers that die and grows/shrinks the pool with the number of busy ones.
+
+// One scoreboard slot per worker, in memory shared with the master
+typedef struct {
+    pid_t pid;              // 0 when the slot is free
+    volatile int busy;      // 1 while serving a client
+    volatile int retiring;  // set by the master before asking an idle worker to stop
+} WorkerSlot;
+
+WorkerSlot *scoreboard = NULL;
+volatile sig_atomic_t worker_stop = 0;
+
+void handle_worker_stop(int sig) {
+    worker_stop = 1;
+}
+
+// Wakes the master up early; it reaps workers itself
+void handle_master_sigchld(int sig) {
+}
+
+volatile sig_atomic_t master_stop = 0;
+
+void handle_master_stop(int sig) {
+    master_stop = 1;
+}
+
+void prefork_worker(int fd, WorkerSlot *slot) {
+    struct sigaction sa;
+    sa.sa_handler = &handle_worker_stop;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;  // no SA_RESTART: interrupt accept() so an idle worker stops at once
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);  // a vanished client must not take the worker down with it
+    if (handoff_fd >= 0) {
+        close(handoff_fd);  // hot restarts are the master's business
+    }
     
-    if (listen(fd, DEFAULT_BACKLOG) < 0)
-        erro("error in listen function");
+    while (!worker_stop) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_size = sizeof(client_addr);
+        
+        int client = accept(fd, (struct sockaddr *)&client_addr, &client_addr_size);
+        if (client < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Listener taken over from a reactor build, which made it non-blocking
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                poll(&pfd, 1, -1);
+            } else if (errno != EINTR) {
+                perror("Error in accept function");
+            }
+            continue;
+        }
+        if (!admit_connection(client, client_addr.sin_addr.s_addr)) {
+            close(client);
+            continue;
+        }
+        tune_client_socket(client);
+        slot->busy = 1;
+        
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        printf("New connection established from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
+        
+        process_client(client);
+        release_connection();
+        printf("Connection with client closed\n");
+        
+        slot->busy = 0;
+    }
+    exit(0);
+}
+
+int spawn_worker(int fd, int max_workers) {
+    for (int i = 0; i < max_workers; i++) {
+        if (scoreboard[i].pid != 0) {
+            continue;
+        }
+        
+        scoreboard[i].busy = 0;
+        scoreboard[i].retiring = 0;
+        fflush(stdout);  // don't let the child inherit unflushed log lines
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Error forking worker");
+            return -1;
+        }
+        if (pid == 0) {
+            prefork_worker(fd, &scoreboard[i]);
+        }
+        scoreboard[i].pid = pid;
+        return 0;
+    }
+    return -1;
+}
+
+void run_prefork_server(int fd, int min_workers, int max_workers) {
+    scoreboard = mmap(NULL, max_workers * sizeof(WorkerSlot), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scoreboard == MAP_FAILED)
+        erro("error creating worker scoreboard");
+    memset(scoreboard, 0, max_workers * sizeof(WorkerSlot));
     
-    printf("Server started on port %d. Waiting for connections...\n", SERVER_PORT);
+    // The master reaps its own workers so it knows which slots to refill
+    struct sigaction sa;
+    sa.sa_handler = &handle_master_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
     
-    client_addr_size = sizeof(client_addr);
+    // Stopping the master stops the whole pool
+    sa.sa_handler = &handle_master_stop;
+    sa.sa_flags = 0;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    
+    for (int i = 0; i < min_workers; i++) {
+        spawn_worker(fd, max_workers);
+    }
+    
+    while (!master_stop) {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < max_workers; i++) {
+                if (scoreboard[i].pid == pid) {
+                    if (!scoreboard[i].retiring)
+                        printf("Worker %d exited unexpectedly, replacing it\n", (int)pid);
+                    scoreboard[i].pid = 0;
+                    break;
+                }
+            }
+        }
+        
+        int alive = 0, busy = 0, idle_slot = -1;
+        for (int i = 0; i < max_workers; i++) {
+            if (scoreboard[i].pid == 0 || scoreboard[i].retiring)
+                continue;
+            alive++;
+            if (scoreboard[i].busy)
+                busy++;
+            else
+                idle_slot = i;
+        }
+        int idle = alive - busy;
+        
+        if (alive < min_workers || (idle < PREFORK_MIN_SPARE && alive < max_workers)) {
+            // Fill up to the minimum, or keep a few idle workers ready for the next burst
+            int wanted = min_workers - alive;
+            if (PREFORK_MIN_SPARE - idle > wanted)
+                wanted = PREFORK_MIN_SPARE - idle;
+            for (int i = 0; i < wanted && alive < max_workers; i++, alive++) {
+                if (spawn_worker(fd, max_workers) < 0)
+                    break;
+            }
+        } else if (idle > PREFORK_MAX_SPARE && alive > min_workers && idle_slot >= 0) {
+            // Too many idle workers: retire one per round
+            scoreboard[idle_slot].retiring = 1;
+            kill(scoreboard[idle_slot].pid, SIGTERM);
+        }
+        
+        if (handoff_fd >= 0) {
+            // The hot restart socket doubles as the master's one second sleep
+            struct pollfd pfd = { handoff_fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 1000) > 0 && handoff_serve())
+                break;
+        } else {
+            sleep(1);  // cut short by SIGCHLD when a worker exits
+        }
+    }
+    
+    // Workers finish the client they are serving before they stop
+    for (int i = 0; i < max_workers; i++) {
+        if (scoreboard[i].pid != 0) {
+            scoreboard[i].retiring = 1;
+            kill(scoreboard[i].pid, SIGTERM);
+        }
+    }
+    if (draining) {
+        close(fd);
+        while (1) {
+            pid_t pid;
+            while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+                for (int i = 0; i < max_workers; i++) {
+                    if (scoreboard[i].pid == pid)
+                        scoreboard[i].pid = 0;
+                }
+            }
+            int alive = 0;
+            for (int i = 0; i < max_workers; i++) {
+                if (scoreboard[i].pid != 0)
+                    alive++;
+            }
+            if (drain_over(alive))
+                break;
+            sleep(1);
+        }
+        for (int i = 0; i < max_workers; i++) {
+            if (scoreboard[i].pid != 0)
+                kill(scoreboard[i].pid, SIGKILL);
+        }
+    }
+    while (wait(NULL) > 0);
+}
+
+// Original model: one child process per connection running the blocking handlers
+void run_fork_server(int fd) {
+    int client;
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_size = sizeof(client_addr);
     
     while (1) {
+        // With -H, wait on the listener and the hot restart socket together
+        if (handoff_fd >= 0) {
+            struct pollfd pfd[2] = { { fd, POLLIN, 0 }, { handoff_fd, POLLIN, 0 } };
+            if (poll(pfd, 2, -1) < 0)
+                continue; // Interrupted by a signal
+            if ((pfd[1].revents & POLLIN) && handoff_serve())
+                break;
+            if (!(pfd[0].revents & POLLIN))
+                continue;
+        }
+        
         // Wait for a new connection
         client = accept(fd, (struct sockaddr *)&client_addr, &client_addr_size);
         
         if (client < 0) {
-            if (errno == EINTR)
-                continue; // Interrupted by a signal
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue; // Interrupted by a signal, or another process took it
                 
             perror("Error in accept function");
             continue;
         }
         
-        printf("New connection established from %s:%d\n", 
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        // Refused connections never cost a fork
+        if (!admit_connection(client, client_addr.sin_addr.s_addr)) {
+            close(client);
+            continue;
+        }
+        tune_client_socket(client);
+        
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        printf("New connection established from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
         
+        fflush(stdout);  // don't let the child inherit unflushed log lines
         if (fork() == 0) {
             // Child process
             close(fd);
+            if (handoff_fd >= 0) {
+                close(handoff_fd);
+                prctl(PR_SET_PDEATHSIG, SIGTERM);  // cut at the drain deadline, when the parent exits
+            }
             process_client(client);
+            release_connection();
             printf("Connection with client closed\n");
             exit(0);
         }
@@ -1386,5 +8028,256 @@ int main() {
         close(client);
     }
     
+    // Hot restart: the children finish their clients, up to the deadline
+    close(fd);
+    while (!drain_over(__atomic_load_n(&admission->active, __ATOMIC_RELAXED))) {
+        sleep(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int fd;
+    ServerMode mode = MODE_REACTOR;
+    int num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_workers = PREFORK_MAX_WORKERS;
+    const char *convert = NULL;
+    int c;
+    
+    while ((c = getopt(argc, argv, "m:w:W:b:t:T:l:c:r:a:o:O:S:H:D:P:A:U:X:G:")) != -1) {
+        switch (c) {
+            case 'm':
+                if (strcmp(optarg, "reactor") == 0) {
+                    mode = MODE_REACTOR;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    mode = MODE_THREADS;
+                } else if (strcmp(optarg, "prefork") == 0) {
+                    mode = MODE_PREFORK;
+                } else if (strcmp(optarg, "fork") == 0) {
+                    mode = MODE_FORK;
+                } else {
+                    fprintf(stderr, "Unknown mode '%s' (use reactor, threads, prefork or fork)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                if (num_workers <= 0) {
+                    fprintf(stderr, "Invalid number of workers '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W':
+                max_workers = atoi(optarg);
+                if (max_workers <= 0) {
+                    fprintf(stderr, "Invalid maximum number of workers '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                if (strcmp(optarg, "epoll") == 0) {
+                    io_backend = BACKEND_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+#ifdef HAVE_LIBURING
+                    io_backend = BACKEND_URING;
+#else
+                    printf("Built without liburing, using epoll\n");
+#endif
+                } else {
+                    fprintf(stderr, "Unknown backend '%s' (use epoll or uring)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+            case 'T':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (c == 't') {
+                    prompt_timeout = atoi(optarg);
+                } else {
+                    idle_timeout = atoi(optarg);
+                }
+                break;
+            case 'l':
+                listen_backlog = atoi(optarg);
+                if (listen_backlog <= 0) {
+                    fprintf(stderr, "Invalid backlog '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+            case 'r':
+            case 'a':
+                // 0 lifts the limit
+                if (!is_valid_integer(optarg) || optarg[0] == '\0') {
+                    fprintf(stderr, "Invalid limit '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                if (c == 'c') {
+                    max_connections = atoi(optarg);
+                } else if (c == 'r') {
+                    conn_rate = atoi(optarg);
+                } else {
+                    login_rate = atoi(optarg);
+                }
+                break;
+            case 'o':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Invalid output limit '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                outq_limit = (size_t)atoi(optarg) * 1024;
+                break;
+            case 'O':
+                if (strcmp(optarg, "disconnect") == 0) {
+                    outq_policy = OUTQ_DISCONNECT;
+                } else if (strcmp(optarg, "drop") == 0) {
+                    outq_policy = OUTQ_DROP;
+                } else {
+                    fprintf(stderr, "Unknown output policy '%s' (use disconnect or drop)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                if (parse_socket_tuning(optarg) < 0) {
+                    fprintf(stderr, "Invalid socket options '%s' (use [no]defer[=s], [no]fastopen[=queue], [no]nodelay, [no]cork, [no]busypoll=us)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'H':
+                handoff_path = optarg;
+                break;
+            case 'D':
+                drain_timeout = atoi(optarg);
+                if (drain_timeout <= 0) {
+                    fprintf(stderr, "Invalid drain timeout '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                http_port = atoi(optarg);
+                if (http_port <= 0 || http_port > 65535 || http_port == SERVER_PORT) {
+                    fprintf(stderr, "Invalid HTTP port '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'A':
+                admin_path = optarg;
+                break;
+            case 'U':
+                index_min_users = atol(optarg);
+                if (index_min_users <= 0) {
+                    fprintf(stderr, "Invalid number of users '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'X':
+                if (strcmp(optarg, "import") != 0 && strcmp(optarg, "export") != 0) {
+                    fprintf(stderr, "Unknown conversion '%s' (use import or export)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                convert = optarg;
+                break;
+            case 'G':
+                // Longer gathers more changes per sync, at the cost of that much latency
+                if (!is_valid_integer(optarg) || optarg[0] == '\0' || atol(optarg) > 1000000) {
+                    fprintf(stderr, "Invalid durability window '%s' (0 to 1000000 us)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                wal_window_us = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-m reactor|threads|prefork|fork] [-w workers] [-W max prefork workers] [-b epoll|uring] [-t prompt timeout] [-T idle timeout] [-l backlog] [-c max connections] [-r connections/min per IP] [-a logins/min per IP] [-o output limit KB] [-O disconnect|drop] [-S socket options] [-H hot restart socket] [-D drain seconds] [-P HTTP port] [-A admin socket] [-U users to index] [-X import|export] [-G durability window us]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (num_workers <= 0) {
+        num_workers = 1;
+    }
+    if (http_port > 0 && mode != MODE_REACTOR && mode != MODE_THREADS) {
+        printf("The HTTP API is served by the reactors only (-m reactor|threads), ignoring -P\n");
+        http_port = 0;
+    }
+    if (max_workers < num_workers) {
+        max_workers = num_workers;
+    }
+    
+    // Set up signal handler for child processes
+    struct sigaction sa;
+    sa.sa_handler = &handle_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        erro("Error setting up signal handler");
+    }
+    
+    // Convert between the record store and the text files, then stop
+    if (convert != NULL && strcmp(convert, "import") == 0) {
+        exit(store_import() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    
+    // Open the record store (created, or imported from the text files, on the first start)
+    // and replay what the log has that it may lack
+    store_open();
+    storage_init();
+    index_init();
+    wal_open();
+    if (convert != NULL) {
+        exit(store_export() == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    wal_start();
+    
+    // Create admin user
+    create_admin_user();
+    
+    admission_init();
+    baseline_resident_kb = resident_kb();
+    print_socket_tuning();
+    
+    // A client that disappears mid-send must not kill the whole server
+    if (mode == MODE_REACTOR || mode == MODE_THREADS) {
+        signal(SIGPIPE, SIG_IGN);
+        
+        // SIGUSR1 prints statistics; no SA_RESTART so it wakes the event loop
+        sa.sa_handler = &handle_stats_request;
+        sa.sa_flags = 0;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+    
+    if (admin_path != NULL) {
+        admin_start();
+    }
+    
+    // A running server hands over its listening sockets instead of us binding new ones
+    handoff_take_over();
+    if (handoff_peer >= 0) {
+        index_bypass(drain_timeout + HANDOFF_ACK_TIMEOUT);
+    }
+    
+    if (mode == MODE_THREADS) {
+        run_threaded_reactors(num_workers);
+        return 0;
+    }
+    
+    // Setup server socket
+    fd = open_listen_socket(SERVER_PORT, 0);
+    int http_fd = (mode == MODE_REACTOR && http_port > 0) ? open_listen_socket(http_port, 0) : -1;
+    handoff_ready(mode == MODE_REACTOR);
+    
+    printf("Server started on port %d. Waiting for connections...\n", SERVER_PORT);
+    if (http_fd >= 0) {
+        printf("HTTP API on port %d\n", http_port);
+    }
+    
+    if (mode == MODE_FORK) {
+        run_fork_server(fd);
+    } else if (mode == MODE_PREFORK) {
+        run_prefork_server(fd, num_workers, max_workers);
+    } else {
+        run_reactor(fd, http_fd);
+    }
+    
     return 0;
 }
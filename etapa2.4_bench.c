@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SERVER_PORT     9000
+#define BUF_SIZE        4096
+#define PROMPT_END      "Enter your choice: "
+#define LOGIN_COMMAND   "LOGIN admin admin\n"
+
+//Loopback latency driver for the socket options of etapa2.4.c (-S)
+//Build:     gcc -O2 -Wall -pthread -o etapa2.4_bench etapa2.4_bench.c
+//Usage:     ./etapa2.4_bench -s ./server                   (each option on and off, one server per run)
+//           ./etapa2.4_bench -s ./server -o "cork nocork"  (only these -S values)
+//           ./etapa2.4_bench                               (measures a server that is already running)
+//Options:   -n prompts per connection (100)  -k connections per client (20)  -c concurrent clients (8)
+//           -m server mode passed with -m (reactor)
+//Each client alternates two kinds of connection:
+//  command: connect and send LOGIN at once, until the OK (connect latency; what defer and fastopen change)
+//  menu:    connect and wait for the menu (menu latency), then send an invalid choice n times and
+//           wait each time for the menu to come back (prompt latency)
+//The server is started with -r 0 -a 0 -c 0 so admission control stays out of the way.
+
+const char *host = "127.0.0.1";
+int prompts = 100;
+int connections = 20;
+int concurrency = 8;
+
+// Samples in microseconds, filled through an atomic index
+typedef struct {
+    double *values;
+    int count;
+    int capacity;
+} Samples;
+
+Samples connect_samples, menu_samples, prompt_samples;
+int failures;
+
+// Function prototypes
+double now_us(void);
+void add_sample(Samples *s, double value);
+int open_connection(int fastopen, const char *first, size_t first_len);
+int read_until(int fd, const char *end);
+int command_connection(void);
+int menu_connection(void);
+void *client_thread(void *arg);
+int compare_double(const void *a, const void *b);
+double percentile(Samples *s, double p);
+void run_benchmark(const char *label);
+pid_t start_server(const char *path, const char *mode, const char *options);
+void stop_server(pid_t pid);
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void add_sample(Samples *s, double value) {
+    int i = __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    if (i < s->capacity)
+        s->values[i] = value;
+}
+
+// Connect, handing the first request to the kernel so it may ride on the SYN (Fast Open)
+int open_connection(int fastopen, const char *first, size_t first_len) {
+    struct sockaddr_in addr;
+    int opt = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (fastopen)
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (first != NULL && send(fd, first, first_len, 0) != (ssize_t)first_len) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read until what arrived ends with end; 0 when it did
+int read_until(int fd, const char *end) {
+    char buffer[BUF_SIZE];
+    size_t end_len = strlen(end);
+    int got = 0, n;
+
+    while ((n = recv(fd, buffer + got, sizeof(buffer) - 1 - got, 0)) > 0) {
+        got += n;
+        buffer[got] = '\0';
+        if (got >= (int)end_len && strcmp(buffer + got - end_len, end) == 0)
+            return 0;
+        // Keep only a tail long enough to hold end
+        if (got > (int)(sizeof(buffer) / 2)) {
+            memmove(buffer, buffer + got - end_len, end_len);
+            got = end_len;
+        }
+    }
+    return -1;
+}
+
+int command_connection(void) {
+    double start = now_us();
+    int fd = open_connection(1, LOGIN_COMMAND, strlen(LOGIN_COMMAND));
+    if (fd < 0)
+        return -1;
+    int ret = read_until(fd, "\nOK\n");
+    if (ret == 0)
+        add_sample(&connect_samples, now_us() - start);
+    close(fd);
+    return ret;
+}
+
+int menu_connection(void) {
+    double start = now_us();
+    int fd = open_connection(0, NULL, 0);
+    if (fd < 0)
+        return -1;
+    if (read_until(fd, PROMPT_END) < 0) {
+        close(fd);
+        return -1;
+    }
+    add_sample(&menu_samples, now_us() - start);
+
+    for (int i = 0; i < prompts; i++) {
+        start = now_us();
+        if (send(fd, "9\n", 2, 0) != 2 || read_until(fd, PROMPT_END) < 0) {
+            close(fd);
+            return -1;
+        }
+        add_sample(&prompt_samples, now_us() - start);
+    }
+    close(fd);
+    return 0;
+}
+
+void *client_thread(void *arg) {
+    for (int i = 0; i < connections; i++) {
+        if (command_connection() < 0)
+            __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+        if (menu_connection() < 0)
+            __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The samples must be sorted
+double percentile(Samples *s, double p) {
+    int count = s->count < s->capacity ? s->count : s->capacity;
+    if (count == 0)
+        return -1;
+    int i = (int)(count * p);
+    return s->values[i < count ? i : count - 1];
+}
+
+void run_benchmark(const char *label) {
+    pthread_t threads[concurrency];
+
+    connect_samples.count = menu_samples.count = prompt_samples.count = 0;
+    failures = 0;
+
+    for (int i = 0; i < concurrency; i++)
+        pthread_create(&threads[i], NULL, client_thread, NULL);
+    for (int i = 0; i < concurrency; i++)
+        pthread_join(threads[i], NULL);
+
+    Samples *all[] = { &connect_samples, &menu_samples, &prompt_samples };
+    for (int i = 0; i < 3; i++) {
+        int count = all[i]->count < all[i]->capacity ? all[i]->count : all[i]->capacity;
+        qsort(all[i]->values, count, sizeof(double), compare_double);
+    }
+
+    printf("%-18s %9.0f %9.0f %9.0f %9.0f %9.1f %9.1f %7d\n", label,
+           percentile(&connect_samples, 0.5), percentile(&connect_samples, 0.99),
+           percentile(&menu_samples, 0.5), percentile(&menu_samples, 0.99),
+           percentile(&prompt_samples, 0.5), percentile(&prompt_samples, 0.99),
+           failures);
+    fflush(stdout);
+}
+
+// Start the server in its own process group and wait until it answers
+pid_t start_server(const char *path, const char *mode, const char *options) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error in fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        // The server has nothing to say during the measurement
+        freopen("/dev/null", "w", stdout);
+        execl(path, path, "-m", mode, "-r", "0", "-a", "0", "-c", "0", "-S", options, (char *)NULL);
+        perror("Error running the server");
+        _exit(EXIT_FAILURE);
+    }
+    setpgid(pid, pid);
+
+    for (int tries = 0; tries < 100; tries++) {
+        if (command_connection() == 0)
+            return pid;
+        usleep(50000);
+    }
+    fprintf(stderr, "Server (-S %s) did not start\n", options);
+    stop_server(pid);
+    exit(EXIT_FAILURE);
+}
+
+// Stop the server and every process it created (prefork/fork)
+void stop_server(pid_t pid) {
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    usleep(100000); // let the children go before the next bind
+}
+
+int main(int argc, char *argv[]) {
+    const char *server = NULL;
+    const char *mode = "reactor";
+    char options[BUF_SIZE] = "nodelay nonodelay cork nocork fastopen nofastopen defer nodefer busypoll=50 nobusypoll";
+    int c;
+
+    while ((c = getopt(argc, argv, "s:o:m:n:k:c:h:")) != -1) {
+        switch (c) {
+            case 's': server = optarg; break;
+            case 'o': snprintf(options, sizeof(options), "%s", optarg); break;
+            case 'm': mode = optarg; break;
+            case 'n': prompts = atoi(optarg); break;
+            case 'k': connections = atoi(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'h': host = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-s ./server] [-o \"cork nocork ...\"] [-m mode] [-n prompts] [-k connections] [-c clients] [-h host]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (prompts <= 0 || connections <= 0 || concurrency <= 0) {
+        fprintf(stderr, "-n, -k and -c must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Samples *all[] = { &connect_samples, &menu_samples, &prompt_samples };
+    int capacity[] = { concurrency * connections, concurrency * connections, concurrency * connections * prompts };
+    for (int i = 0; i < 3; i++) {
+        all[i]->capacity = capacity[i];
+        all[i]->values = malloc(capacity[i] * sizeof(double));
+        if (all[i]->values == NULL) {
+            perror("Error in malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%d clients x %d connections, %d prompts each; latencies in microseconds\n",
+           concurrency, connections, prompts);
+    printf("%-18s %9s %9s %9s %9s %9s %9s %7s\n", "-S", "conn p50", "conn p99",
+           "menu p50", "menu p99", "prm p50", "prm p99", "fails");
+
+    if (server == NULL) {
+        run_benchmark("running server");
+    } else {
+        char *saveptr;
+        for (char *set = strtok_r(options, " ", &saveptr); set; set = strtok_r(NULL, " ", &saveptr)) {
+            pid_t pid = start_server(server, mode, set);
+            run_benchmark(set);
+            stop_server(pid);
+        }
+    }
+
+    for (int i = 0; i < 3; i++)
+        free(all[i]->values);
+    return 0;
+}
@@ -0,0 +1,664 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "etapa2.4_client.h"
+
+//Client library for the binary protocol of etapa2.4.c; usage in etapa2.4_client.h
+
+#define BINARY_MAGIC     "\0ENG"
+#define BINARY_MAGIC_LEN 4
+#define BINARY_VERSION   1
+#define BIN_LOGIN        1
+#define BIN_QUIT         9
+#define MAX_NAME         255
+#define READ_CHUNK       65536
+#define MAX_EVENTS       64
+
+// A request sent and not answered yet
+typedef struct {
+    int type;
+    EngCallback callback;
+    void *arg;
+} Request;
+
+typedef struct {
+    int fd;                  // -1 once broken
+    int watching_output;     // registered for EPOLLOUT: output is waiting
+    char *out;               // requests not written yet
+    size_t out_len, out_sent, out_cap;
+    char *in;                // responses read, up to the last complete frame
+    size_t in_len, in_cap;
+    Request *queue;          // ring of requests in the order they were sent
+    int head, count, queue_cap;
+} Connection;
+
+struct EngPool {
+    Connection *connections;
+    int count;
+    int epfd;
+    int dispatching;         // inside a callback: don't do I/O from an eng_* call
+    EngRecord *records;      // records of the response being delivered
+    int records_cap;
+};
+
+// Bytes of a response, consumed from the front
+typedef struct {
+    const char *p;
+    size_t left;
+    int bad;
+} Reader;
+
+// Function prototypes
+static int grow(char **data, size_t *cap, size_t need);
+static void put_bytes(Connection *c, const void *data, size_t len);
+static void put_u8(Connection *c, int value);
+static void put_str(Connection *c, const char *str);
+static void begin_frame(Connection *c, int type, size_t *at);
+static void end_frame(Connection *c, size_t at);
+static int read_u8(Reader *r);
+static int read_u16(Reader *r);
+static const char *read_str(Reader *r);
+static int set_nonblocking(int fd);
+static int open_connection(const char *host, int port);
+static int handshake(int fd, const char *username, const char *password);
+static int conn_watch(EngPool *pool, Connection *c, int want_output);
+static void conn_break(EngPool *pool, Connection *c);
+static int conn_flush(EngPool *pool, Connection *c);
+static int conn_read(EngPool *pool, Connection *c);
+static int deliver(EngPool *pool, Connection *c, const char *frame, size_t len);
+static Connection *pick_connection(EngPool *pool);
+static int submit(EngPool *pool, int type, const char *username, EngCallback callback, void *arg);
+
+static int grow(char **data, size_t *cap, size_t need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < need)
+        new_cap *= 2;
+    char *grown = realloc(*data, new_cap);
+    if (grown == NULL) {
+        return -1;
+    }
+    *data = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+// Requests are small and the pool can't go on without memory: give up loudly
+static void put_bytes(Connection *c, const void *data, size_t len) {
+    if (grow(&c->out, &c->out_cap, c->out_len + len) < 0) {
+        perror("eng: out of memory");
+        abort();
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+static void put_u8(Connection *c, int value) {
+    unsigned char byte = value;
+    put_bytes(c, &byte, 1);
+}
+
+// u16 length, the bytes and their NUL
+static void put_str(Connection *c, const char *str) {
+    size_t len = strlen(str);
+    uint16_t net = htons(len);
+    put_bytes(c, &net, 2);
+    put_bytes(c, str, len + 1);
+}
+
+// Room for the length, then the type; end_frame() fills the length in
+static void begin_frame(Connection *c, int type, size_t *at) {
+    *at = c->out_len;
+    put_bytes(c, "\0\0\0\0", 4);
+    put_u8(c, type);
+}
+
+static void end_frame(Connection *c, size_t at) {
+    uint32_t net = htonl(c->out_len - at - 4);
+    memcpy(c->out + at, &net, 4);
+}
+
+static int read_u8(Reader *r) {
+    if (r->left < 1) {
+        r->bad = 1;
+        return 0;
+    }
+    r->left--;
+    return (unsigned char)*r->p++;
+}
+
+static int read_u16(Reader *r) {
+    int high = read_u8(r);
+    return (high << 8) | read_u8(r);
+}
+
+// Strings keep their NUL on the wire: they are used where they lie
+static const char *read_str(Reader *r) {
+    size_t len = read_u16(r);
+    if (r->bad || r->left < len + 1 || r->p[len] != '\0') {
+        r->bad = 1;
+        return "";
+    }
+    const char *str = r->p;
+    r->p += len + 1;
+    r->left -= len + 1;
+    return str;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int open_connection(const char *host, int port) {
+    struct addrinfo hints, *list;
+    char service[16];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &list) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (struct addrinfo *ai = list; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(list);
+
+    if (fd >= 0) {
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    return fd;
+}
+
+// Blocking: the hello and the LOGIN leave together; the server's banner is
+// skipped up to its hello, then the LOGIN response is read. 0 once logged in.
+static int handshake(int fd, const char *username, const char *password) {
+    Connection c;
+    char hello[BINARY_MAGIC_LEN + 1];
+    size_t at;
+
+    memset(&c, 0, sizeof(c));
+    memcpy(hello, BINARY_MAGIC, BINARY_MAGIC_LEN);
+    hello[BINARY_MAGIC_LEN] = BINARY_VERSION;
+    put_bytes(&c, hello, sizeof(hello));
+    begin_frame(&c, BIN_LOGIN, &at);
+    put_str(&c, username);
+    put_str(&c, password);
+    end_frame(&c, at);
+
+    ssize_t n = send(fd, c.out, c.out_len, MSG_NOSIGNAL);
+    free(c.out);
+    if (n != (ssize_t)c.out_len) {
+        return -1;
+    }
+
+    // Everything up to the end of the LOGIN response
+    char buffer[8192];
+    size_t got = 0, start = 0;
+    int found_hello = 0;
+    while (1) {
+        if (got == sizeof(buffer)) {
+            errno = EPROTO;
+            return -1;
+        }
+        n = recv(fd, buffer + got, sizeof(buffer) - got, 0);
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        got += n;
+
+        if (!found_hello) {
+            for (size_t i = 0; i + sizeof(hello) <= got; i++) {
+                if (memcmp(buffer + i, hello, sizeof(hello)) == 0) {
+                    found_hello = 1;
+                    start = i + sizeof(hello);
+                    break;
+                }
+            }
+            if (!found_hello)
+                continue;
+        }
+        if (got - start < 4)
+            continue;
+        uint32_t len;
+        memcpy(&len, buffer + start, 4);
+        len = ntohl(len);
+        if (len < 2 || len > sizeof(buffer) - 4) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (got - start - 4 < len)
+            continue;
+
+        // type, status, message, u8 user_type
+        if ((unsigned char)buffer[start + 4] != BIN_LOGIN) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (buffer[start + 5] != ENG_OK) {
+            errno = EACCES;
+            return -1;
+        }
+        if (got - start - 4 > len) {
+            errno = EPROTO;  // nothing else was asked
+            return -1;
+        }
+        return 0;
+    }
+}
+
+EngPool *eng_connect(const char *host, int port, int connections, const char *username, const char *password) {
+    if (connections <= 0 || connections > ENG_MAX_CONNECTIONS ||
+        strlen(username) > MAX_NAME || strlen(password) > MAX_NAME) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    EngPool *pool = calloc(1, sizeof(EngPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->connections = calloc(connections, sizeof(Connection));
+    pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->connections == NULL || pool->epfd < 0) {
+        int saved = errno;
+        free(pool->connections);
+        if (pool->epfd >= 0)
+            close(pool->epfd);
+        free(pool);
+        errno = saved;
+        return NULL;
+    }
+
+    for (int i = 0; i < connections; i++) {
+        Connection *c = &pool->connections[i];
+        c->fd = open_connection(host, port);
+        pool->count++;
+        if (c->fd < 0 || handshake(c->fd, username, password) < 0 || set_nonblocking(c->fd) < 0) {
+            int saved = errno;
+            eng_close(pool);
+            errno = saved;
+            return NULL;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(pool->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+            int saved = errno;
+            eng_close(pool);
+            errno = saved;
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void eng_close(EngPool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    for (int i = 0; i < pool->count; i++) {
+        Connection *c = &pool->connections[i];
+        if (c->fd >= 0) {
+            // Say goodbye if the socket takes it at once; the server logs us out either way
+            size_t at;
+            begin_frame(c, BIN_QUIT, &at);
+            end_frame(c, at);
+            conn_flush(pool, c);
+        }
+        conn_break(pool, c);
+        free(c->out);
+        free(c->in);
+        free(c->queue);
+    }
+    close(pool->epfd);
+    free(pool->records);
+    free(pool->connections);
+    free(pool);
+}
+
+// Wait for the socket to take more (want_output) or for responses only
+static int conn_watch(EngPool *pool, Connection *c, int want_output) {
+    if (c->watching_output == want_output) {
+        return 0;
+    }
+    struct epoll_event ev;
+    ev.events = want_output ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(pool->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        return -1;
+    }
+    c->watching_output = want_output;
+    return 0;
+}
+
+// The connection is gone: every request still waiting on it fails
+static void conn_break(EngPool *pool, Connection *c) {
+    if (c->fd >= 0) {
+        close(c->fd);  // also takes it out of the epoll set
+        c->fd = -1;
+    }
+    c->out_len = c->out_sent = 0;
+    c->in_len = 0;
+
+    EngResult result = { .status = ENG_DISCONNECTED, .message = "Connection lost.\n" };
+    pool->dispatching++;
+    while (c->count > 0) {
+        Request *req = &c->queue[c->head];
+        c->head = (c->head + 1) % c->queue_cap;
+        c->count--;
+        result.request = req->type;
+        if (req->callback != NULL)
+            req->callback(req->arg, &result);
+    }
+    pool->dispatching--;
+}
+
+// Write what is queued; waits for EPOLLOUT when the socket is full. -1 if it broke
+static int conn_flush(EngPool *pool, Connection *c) {
+    while (c->fd >= 0 && c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return conn_watch(pool, c, 1);
+            conn_break(pool, c);
+            return -1;
+        }
+        c->out_sent += n;
+    }
+    if (c->fd < 0) {
+        return -1;
+    }
+    c->out_len = c->out_sent = 0;
+    return conn_watch(pool, c, 0);
+}
+
+// Read everything available and deliver each complete response; returns how many, -1 if it broke
+static int conn_read(EngPool *pool, Connection *c) {
+    int delivered = 0;
+
+    while (c->fd >= 0) {
+        if (grow(&c->in, &c->in_cap, c->in_len + READ_CHUNK) < 0) {
+            conn_break(pool, c);
+            return -1;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            conn_break(pool, c);
+            return -1;
+        }
+        c->in_len += n;
+
+        size_t used = 0;
+        while (c->in_len - used >= 4) {
+            uint32_t len;
+            memcpy(&len, c->in + used, 4);
+            len = ntohl(len);
+            if (c->in_len - used - 4 < len)
+                break;
+            if (deliver(pool, c, c->in + used + 4, len) < 0) {
+                conn_break(pool, c);
+                return -1;
+            }
+            delivered++;
+            used += 4 + len;
+            if (c->fd < 0) {
+                return delivered;  // a callback's request broke it
+            }
+        }
+        memmove(c->in, c->in + used, c->in_len - used);
+        c->in_len -= used;
+    }
+    return delivered;
+}
+
+// Decode one response and run the callback of the oldest request
+static int deliver(EngPool *pool, Connection *c, const char *frame, size_t len) {
+    Reader r = { frame, len, 0 };
+    EngResult result;
+    int count = 0;
+
+    if (c->count == 0) {
+        return -1;  // nothing was asked
+    }
+    Request req = c->queue[c->head];
+    result.request = read_u8(&r);
+    result.status = read_u8(&r);
+    result.message = read_str(&r);
+    if (r.bad || result.request != req.type) {
+        return -1;
+    }
+
+    if (result.status == ENG_OK) {
+        if (req.type == ENG_REQ_VIEW_PROFILE) {
+            count = 1;
+        } else if (req.type == ENG_REQ_LIST_ENGINEERS || req.type == ENG_REQ_LIST_ORGANIZATIONS ||
+                   req.type == ENG_REQ_LIST_PENDING) {
+            count = read_u16(&r);
+        }
+        if (count > pool->records_cap) {
+            EngRecord *grown = realloc(pool->records, count * sizeof(EngRecord));
+            if (grown == NULL)
+                return -1;
+            pool->records = grown;
+            pool->records_cap = count;
+        }
+    }
+
+    for (int i = 0; i < count && !r.bad; i++) {
+        EngRecord *rec = &pool->records[i];
+        memset(rec, 0, sizeof(*rec));
+        if (req.type == ENG_REQ_VIEW_PROFILE) {
+            // u8 user_type, str username, u8 n, n x str
+            rec->user_type = read_u8(&r);
+            rec->username = read_str(&r);
+            rec->field_count = read_u8(&r);
+            if (rec->field_count > 4)
+                r.bad = 1;
+            for (int f = 0; f < rec->field_count && !r.bad; f++)
+                rec->fields[f] = read_str(&r);
+        } else if (req.type == ENG_REQ_LIST_PENDING) {
+            rec->username = read_str(&r);
+            rec->user_type = read_u8(&r);
+        } else {
+            // str username, two profile fields, u8 online
+            rec->username = read_str(&r);
+            rec->fields[0] = read_str(&r);
+            rec->fields[1] = read_str(&r);
+            rec->field_count = 2;
+            rec->online = read_u8(&r);
+            rec->user_type = (req.type == ENG_REQ_LIST_ENGINEERS) ? ENG_ENGINEER : ENG_ORGANIZATION;
+        }
+    }
+    if (r.bad) {
+        return -1;
+    }
+    result.count = count;
+    result.records = pool->records;
+
+    c->head = (c->head + 1) % c->queue_cap;
+    c->count--;
+    if (req.callback != NULL) {
+        pool->dispatching++;
+        req.callback(req.arg, &result);
+        pool->dispatching--;
+    }
+    return 0;
+}
+
+// The open connection with the fewest requests waiting
+static Connection *pick_connection(EngPool *pool) {
+    Connection *best = NULL;
+    for (int i = 0; i < pool->count; i++) {
+        Connection *c = &pool->connections[i];
+        if (c->fd >= 0 && (best == NULL || c->count < best->count))
+            best = c;
+    }
+    return best;
+}
+
+static int submit(EngPool *pool, int type, const char *username, EngCallback callback, void *arg) {
+    if (username != NULL && strlen(username) > MAX_NAME) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    Connection *c = pick_connection(pool);
+    // Every connection has ENG_MAX_INFLIGHT waiting: let responses come back first
+    while (c != NULL && c->count >= ENG_MAX_INFLIGHT && !pool->dispatching) {
+        if (eng_process(pool, -1) < 0)
+            return -1;
+        c = pick_connection(pool);
+    }
+    if (c == NULL) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    if (c->count == c->queue_cap) {
+        int cap = c->queue_cap ? c->queue_cap * 2 : 64;
+        Request *grown = malloc(cap * sizeof(Request));
+        if (grown == NULL)
+            return -1;
+        for (int i = 0; i < c->count; i++)
+            grown[i] = c->queue[(c->head + i) % c->queue_cap];
+        free(c->queue);
+        c->queue = grown;
+        c->queue_cap = cap;
+        c->head = 0;
+    }
+    Request *req = &c->queue[(c->head + c->count) % c->queue_cap];
+    req->type = type;
+    req->callback = callback;
+    req->arg = arg;
+    c->count++;
+
+    size_t at;
+    begin_frame(c, type, &at);
+    if (username != NULL)
+        put_str(c, username);
+    end_frame(c, at);
+
+    // A big batch goes out as it grows. Otherwise waiting for EPOLLOUT makes
+    // the epoll fd readable, so the caller's event loop comes back to send it
+    if (c->out_len - c->out_sent >= READ_CHUNK) {
+        conn_flush(pool, c);  // if it broke, the callbacks already heard
+    } else {
+        conn_watch(pool, c, 1);
+    }
+    return 0;
+}
+
+int eng_view_profile(EngPool *pool, EngCallback callback, void *arg) {
+    return submit(pool, ENG_REQ_VIEW_PROFILE, NULL, callback, arg);
+}
+
+int eng_list_engineers(EngPool *pool, EngCallback callback, void *arg) {
+    return submit(pool, ENG_REQ_LIST_ENGINEERS, NULL, callback, arg);
+}
+
+int eng_list_organizations(EngPool *pool, EngCallback callback, void *arg) {
+    return submit(pool, ENG_REQ_LIST_ORGANIZATIONS, NULL, callback, arg);
+}
+
+int eng_list_pending(EngPool *pool, EngCallback callback, void *arg) {
+    return submit(pool, ENG_REQ_LIST_PENDING, NULL, callback, arg);
+}
+
+int eng_approve(EngPool *pool, const char *username, EngCallback callback, void *arg) {
+    return submit(pool, ENG_REQ_APPROVE, username, callback, arg);
+}
+
+int eng_delete(EngPool *pool, const char *username, EngCallback callback, void *arg) {
+    return submit(pool, ENG_REQ_DELETE, username, callback, arg);
+}
+
+int eng_fd(EngPool *pool) {
+    return pool->epfd;
+}
+
+int eng_process(EngPool *pool, int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int delivered = 0;
+
+    if (pool->dispatching) {
+        errno = EDEADLK;  // a callback can queue requests, not wait for them
+        return -1;
+    }
+
+    // Write first: most of what there is to read is the answer to it
+    for (int i = 0; i < pool->count; i++) {
+        Connection *c = &pool->connections[i];
+        if (c->fd >= 0 && c->out_sent < c->out_len)
+            conn_flush(pool, c);
+    }
+    if (eng_pending(pool) == 0 && timeout_ms < 0) {
+        timeout_ms = 0;  // nothing will arrive
+    }
+
+    int n = epoll_wait(pool->epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        Connection *c = events[i].data.ptr;
+        if (events[i].events & EPOLLOUT)
+            conn_flush(pool, c);
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            int got = conn_read(pool, c);
+            if (got > 0)
+                delivered += got;
+        }
+    }
+    return delivered;
+}
+
+int eng_wait(EngPool *pool) {
+    while (eng_pending(pool) > 0) {
+        if (eng_process(pool, -1) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int eng_pending(EngPool *pool) {
+    int pending = 0;
+    for (int i = 0; i < pool->count; i++)
+        pending += pool->connections[i].count;
+    return pending;
+}
@@ -0,0 +1,100 @@
+#ifndef ETAPA2_4_CLIENT_H
+#define ETAPA2_4_CLIENT_H
+
+//Client library for the binary protocol of etapa2.4.c (see its Binary protocol section)
+//Build:     gcc -O2 -Wall -c etapa2.4_client.c && ar rcs libengclient.a etapa2.4_client.o   (static)
+//           gcc -O2 -Wall -fPIC -shared -o libengclient.so etapa2.4_client.c             (shared)
+//Link:      gcc -O2 -Wall -o job job.c libengclient.a   (or -L. -lengclient)
+//
+//A pool opens a few connections and logs in once on each. Requests are only
+//queued by the eng_* calls: they leave pipelined, many per write(), the next
+//time the pool does I/O, and every connection answers its requests in order.
+//Completions are delivered by calling the request's callback from
+//eng_process(). A program with its own event loop polls eng_fd() for
+//readability and calls eng_process(pool, 0) when it is readable.
+//
+//    EngPool *pool = eng_connect("127.0.0.1", 9000, 4, "admin", "admin");
+//    for (int i = 0; i < count; i++)
+//        eng_approve(pool, names[i], approved, NULL);
+//    eng_wait(pool);     // runs approved() once per request
+//    eng_close(pool);
+//
+//A pool belongs to one thread at a time. It keeps at most ENG_MAX_INFLIGHT
+//requests unanswered per connection; past that, eng_* calls do I/O themselves
+//until there is room again, so a batch job can't outrun the server.
+
+#define ENG_MAX_CONNECTIONS 64
+#define ENG_MAX_INFLIGHT    1024  // unanswered requests per connection
+
+// Statuses; the first four are the server's
+enum {
+    ENG_OK = 0,
+    ENG_FAILED,          // refused: message says why
+    ENG_BAD_REQUEST,
+    ENG_DENIED,          // not allowed for the logged in user
+    ENG_DISCONNECTED     // the connection broke before the response arrived
+};
+
+// User types
+enum {
+    ENG_ENGINEER = 1,
+    ENG_ORGANIZATION = 2,
+    ENG_ADMIN = 3
+};
+
+// One user of a list, or the profile of VIEW_PROFILE
+typedef struct {
+    const char *username;
+    const char *fields[4];   // profile fields after the username, in file order
+    int field_count;
+    int online;              // lists of engineers and organizations
+    int user_type;           // pending users and profiles
+} EngRecord;
+
+// Everything points into the pool's buffers: valid only during the callback
+typedef struct {
+    int request;             // which eng_* call this answers (ENG_REQ_*)
+    int status;
+    const char *message;     // what the menus would have shown, may be ""
+    int count;
+    const EngRecord *records;
+} EngResult;
+
+enum {
+    ENG_REQ_VIEW_PROFILE = 4,
+    ENG_REQ_LIST_ENGINEERS,
+    ENG_REQ_LIST_ORGANIZATIONS,
+    ENG_REQ_LIST_PENDING,
+    ENG_REQ_APPROVE,
+    ENG_REQ_DELETE = 10
+};
+
+typedef struct EngPool EngPool;
+typedef void (*EngCallback)(void *arg, const EngResult *result);
+
+// Open connections to host:port and log in as username on each; NULL with
+// errno set when a connection can't be opened or the login is refused
+EngPool *eng_connect(const char *host, int port, int connections, const char *username, const char *password);
+// Log out and close every connection; requests still waiting get ENG_DISCONNECTED
+void eng_close(EngPool *pool);
+
+// Queue a request; callback may be NULL. 0, or -1 with errno set (ENOTCONN
+// once every connection broke, EINVAL for a name too long to send)
+int eng_view_profile(EngPool *pool, EngCallback callback, void *arg);
+int eng_list_engineers(EngPool *pool, EngCallback callback, void *arg);
+int eng_list_organizations(EngPool *pool, EngCallback callback, void *arg);
+int eng_list_pending(EngPool *pool, EngCallback callback, void *arg);
+int eng_approve(EngPool *pool, const char *username, EngCallback callback, void *arg);
+int eng_delete(EngPool *pool, const char *username, EngCallback callback, void *arg);
+
+// Readable when eng_process() has something to do
+int eng_fd(EngPool *pool);
+// Send what is queued and run the callbacks of the responses that arrived,
+// waiting up to timeout_ms (-1: until one does). Returns how many completed, -1 on error
+int eng_process(EngPool *pool, int timeout_ms);
+// eng_process() until no request is left unanswered; -1 on error
+int eng_wait(EngPool *pool);
+// Requests not answered yet
+int eng_pending(EngPool *pool);
+
+#endif
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SERVER_PORT     9000
+#define BUF_SIZE        4096
+
+//Login latency against the number of accounts, for the credentials index of etapa2.4.c
+//Build:     gcc -O2 -Wall -pthread -o etapa2.4_login_bench etapa2.4_login_bench.c
+//Usage:     ./etapa2.4_login_bench -s ./server                        (1k, 10k, 100k and 1M accounts)
+//           ./etapa2.4_login_bench -s ./server -u "1000 50000" -n 100  (only these account counts)
+//Options:   -n logins per client (500)  -c concurrent clients (8)  -m server mode passed with -m (reactor)
+//For each account count the accounts are written to credentials.txt in a new directory under /tmp
+//(the server imports them into its record store when it starts) and a server is started there with -r 0 -a 0 -c 0 so admission control stays out of the way.
+//Each client keeps one connection in command mode and sends "LOGIN userN passN" for random
+//accounts, then LOGOUT; a login is timed from the LOGIN until its OK. With the index, the
+//latency should not grow with the number of accounts; a server that scans the files
+//grows linearly (run it with a smaller -n).
+
+const char *host = "127.0.0.1";
+int logins = 500;
+int concurrency = 8;
+long accounts;
+
+// Samples in microseconds, filled through an atomic index
+typedef struct {
+    double *values;
+    int count;
+    int capacity;
+} Samples;
+
+Samples login_samples;
+int failures;
+
+// Function prototypes
+double now_us(void);
+void add_sample(Samples *s, double value);
+int open_connection(void);
+int read_until(int fd, const char *end);
+int login(int fd, long account);
+void *client_thread(void *arg);
+int compare_double(const void *a, const void *b);
+double percentile(Samples *s, double p);
+void run_benchmark(long count);
+int write_accounts(const char *dir, long count);
+void remove_accounts(const char *dir);
+pid_t start_server(const char *path, const char *mode, const char *dir);
+void stop_server(pid_t pid);
+
+double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void add_sample(Samples *s, double value) {
+    int i = __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    if (i < s->capacity)
+        s->values[i] = value;
+}
+
+int open_connection(void) {
+    struct sockaddr_in addr;
+    int opt = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SERVER_PORT);
+    inet_pton(AF_INET, host, &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read until what arrived ends with end; 0 when it did
+int read_until(int fd, const char *end) {
+    char buffer[BUF_SIZE];
+    size_t end_len = strlen(end);
+    int got = 0, n;
+
+    while ((n = recv(fd, buffer + got, sizeof(buffer) - 1 - got, 0)) > 0) {
+        got += n;
+        buffer[got] = '\0';
+        if (got >= (int)end_len && strcmp(buffer + got - end_len, end) == 0)
+            return 0;
+        // Any other answer to a command ends in ERR
+        if (got >= 4 && strcmp(buffer + got - 4, "ERR\n") == 0)
+            return -1;
+        // Keep only a tail long enough to hold end
+        if (got > (int)(sizeof(buffer) / 2)) {
+            memmove(buffer, buffer + got - end_len, end_len);
+            got = end_len;
+        }
+    }
+    return -1;
+}
+
+// Log in as account and back out; 0 when both were accepted
+int login(int fd, long account) {
+    char command[128];
+    int len = snprintf(command, sizeof(command), "LOGIN user%ld pass%ld\n", account, account);
+
+    double start = now_us();
+    if (send(fd, command, len, 0) != len || read_until(fd, "\nOK\n") < 0)
+        return -1;
+    add_sample(&login_samples, now_us() - start);
+    if (send(fd, "LOGOUT\n", 7, 0) != 7 || read_until(fd, "\nOK\n") < 0)
+        return -1;
+    return 0;
+}
+
+void *client_thread(void *arg) {
+    unsigned int seed = (unsigned int)(long)arg * 2654435761u;
+    int fd = open_connection();
+
+    if (fd < 0) {
+        __atomic_fetch_add(&failures, logins, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    for (int i = 0; i < logins; i++) {
+        long account = ((long)rand_r(&seed) * RAND_MAX + rand_r(&seed)) % accounts;
+        if (login(fd, account) < 0) {
+            __atomic_fetch_add(&failures, logins - i, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The samples must be sorted
+double percentile(Samples *s, double p) {
+    int count = s->count < s->capacity ? s->count : s->capacity;
+    if (count == 0)
+        return -1;
+    int i = (int)(count * p);
+    return s->values[i < count ? i : count - 1];
+}
+
+void run_benchmark(long count) {
+    pthread_t threads[concurrency];
+
+    accounts = count;
+    login_samples.count = 0;
+    failures = 0;
+
+    double start = now_us();
+    for (long i = 0; i < concurrency; i++)
+        pthread_create(&threads[i], NULL, client_thread, (void *)(i + 1));
+    for (int i = 0; i < concurrency; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    int done = login_samples.count < login_samples.capacity ? login_samples.count : login_samples.capacity;
+    qsort(login_samples.values, done, sizeof(double), compare_double);
+
+    printf("%10ld %10.0f %9.1f %9.1f %9.1f %7d\n", count, done / elapsed,
+           percentile(&login_samples, 0.5), percentile(&login_samples, 0.99),
+           percentile(&login_samples, 1.0), failures);
+    fflush(stdout);
+}
+
+// credentials.txt with count engineers userN/passN, the other data files empty
+int write_accounts(const char *dir, long count) {
+    const char *empty[] = { "pending.txt", "engineers.txt", "organizations.txt" };
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/credentials.txt", dir);
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+    fprintf(file, "admin admin 3\n");
+    for (long i = 0; i < count; i++)
+        fprintf(file, "user%ld pass%ld 1\n", i, i);
+    if (fclose(file) != 0)
+        return -1;
+
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, empty[i]);
+        if ((file = fopen(path, "w")) == NULL)
+            return -1;
+        fclose(file);
+    }
+    return 0;
+}
+
+void remove_accounts(const char *dir) {
+    const char *files[] = { "credentials.txt", "pending.txt", "engineers.txt", "organizations.txt",
+                            "accounts.db", "profiles.db", "accounts.wal" };
+    char path[PATH_MAX];
+
+    for (int i = 0; i < 7; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    if (rmdir(dir) < 0)
+        fprintf(stderr, "Could not remove %s: %s\n", dir, strerror(errno));
+}
+
+// Start the server in dir, in its own process group, and wait until it answers
+pid_t start_server(const char *path, const char *mode, const char *dir) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error in fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        if (chdir(dir) < 0) {
+            perror("Error entering the accounts directory");
+            _exit(EXIT_FAILURE);
+        }
+        // The server has nothing to say during the measurement
+        freopen("/dev/null", "w", stdout);
+        execl(path, path, "-m", mode, "-r", "0", "-a", "0", "-c", "0", (char *)NULL);
+        perror("Error running the server");
+        _exit(EXIT_FAILURE);
+    }
+    setpgid(pid, pid);
+
+    // Loading a million accounts takes a moment
+    for (int tries = 0; tries < 600; tries++) {
+        int fd = open_connection();
+        if (fd >= 0) {
+            int ret = login(fd, 0);
+            close(fd);
+            if (ret == 0)
+                return pid;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "Server (%s) did not start\n", dir);
+    stop_server(pid);
+    exit(EXIT_FAILURE);
+}
+
+// Stop the server and every process it created (prefork/fork)
+void stop_server(pid_t pid) {
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    usleep(100000); // let the children go before the next bind
+}
+
+int main(int argc, char *argv[]) {
+    const char *server = NULL;
+    const char *mode = "reactor";
+    char counts[BUF_SIZE] = "1000 10000 100000 1000000";
+    char server_path[PATH_MAX];
+    int c;
+
+    while ((c = getopt(argc, argv, "s:u:m:n:c:h:")) != -1) {
+        switch (c) {
+            case 's': server = optarg; break;
+            case 'u': snprintf(counts, sizeof(counts), "%s", optarg); break;
+            case 'm': mode = optarg; break;
+            case 'n': logins = atoi(optarg); break;
+            case 'c': concurrency = atoi(optarg); break;
+            case 'h': host = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s -s ./server [-u \"1000 10000 ...\"] [-m mode] [-n logins] [-c clients] [-h host]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (server == NULL) {
+        fprintf(stderr, "-s is required: each account count needs a server of its own\n");
+        exit(EXIT_FAILURE);
+    }
+    if (logins <= 0 || concurrency <= 0) {
+        fprintf(stderr, "-n and -c must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    // The server runs in another directory
+    if (realpath(server, server_path) == NULL) {
+        fprintf(stderr, "Server %s: %s\n", server, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    login_samples.capacity = concurrency * logins;
+    login_samples.values = malloc(login_samples.capacity * sizeof(double));
+    if (login_samples.values == NULL) {
+        perror("Error in malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%d clients x %d logins of random accounts; latencies in microseconds\n", concurrency, logins);
+    printf("%10s %10s %9s %9s %9s %7s\n", "accounts", "logins/s", "p50", "p99", "max", "fails");
+
+    char *saveptr;
+    for (char *word = strtok_r(counts, " ", &saveptr); word; word = strtok_r(NULL, " ", &saveptr)) {
+        long count = atol(word);
+        if (count <= 0) {
+            fprintf(stderr, "Invalid account count '%s'\n", word);
+            continue;
+        }
+
+        char dir[] = "/tmp/login_bench.XXXXXX";
+        if (mkdtemp(dir) == NULL) {
+            perror("Error creating the accounts directory");
+            exit(EXIT_FAILURE);
+        }
+        if (write_accounts(dir, count) < 0) {
+            perror("Error writing the accounts");
+            remove_accounts(dir);
+            exit(EXIT_FAILURE);
+        }
+        pid_t pid = start_server(server_path, mode, dir);
+        run_benchmark(count);
+        stop_server(pid);
+        remove_accounts(dir);
+    }
+
+    free(login_samples.values);
+    return 0;
+}